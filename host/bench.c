@@ -0,0 +1,333 @@
+/*
+ * Host microbenchmarks for the physical memory manager and the DTB parser.
+ *
+ *     bench [dtb...]
+ *
+ * The PMM runs on a block of host memory posing as RAM. Every DTB given is
+ * parsed repeatedly, see host-bench in the Makefile for the blobs it uses.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "device/dtb.h"
+#include "memory/early.h"
+#include "memory/physical.h"
+
+#define RAM_SIZE     (256UL << 20)
+#define RAM_ALIGN    (2UL << 20)
+#define FIRMWARE_SIZE 0x40000         // Reserved at the bottom, like OpenSBI
+
+#define ORDER_BATCH  4096             // Blocks held at once per round
+#define ORDER_ROUNDS 64
+#define RANDOM_OPS   1000000
+#define DTB_MIN_NS   500000000ULL     // Keep parsing a blob for at least this long
+
+static char* ram;
+static mem_region_t ram_region;
+static mem_region_t firmware_region;
+
+/* xorshift64, reproducible across runs */
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t random_next(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/* A fresh PMM over the fake RAM, returns the time phys_init took */
+static uint64_t pmm_boot(void)
+{
+    boot_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    info.core_count = 1;
+    info.memory_regions = &ram_region;
+    info.memory_region_count = 1;
+    info.reserved_regions = &firmware_region;
+    info.reserved_region_count = 1;
+
+    early_init(0, 0);
+
+    uint64_t start = host_time_ns();
+    if(!phys_init(&info))
+    {
+        fprintf(stderr, "phys_init failed\n");
+        exit(1);
+    }
+
+    return host_time_ns() - start;
+}
+
+static void bench_phys_init(void)
+{
+    uint64_t best = ~0ULL;
+    uint64_t total = 0;
+    const int runs = 20;
+
+    for(int i = 0; i < runs; i++)
+    {
+        uint64_t ns = pmm_boot();
+        total += ns;
+        best = ns < best ? ns : best;
+    }
+
+    printf("phys_init, %lu MiB: best %.1f us, avg %.1f us\n",
+           RAM_SIZE >> 20, best / 1000.0, total / runs / 1000.0);
+}
+
+static void bench_orders(void)
+{
+    static void* blocks[ORDER_BATCH];
+
+    printf("\n%-6s %12s %12s %12s\n", "order", "alloc ns", "free ns", "pairs ns");
+
+    for(int order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        size_t size = (size_t)PAGE_SIZE << order;
+        int batch = ORDER_BATCH;
+
+        // The largest orders would not fit ORDER_BATCH times
+        if((size_t)batch * size > RAM_SIZE / 2)
+            batch = RAM_SIZE / 2 / size;
+
+        pmm_boot();
+
+        uint64_t alloc_ns = 0;
+        uint64_t free_ns = 0;
+
+        for(int round = 0; round < ORDER_ROUNDS; round++)
+        {
+            uint64_t start = host_time_ns();
+            for(int i = 0; i < batch; i++)
+                blocks[i] = phys_alloc(size);
+            alloc_ns += host_time_ns() - start;
+
+            for(int i = 0; i < batch; i++)
+            {
+                if(!blocks[i])
+                {
+                    fprintf(stderr, "order %d: out of memory\n", order);
+                    exit(1);
+                }
+            }
+
+            start = host_time_ns();
+            for(int i = 0; i < batch; i++)
+                phys_free(blocks[i]);
+            free_ns += host_time_ns() - start;
+        }
+
+        /* Alloc right after free, the hot path of most callers */
+        uint64_t start = host_time_ns();
+        for(int i = 0; i < batch * ORDER_ROUNDS; i++)
+            phys_free(phys_alloc(size));
+        uint64_t pair_ns = host_time_ns() - start;
+
+        double ops = (double)batch * ORDER_ROUNDS;
+        printf("%-6d %12.1f %12.1f %12.1f\n", order, alloc_ns / ops, free_ns / ops, pair_ns / ops);
+    }
+}
+
+/* Blocks of the largest order that can still be had, each is given back at once after */
+static size_t max_order_blocks(void)
+{
+    static void* blocks[RAM_SIZE / (PAGE_SIZE << PMM_MAX_ORDER)];
+    size_t count = 0;
+
+    while(count < sizeof(blocks) / sizeof(blocks[0]) && (blocks[count] = phys_alloc(PAGE_SIZE << PMM_MAX_ORDER)))
+        count++;
+
+    for(size_t i = 0; i < count; i++)
+        phys_free(blocks[i]);
+
+    return count;
+}
+
+static void bench_fragmentation(void)
+{
+    /* Small blocks far outnumber large ones, as with page tables and slabs */
+    static const int order_weights[PMM_ORDER_COUNT] = { 64, 16, 8, 4, 2, 1, 1 };
+    static struct { void* block; int order; } live[RANDOM_OPS];
+    size_t live_count = 0;
+    size_t live_pages = 0;
+    int weight_total = 0;
+
+    for(int i = 0; i < PMM_ORDER_COUNT; i++)
+        weight_total += order_weights[i];
+
+    pmm_boot();
+    size_t capacity = max_order_blocks();
+    size_t target = (capacity << PMM_MAX_ORDER) / 2;
+
+    uint64_t start = host_time_ns();
+
+    for(int op = 0; op < RANDOM_OPS; op++)
+    {
+        // Hover around half of RAM in use, mostly allocating below that and mostly freeing above
+        bool allocate = live_count == 0 || random_next() % 4 < (live_pages < target ? 3U : 1U);
+
+        if(allocate)
+        {
+            int pick = random_next() % weight_total;
+            int order = 0;
+            while(pick >= order_weights[order])
+                pick -= order_weights[order++];
+
+            void* block = phys_alloc((size_t)PAGE_SIZE << order);
+            if(!block)
+                continue;
+
+            live[live_count].block = block;
+            live[live_count++].order = order;
+            live_pages += 1UL << order;
+        }
+        else
+        {
+            size_t victim = random_next() % live_count;
+
+            phys_free(live[victim].block);
+            live_pages -= 1UL << live[victim].order;
+            live[victim] = live[--live_count];
+        }
+    }
+
+    uint64_t ns = host_time_ns() - start;
+
+    /* With no fragmentation every free page would sit in a largest block */
+    size_t free_pages = (capacity << PMM_MAX_ORDER) - live_pages;
+    size_t available = max_order_blocks();
+
+    printf("\nRandom workload: %d ops, %.1f ns/op, %zu blocks (%zu pages) live\n",
+           RANDOM_OPS, (double)ns / RANDOM_OPS, live_count, live_pages);
+    printf("Order %d blocks left: %zu of an ideal %zu (%.1f%% of free memory unfragmented)\n",
+           PMM_MAX_ORDER, available, free_pages >> PMM_MAX_ORDER,
+           free_pages ? 100.0 * ((double)available * (1 << PMM_MAX_ORDER)) / free_pages : 100.0);
+
+    for(size_t i = 0; i < live_count; i++)
+        phys_free(live[i].block);
+}
+
+static void bench_dtb(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        perror(path);
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // The firmware hands the blob over 8-byte aligned
+    void* blob = aligned_alloc(8, ALIGN_UP((size_t)size, 8));
+    if(!blob || fread(blob, 1, size, file) != (size_t)size)
+    {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(file);
+        free(blob);
+        return;
+    }
+    fclose(file);
+
+    if(dtb_total_size(blob) == 0 || dtb_total_size(blob) > (size_t)size)
+    {
+        fprintf(stderr, "%s: not a flattened device tree\n", path);
+        free(blob);
+        return;
+    }
+
+    boot_info_t info;
+    uint64_t best = ~0ULL;
+    uint64_t total = 0;
+    uint64_t runs = 0;
+
+    while(total < DTB_MIN_NS || runs < 10)
+    {
+        memset(&info, 0, sizeof(info));
+        early_init((uintptr_t)blob, size);
+
+        uint64_t start = host_time_ns();
+        dtb_parse(blob, &info);
+        uint64_t ns = host_time_ns() - start;
+
+        total += ns;
+        best = ns < best ? ns : best;
+        runs++;
+    }
+
+    const dtb_index_t* index = (const dtb_index_t*)info.dtb_index;
+    if(!index)
+    {
+        fprintf(stderr, "%s: dtb_parse failed\n", path);
+        free(blob);
+        return;
+    }
+
+    /* Lookups on the index of the last parse, every phandle and every node's first compatible */
+    uint64_t phandles = 0;
+    uint64_t compatibles = 0;
+
+    uint64_t start = host_time_ns();
+    for(uint32_t i = 0; i < index->node_count; i++)
+    {
+        if(dtb_node(i)->phandle)
+            phandles += dtb_find_phandle(dtb_node(i)->phandle) == i;
+    }
+    uint64_t phandle_ns = host_time_ns() - start;
+
+    start = host_time_ns();
+    for(uint32_t i = 0; i < index->node_count; i++)
+    {
+        if(dtb_node(i)->compatible == DTB_NONE)
+            continue;
+
+        uint32_t cursor = 0;
+        const char* compatible = (const char*)blob + dtb_index_props(index)[dtb_node(i)->compatible].value;
+        compatibles += dtb_next_compatible(compatible, &cursor) != DTB_NONE;
+    }
+    uint64_t compatible_ns = host_time_ns() - start;
+
+    printf("\n%s: %ld bytes, %u nodes, %u properties, %zu byte index\n",
+           path, size, index->node_count, index->prop_count, info.dtb_index_size);
+    printf("  dtb_parse: best %.1f us, avg %.1f us over %lu runs\n",
+           best / 1000.0, (double)total / runs / 1000.0, runs);
+    printf("  dtb_find_phandle: %.1f ns each, %lu phandles\n",
+           phandles ? (double)phandle_ns / phandles : 0.0, phandles);
+    printf("  dtb_next_compatible: %.1f ns each, %lu nodes\n",
+           compatibles ? (double)compatible_ns / compatibles : 0.0, compatibles);
+
+    free(blob);
+}
+
+int main(int argc, char** argv)
+{
+    ram = aligned_alloc(RAM_ALIGN, RAM_SIZE);
+    if(!ram)
+    {
+        fprintf(stderr, "no memory for the fake RAM\n");
+        return 1;
+    }
+
+    ram_region.base = (uintptr_t)ram;
+    ram_region.size = RAM_SIZE;
+    firmware_region.base = (uintptr_t)ram;
+    firmware_region.size = FIRMWARE_SIZE;
+
+    host_quiet = true;
+
+    bench_phys_init();
+    bench_orders();
+    bench_fragmentation();
+
+    for(int i = 1; i < argc; i++)
+        bench_dtb(argv[i]);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * libFuzzer entry for dtb_parse, see host-fuzz in the Makefile. Also
+ * builds without libFuzzer with -DFUZZ_REPLAY, then it runs every file
+ * given on the command line once, to replay crashes under a debugger.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "device/dtb.h"
+#include "memory/early.h"
+
+/* Blobs larger than this would only test the size of the early arena */
+#define FUZZ_MAX_SIZE (1 << 20)
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static uint64_t blob[FUZZ_MAX_SIZE / sizeof(uint64_t)];
+
+    if(size > FUZZ_MAX_SIZE)
+        return 0;
+
+    host_quiet = true;
+
+    // Firmware hands the blob over 8-byte aligned and promises totalsize bytes of it
+    memcpy(blob, data, size);
+    if(dtb_total_size(blob) > size)
+        return 0;
+
+    boot_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    early_init((uintptr_t)blob, size);
+    dtb_parse(blob, &info);
+
+    /* Whatever dtb_parse found has to lie within the arena it was given */
+    if(info.dtb_index)
+    {
+        mem_region_t arena = early_seal();
+        if(info.dtb_index < arena.base || info.dtb_index + info.dtb_index_size > arena.base + arena.size)
+            abort();
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_REPLAY
+
+int main(int argc, char** argv)
+{
+    static uint8_t data[FUZZ_MAX_SIZE];
+
+    for(int i = 1; i < argc; i++)
+    {
+        FILE* file = fopen(argv[i], "rb");
+        if(!file)
+        {
+            perror(argv[i]);
+            continue;
+        }
+
+        size_t size = fread(data, 1, sizeof(data), file);
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(data, size);
+        printf("%s: ok\n", argv[i]);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Device tree source for a synthetic RISC-V machine, laid out like QEMU's
+ * virt board but with as many devices as asked for. Pipe it into dtc:
+ *
+ *     gendts 10000 [harts] | dtc -I dts -O dtb -o big.dtb -
+ *
+ * Every eighth device gets a couple of child nodes, so the tree isn't flat.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEVICE_BASE  0x20000000UL
+#define DEVICE_SIZE  0x1000UL
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s nodes [harts]\n", argv[0]);
+        return 1;
+    }
+
+    long nodes = strtol(argv[1], 0, 0);
+    long harts = argc > 2 ? strtol(argv[2], 0, 0) : 4;
+
+    if(nodes < 0 || harts < 1 || harts > 64)
+    {
+        fprintf(stderr, "%s: bad node or hart count\n", argv[0]);
+        return 1;
+    }
+
+    /* About one node per device plus a quarter for the children */
+    long devices = nodes * 4 / 5;
+
+    printf("/dts-v1/;\n\n");
+    printf("/ {\n");
+    printf("\t#address-cells = <2>;\n\t#size-cells = <2>;\n");
+    printf("\tcompatible = \"riscv-virtio\";\n\tmodel = \"iris synthetic\";\n\n");
+
+    printf("\tchosen {\n\t\tstdout-path = \"serial0:115200n8\";\n\t};\n\n");
+    printf("\taliases {\n\t\tserial0 = \"/soc/serial@10000000\";\n\t};\n\n");
+
+    printf("\tmemory@80000000 {\n\t\tdevice_type = \"memory\";\n");
+    printf("\t\treg = <0x0 0x80000000 0x0 0x80000000>;\n\t};\n\n");
+
+    printf("\treserved-memory {\n\t\t#address-cells = <2>;\n\t\t#size-cells = <2>;\n\t\tranges;\n\n");
+    printf("\t\tmmode_resv0@80000000 {\n\t\t\treg = <0x0 0x80000000 0x0 0x40000>;\n\t\t\tno-map;\n\t\t};\n\t};\n\n");
+
+    printf("\tcpus {\n\t\t#address-cells = <1>;\n\t\t#size-cells = <0>;\n");
+    printf("\t\ttimebase-frequency = <10000000>;\n");
+
+    for(long i = 0; i < harts; i++)
+    {
+        printf("\n\t\tcpu@%ld {\n", i);
+        printf("\t\t\tdevice_type = \"cpu\";\n\t\t\treg = <%ld>;\n\t\t\tstatus = \"okay\";\n", i);
+        printf("\t\t\tcompatible = \"riscv\";\n\t\t\triscv,isa = \"rv64imafdc_zicsr_zifencei_sstc\";\n");
+        printf("\t\t\tmmu-type = \"riscv,sv48\";\n\n");
+        printf("\t\t\tcpu%ld_intc: interrupt-controller {\n", i);
+        printf("\t\t\t\t#interrupt-cells = <1>;\n\t\t\t\tinterrupt-controller;\n");
+        printf("\t\t\t\tcompatible = \"riscv,cpu-intc\";\n\t\t\t};\n\t\t};\n");
+    }
+
+    printf("\t};\n\n");
+
+    printf("\tsoc {\n\t\t#address-cells = <2>;\n\t\t#size-cells = <2>;\n");
+    printf("\t\tcompatible = \"simple-bus\";\n\t\tranges;\n\n");
+
+    printf("\t\tplic: plic@c000000 {\n");
+    printf("\t\t\tcompatible = \"sifive,plic-1.0.0\", \"riscv,plic0\";\n");
+    printf("\t\t\treg = <0x0 0x0c000000 0x0 0x600000>;\n");
+    printf("\t\t\tinterrupt-controller;\n\t\t\t#interrupt-cells = <1>;\n");
+    printf("\t\t\triscv,ndev = <%ld>;\n", devices + 16 < 1023 ? devices + 16 : 1023);
+    printf("\t\t\tinterrupts-extended =");
+    for(long i = 0; i < harts; i++)
+        printf(" <&cpu%ld_intc 11>, <&cpu%ld_intc 9>%s", i, i, i + 1 < harts ? "," : ";\n");
+    printf("\t\t};\n\n");
+
+    printf("\t\tserial@10000000 {\n\t\t\tcompatible = \"ns16550a\";\n");
+    printf("\t\t\treg = <0x0 0x10000000 0x0 0x100>;\n");
+    printf("\t\t\tinterrupt-parent = <&plic>;\n\t\t\tinterrupts = <10>;\n");
+    printf("\t\t\tclock-frequency = <3686400>;\n\t\t};\n\n");
+
+    printf("\t\ttest@100000 {\n\t\t\tcompatible = \"sifive,test1\", \"sifive,test0\", \"syscon\";\n");
+    printf("\t\t\treg = <0x0 0x100000 0x0 0x1000>;\n\t\t};\n");
+
+    for(long i = 0; i < devices; i++)
+    {
+        unsigned long base = DEVICE_BASE + i * DEVICE_SIZE;
+
+        printf("\n\t\tdevice@%lx {\n", base);
+        printf("\t\t\tcompatible = \"iris,synthetic-%ld\", \"iris,synthetic\";\n", i % 16);
+        printf("\t\t\treg = <0x%lx 0x%lx 0x0 0x%lx>;\n", base >> 32, base & 0xFFFFFFFF, DEVICE_SIZE);
+        printf("\t\t\tinterrupt-parent = <&plic>;\n\t\t\tinterrupts = <%ld>;\n", 16 + i % 1000);
+        printf("\t\t\tphandle = <%ld>;\n", 0x1000 + i);
+
+        if(i % 8 == 0)
+        {
+            printf("\t\t\t#address-cells = <1>;\n\t\t\t#size-cells = <0>;\n");
+            printf("\n\t\t\tport@0 {\n\t\t\t\treg = <0>;\n\t\t\t};\n");
+            printf("\n\t\t\tport@1 {\n\t\t\t\treg = <1>;\n\t\t\t};\n");
+        }
+
+        printf("\t\t};\n");
+    }
+
+    printf("\t};\n};\n");
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HOST_STRINGIFY_(x) #x
+#define HOST_STRINGIFY(x)  HOST_STRINGIFY_(x)
+
+/* Early arena behind the host's __kernel_end, enough for a 100k node DTB index */
+#define HOST_ARENA_SIZE 0x4000000
+
+/* rdtime ticks per second on the host, QEMU virt's */
+#define HOST_TIMEBASE 10000000
+
+/* Drop klog output, benchmarks and the fuzzer call noisy init code in loops */
+extern bool host_quiet;
+
+uint64_t host_time_ns(void);
+
+#endif // HOST_H
@@ -0,0 +1,82 @@
+/*
+ * What the portable kernel code needs from the rest of the kernel when it
+ * is built for the host, see host-bench, host-fuzz and host-test in the
+ * Makefile.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+#include "cpu/hart.h"
+#include "device/opensbi.h"
+#include "kernel/klog.h"
+
+hart_t host_hart;
+bool host_quiet;
+
+/*
+ * The kernel image and the early arena right behind it, the arena has no
+ * end of its own in the kernel either. Both are outside of any memory
+ * region handed to phys_init, like a kernel loaded below its RAM.
+ */
+__asm__(".pushsection .bss\n"
+        ".balign 4096\n"
+        ".globl __kernel_start\n"
+        "__kernel_start:\n"
+        ".skip 4096\n"
+        ".globl __kernel_end\n"
+        "__kernel_end:\n"
+        ".skip " HOST_STRINGIFY(HOST_ARENA_SIZE) "\n"
+        ".popsection");
+
+uint64_t host_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* time runs at HOST_TIMEBASE, the counters count nanoseconds */
+uint64_t host_csr_read(const char* csr)
+{
+    if(strcmp(csr, "time") == 0)
+        return host_time_ns() / (1000000000ULL / HOST_TIMEBASE);
+
+    if(strcmp(csr, "cycle") == 0 || strcmp(csr, "instret") == 0)
+        return host_time_ns();
+
+    return 0;
+}
+
+/* klog's formats are a subset of printf's */
+void klog(const char* fmt, ...)
+{
+    if(host_quiet)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* A single hart, remote fences have nobody to reach */
+hart_mask_t hart_online_mask(void)
+{
+    return HART_MASK(0);
+}
+
+sbiret_t sbi_remote_sfence_vma(hart_mask_t harts, uintptr_t start, size_t size)
+{
+    (void)harts; (void)start; (void)size;
+    return (sbiret_t){ SBI_SUCCESS, 0 };
+}
+
+sbiret_t sbi_remote_sfence_vma_asid(hart_mask_t harts, uintptr_t start, size_t size, uint64_t asid)
+{
+    (void)harts; (void)start; (void)size; (void)asid;
+    return (sbiret_t){ SBI_SUCCESS, 0 };
+}
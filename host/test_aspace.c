@@ -0,0 +1,137 @@
+/*
+ * Host test for address space isolation.
+ *
+ *     test_aspace
+ *
+ * Two address spaces map the same user address to different pages, each
+ * must see its own PTE and the kernel tables none. Runs with the Sv48
+ * layout vm_init builds and again after vm_activate falls back to Sv39,
+ * the host satp reads back 0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "memory/aspace.h"
+#include "memory/early.h"
+#include "memory/physical.h"
+#include "memory/slab.h"
+#include "memory/virtual.h"
+
+#define RAM_SIZE  (64UL << 20)
+#define RAM_ALIGN (2UL << 20)
+
+/* Where QEMU virt has its RAM, only entered into the tables, never touched */
+#define KERNEL_VA   0x80000000UL
+#define KERNEL_SIZE (1UL << 30)
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do                                                                \
+    {                                                                 \
+        if(!(cond))                                                   \
+        {                                                             \
+            printf("  FAILED: %s, line %d\n", #cond, __LINE__);       \
+            failures++;                                               \
+        }                                                             \
+    } while(0)
+
+/* Leaf PTE mapping va under root, 0 if there is none */
+static pte_t walk(pte_t* root, uintptr_t va)
+{
+    pte_t* table = root;
+
+    for(int level = vm_levels() - 1; level >= 0; level--)
+    {
+        pte_t entry = table[(va >> (PAGE_SHIFT + 9 * level)) & (PT_ENTRIES - 1)];
+
+        if(!(entry & PTE_V))
+            return 0;
+        if(entry & PTE_LEAF)
+            return entry;
+
+        table = pte_table(entry);
+    }
+
+    return 0;
+}
+
+static uintptr_t pte_address(pte_t entry)
+{
+    return (entry >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+}
+
+static void test_isolation(const char* mode)
+{
+    printf("%s\n", mode);
+
+    aspace_t* a = aspace_create();
+    aspace_t* b = aspace_create();
+    void* page_a = phys_alloc(PAGE_SIZE);
+    void* page_b = phys_alloc(PAGE_SIZE);
+
+    CHECK(a && b && page_a && page_b);
+    if(!a || !b || !page_a || !page_b)
+        return;
+
+    CHECK(aspace_map(a, ASPACE_USER_BASE, (uintptr_t)page_a, PAGE_SIZE, PTE_R));
+    CHECK(aspace_map(b, ASPACE_USER_BASE, (uintptr_t)page_b, PAGE_SIZE, PTE_R | PTE_W));
+
+    pte_t pte_a = walk(a->root, ASPACE_USER_BASE);
+    pte_t pte_b = walk(b->root, ASPACE_USER_BASE);
+
+    CHECK(pte_address(pte_a) == (uintptr_t)page_a && (pte_a & PTE_U) && !(pte_a & PTE_W));
+    CHECK(pte_address(pte_b) == (uintptr_t)page_b && (pte_b & PTE_U) && (pte_b & PTE_W));
+    CHECK(walk(vm_kernel_root(), ASPACE_USER_BASE) == 0);
+
+    /* The kernel's mappings are still there for both */
+    CHECK(pte_address(walk(a->root, KERNEL_VA)) == KERNEL_VA);
+    CHECK(pte_address(walk(b->root, KERNEL_VA)) == KERNEL_VA);
+
+    /* Gone with a, b keeps its own */
+    aspace_destroy(a);
+    CHECK(pte_address(walk(b->root, ASPACE_USER_BASE)) == (uintptr_t)page_b);
+    CHECK(pte_address(walk(vm_kernel_root(), KERNEL_VA)) == KERNEL_VA);
+
+    aspace_destroy(b);
+    phys_free(page_a);
+    phys_free(page_b);
+}
+
+int main(void)
+{
+    char* ram = aligned_alloc(RAM_ALIGN, RAM_SIZE);
+    if(!ram)
+        return 1;
+
+    mem_region_t ram_region = { (uintptr_t)ram, RAM_SIZE };
+    boot_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    info.core_count = 1;
+    info.memory_regions = &ram_region;
+    info.memory_region_count = 1;
+
+    host_quiet = true;
+    early_init(0, 0);
+
+    if(!phys_init(&info) || !slab_init(&info) || !vm_init(&info) || !aspace_init(&info) ||
+       !vm_map(vm_kernel_root(), KERNEL_VA, KERNEL_VA, KERNEL_SIZE, PTE_R | PTE_W | PTE_X | PTE_G))
+    {
+        printf("setup failed\n");
+        return 1;
+    }
+
+    test_isolation("Sv48");
+
+    vm_activate();
+    test_isolation(vm_satp_mode() == SATP_MODE_SV39 ? "Sv39" : "Sv48 again");
+
+    /* Address spaces hold copies of the kernel root, it takes no new mappings now */
+    CHECK(!vm_map(vm_kernel_root(), KERNEL_VA, KERNEL_VA, PAGE_SIZE, PTE_R | PTE_G));
+
+    printf(failures ? "%d checks failed\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
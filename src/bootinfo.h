@@ -4,9 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#define MEM_REGIONS_MAX 8
-#define MEM_RESERVED_MAX 8
-#define SYSCON_MAX 4
+#define HARTS_MAX 64
 
 typedef struct 
 {
@@ -26,10 +24,15 @@ syscon_device_t;
 typedef struct 
 {
     int core_count;
+    uint64_t hart_ids[HARTS_MAX];   // reg of each cpu node, in DTB order
+    uint64_t boot_hart_id;
+    uint64_t timebase_frequency;    // rdtime ticks per second, 0 if the DTB has none
+    int sstc_count;                 // cpu nodes whose ISA lists Sstc
 
-    mem_region_t memory_regions[MEM_REGIONS_MAX];
-    mem_region_t reserved_regions[MEM_RESERVED_MAX];
-    syscon_device_t syscon_devices[SYSCON_MAX];
+    /* Sized to the DTB, in the early arena */
+    mem_region_t* memory_regions;
+    mem_region_t* reserved_regions;
+    syscon_device_t* syscon_devices;
 
     int memory_region_count;
     int reserved_region_count;
@@ -37,6 +40,23 @@ typedef struct
 
     uintptr_t dtb_base;
     size_t dtb_size;
+    uintptr_t dtb_index;    // dtb_index_t in the early arena, 0 if indexing failed
+    size_t dtb_index_size;
+
+    uintptr_t initrd_base;  // From /chosen, 0 if no initrd was loaded
+    size_t initrd_size;
+
+    /* ns16550a console from /chosen/stdout-path, uart_base 0 if there is none */
+    uintptr_t uart_base;
+    size_t uart_size;
+    uint32_t uart_reg_shift;   // Registers are 1 << reg_shift bytes apart
+    uint32_t uart_reg_width;   // Access width in bytes, 1 or 4
+    uint32_t uart_irq;         // PLIC source, 0 if the console can only be polled
+
+    /* PLIC the console interrupt goes through, plic_base 0 if there is none */
+    uintptr_t plic_base;
+    size_t plic_size;
+    uint32_t plic_context;     // Supervisor context of the boot hart
 }
 boot_info_t;
 
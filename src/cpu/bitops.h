@@ -0,0 +1,26 @@
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include <stdint.h>
+
+/* Count trailing zeros without pulling in libgcc, x must not be 0 */
+static inline int ctz64(uint64_t x)
+{
+    static const uint8_t debruijn[64] =
+    {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+    };
+
+    return debruijn[((x & -x) * 0x022FDD63CC95386DULL) >> 58];
+}
+
+/* Rotate right, n in 0..63 */
+static inline uint64_t ror64(uint64_t x, unsigned int n)
+{
+    return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+#endif // BITOPS_H
@@ -0,0 +1,56 @@
+#ifndef CSR_H
+#define CSR_H
+
+#include <stdint.h>
+
+#ifdef IRIS_HOST
+
+/* Host builds of the portable parts, see host/. time and cycle read a host clock */
+uint64_t host_csr_read(const char* csr);
+
+#define csr_read(csr)       host_csr_read(#csr)
+#define csr_write(csr, val) ((void)(val))
+#define csr_set(csr, val)   ((void)(val))
+#define csr_clear(csr, val) ((void)(val))
+
+#define sfence_vma()                   ((void)0)
+#define sfence_vma_addr(va)            ((void)(va))
+#define sfence_vma_asid(asid)          ((void)(asid))
+#define sfence_vma_addr_asid(va, asid) ((void)(va), (void)(asid))
+
+#else
+
+#define csr_read(csr)                                           \
+    ({                                                          \
+        uint64_t __v;                                           \
+        asm volatile("csrr %0, " #csr : "=r"(__v) : : "memory"); \
+        __v;                                                    \
+    })
+
+#define csr_write(csr, val)                                         \
+    ({                                                              \
+        uint64_t __v = (uint64_t)(val);                             \
+        asm volatile("csrw " #csr ", %0" : : "rK"(__v) : "memory"); \
+    })
+
+#define csr_set(csr, val)                                           \
+    ({                                                              \
+        uint64_t __v = (uint64_t)(val);                             \
+        asm volatile("csrs " #csr ", %0" : : "rK"(__v) : "memory"); \
+    })
+
+#define csr_clear(csr, val)                                         \
+    ({                                                              \
+        uint64_t __v = (uint64_t)(val);                             \
+        asm volatile("csrc " #csr ", %0" : : "rK"(__v) : "memory"); \
+    })
+
+/* TLB flushes, by address and/or ASID where given */
+#define sfence_vma() asm volatile("sfence.vma" : : : "memory")
+#define sfence_vma_addr(va) asm volatile("sfence.vma %0" : : "r"(va) : "memory")
+#define sfence_vma_asid(asid) asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory")
+#define sfence_vma_addr_asid(va, asid) asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(asid) : "memory")
+
+#endif // IRIS_HOST
+
+#endif // CSR_H
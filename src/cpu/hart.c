@@ -0,0 +1,110 @@
+#include "hart.h"
+#include "trap.h"
+#include "../device/opensbi.h"
+#include "../memory/physical.h"
+#include "../memory/virtual.h"
+#include "../kernel/klog.h"
+#include "../kernel/pmu.h"
+#include "../kernel/sched.h"
+#include "../kernel/timer.h"
+
+_Static_assert(__builtin_offsetof(hart_t, stack_top) == 16, "entry.s loads hart_t.stack_top from offset 16");
+
+// Boot stack from linker.ld and the secondary entry point in entry.s
+extern char stack_top[];
+extern void _secondary_start(void);
+
+/* Entry 0 belongs to the boot hart, entry.s points tp at it */
+hart_t harts[HARTS_MAX];
+
+static int hart_total = 1;
+static int harts_online = 1;
+
+hart_mask_t hart_online_mask(void)
+{
+    hart_mask_t mask = 0;
+
+    for(int i = 0; i < hart_total; i++)
+    {
+        if(__atomic_load_n(&harts[i].online, __ATOMIC_ACQUIRE))
+            mask |= HART_MASK(i);
+    }
+
+    return mask;
+}
+
+hart_t* hart_get(unsigned int index)
+{
+    return &harts[index];
+}
+
+int hart_count(void)
+{
+    return hart_total;
+}
+
+/* Called from _secondary_start on the hart's own stack with tp set up */
+void hart_secondary_main(hart_t* self)
+{
+    vm_activate();
+    trap_init();
+    pmu_init_hart();
+    timer_init_hart();
+    klog_init_hart();
+
+    self->online = true;
+    __atomic_fetch_add(&harts_online, 1, __ATOMIC_RELEASE);
+
+    sched_run();
+}
+
+int hart_start_secondaries(boot_info_t* info)
+{
+    harts[0].index = 0;
+    harts[0].hartid = info->boot_hart_id;
+    harts[0].stack_top = (uintptr_t)stack_top;
+    harts[0].online = true;
+
+    /* Firmware without HSM starts every hart itself, those never reach us */
+    if(!sbi_has_extension(SBI_EXT_HSM))
+        return 1;
+
+    /* Per-hart tables elsewhere are sized by core_count, never hand out more */
+    int next = 1;
+    for(int i = 0; i < info->core_count && next < info->core_count; i++)
+    {
+        uint64_t hartid = info->hart_ids[i];
+        if(hartid == info->boot_hart_id)
+            continue;
+
+        void* stack = phys_alloc(HART_STACK_SIZE);
+        if(!stack)
+            break;
+
+        hart_t* hart = &harts[next];
+        hart->index = next;
+        hart->hartid = hartid;
+        hart->stack_top = (uintptr_t)stack + HART_STACK_SIZE;
+        hart->online = false;
+
+        sbiret_t ret = sbi_hart_start(hartid, (uintptr_t)_secondary_start, (uintptr_t)hart);
+        if(ret.error != SBI_SUCCESS)
+        {
+            phys_free(stack);
+            continue;
+        }
+
+        next++;
+    }
+
+    hart_total = next;
+
+    /* Give the started harts a moment to come up */
+    for(int spin = 0; spin < 10000000; spin++)
+    {
+        if(__atomic_load_n(&harts_online, __ATOMIC_ACQUIRE) == hart_total)
+            break;
+    }
+
+    return __atomic_load_n(&harts_online, __ATOMIC_ACQUIRE);
+}
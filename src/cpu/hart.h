@@ -0,0 +1,71 @@
+#ifndef HART_H
+#define HART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+
+#define CACHE_LINE_SIZE 64
+#define HART_STACK_SIZE 0x4000
+
+/* A set of harts by logical index, see sbi_send_ipi and friends */
+typedef uint64_t hart_mask_t;
+#define HART_MASK(index) (1ULL << (index))
+
+_Static_assert(HARTS_MAX <= 64, "hart_mask_t holds one bit per hart");
+
+struct trap_frame;
+
+/*
+ * Per-hart data block, tp always points at the executing hart's block.
+ * entry.s and trap.s rely on the offsets of everything before online.
+ */
+typedef struct hart
+{
+    uint64_t index;        // Logical index, 0 is the boot hart
+    uint64_t hartid;       // ID as known to SBI and the DTB
+    uintptr_t stack_top;
+    struct trap_frame* frame;     // User context trap entry saves into
+    uintptr_t kernel_sp;          // Stack traps from user mode run on
+    uintptr_t scratch;
+    uintptr_t kernel_context[14]; // ra, sp and s0-s11 of trap_run_user's caller
+    bool online;
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) hart_t;
+
+#ifdef IRIS_HOST
+
+/* Host builds run everything as hart 0, see host/ */
+extern hart_t host_hart;
+
+static inline hart_t* hart_self(void)
+{
+    return &host_hart;
+}
+
+#else
+
+static inline hart_t* hart_self(void)
+{
+    hart_t* self;
+    asm volatile("mv %0, tp" : "=r"(self));
+    return self;
+}
+
+#endif // IRIS_HOST
+
+/* Logical index of the executing hart */
+static inline unsigned int hart_current(void)
+{
+    return (unsigned int)hart_self()->index;
+}
+
+hart_t* hart_get(unsigned int index);
+int hart_count(void);
+hart_mask_t hart_online_mask(void);
+
+/* Start every other hart listed in the DTB, returns the number of harts online */
+int hart_start_secondaries(boot_info_t* info);
+
+#endif // HART_H
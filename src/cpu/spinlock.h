@@ -0,0 +1,29 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    volatile uint32_t locked;
+}
+spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t* lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+    {
+        // Spin on a plain load so waiters don't keep stealing the line
+        while (lock->locked)
+            ;
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif // SPINLOCK_H
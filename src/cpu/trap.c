@@ -0,0 +1,143 @@
+#include "trap.h"
+#include "csr.h"
+#include "hart.h"
+#include "../device/opensbi.h"
+#include "../device/plic.h"
+#include "../device/uart.h"
+#include "../kernel/klog.h"
+#include "../kernel/syscall.h"
+#include "../kernel/sched.h"
+#include "../kernel/thread.h"
+#include "../kernel/timer.h"
+#include "../memory/aspace.h"
+#include "../memory/physical.h"
+
+_Static_assert(__builtin_offsetof(hart_t, frame) == 24, "trap.s loads hart_t.frame from offset 24");
+_Static_assert(__builtin_offsetof(hart_t, kernel_sp) == 32, "trap.s loads hart_t.kernel_sp from offset 32");
+_Static_assert(__builtin_offsetof(hart_t, scratch) == 40, "trap.s uses hart_t.scratch at offset 40");
+_Static_assert(__builtin_offsetof(hart_t, kernel_context) == 48, "trap.s keeps hart_t.kernel_context at offset 48");
+_Static_assert(__builtin_offsetof(trap_frame_t, sepc) == 256, "trap.s keeps trap_frame_t.sepc at offset 256");
+_Static_assert(__builtin_offsetof(trap_frame_t, busy) == 264, "trap.s keeps trap_frame_t.busy at offset 264");
+
+#define STVEC_MODE_VECTORED 1
+
+// Let user mode read cycle, time and instret
+#define SCOUNTEREN_CY (1ULL << 0)
+#define SCOUNTEREN_TM (1ULL << 1)
+#define SCOUNTEREN_IR (1ULL << 2)
+
+extern char trap_vector[];
+
+void trap_init(void)
+{
+    csr_write(sscratch, 0);
+    csr_write(stvec, (uintptr_t)trap_vector | STVEC_MODE_VECTORED);
+    csr_set(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM | SCOUNTEREN_IR);
+}
+
+trap_frame_t* trap_syscall(trap_frame_t* frame)
+{
+    uintptr_t number = frame->regs[REG_A7];
+
+    if(number >= SYSCALL_COUNT)
+    {
+        frame->regs[REG_A0] = (uintptr_t)-1;
+        return frame;
+    }
+
+    return syscall_table[number](frame);
+}
+
+trap_frame_t* trap_user_interrupt(trap_frame_t* frame, uint64_t cause)
+{
+    switch(cause & ~SCAUSE_INTERRUPT)
+    {
+        case IRQ_S_SOFT:
+            // Scheduler kick, the hart was busy anyway
+            csr_clear(sip, 1ULL << IRQ_S_SOFT);
+            break;
+        case IRQ_S_TIMER:
+            timer_poll();
+            break;
+        case IRQ_S_EXT:
+            plic_handle();
+            break;
+    }
+
+    if(sched_preempt_due())
+    {
+        thread_wake((thread_t*)frame);
+        return thread_switch_next();
+    }
+
+    return frame;
+}
+
+trap_frame_t* trap_user_exception(trap_frame_t* frame, uint64_t cause, uint64_t tval)
+{
+    klog("User fault: cause %lu at 0x%016lx, tval 0x%016lx\n", cause, frame->sepc, tval);
+
+    // No fault handling yet, the thread is done
+    thread_exit((thread_t*)frame);
+    return thread_switch_next();
+}
+
+void trap_kernel(uint64_t cause, uint64_t tval, uint64_t epc)
+{
+    if(cause & SCAUSE_INTERRUPT)
+        return;
+
+    klog("Kernel fault: cause %lu at 0x%016lx, tval 0x%016lx\n", cause, epc, tval);
+    klog_drain();
+    uart_flush();
+
+    sbi_shutdown();
+}
+
+#ifdef IRIS_BENCH
+
+#define TRAP_BENCH_ITERATIONS 1000
+
+extern char trap_bench_user[];
+extern char trap_bench_user_end[];
+
+void trap_bench(void)
+{
+    aspace_t* as = aspace_create();
+    char* code = phys_alloc(PAGE_SIZE);
+
+    if(!as || !code)
+    {
+        klog("Syscall bench: out of memory\n");
+        return;
+    }
+
+    for(char* src = trap_bench_user; src < trap_bench_user_end; src++)
+        code[src - trap_bench_user] = *src;
+    asm volatile("fence.i" : : : "memory");
+
+    if(!aspace_map(as, ASPACE_USER_BASE, (uintptr_t)code, PAGE_SIZE, PTE_R | PTE_X))
+    {
+        klog("Syscall bench: mapping failed\n");
+        return;
+    }
+
+    thread_t* thread = thread_create(as, ASPACE_USER_BASE, 0);
+    if(!thread)
+    {
+        klog("Syscall bench: out of memory\n");
+        return;
+    }
+
+    thread->frame.regs[REG_A0] = TRAP_BENCH_ITERATIONS;
+    thread_run(thread);
+
+    klog("Syscall round trip: avg %lu cycles, min %lu cycles\n",
+         thread->frame.regs[REG_A0] / TRAP_BENCH_ITERATIONS, thread->frame.regs[REG_A1]);
+
+    thread_destroy(thread);
+    aspace_destroy(as);
+    phys_free(code);
+}
+
+#endif
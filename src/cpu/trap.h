@@ -0,0 +1,88 @@
+#ifndef TRAP_H
+#define TRAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SSTATUS_SIE  (1ULL << 1)
+#define SSTATUS_SPIE (1ULL << 5)
+#define SSTATUS_SPP  (1ULL << 8)
+#define SSTATUS_SUM  (1ULL << 18)
+
+#define SCAUSE_INTERRUPT (1ULL << 63)
+
+#define IRQ_S_SOFT  1
+#define IRQ_S_TIMER 5
+#define IRQ_S_EXT   9
+
+#define EXC_INST_MISALIGNED  0
+#define EXC_INST_ACCESS      1
+#define EXC_ILLEGAL_INST     2
+#define EXC_BREAKPOINT       3
+#define EXC_LOAD_MISALIGNED  4
+#define EXC_LOAD_ACCESS      5
+#define EXC_STORE_MISALIGNED 6
+#define EXC_STORE_ACCESS     7
+#define EXC_ECALL_U          8
+#define EXC_INST_PAGE_FAULT  12
+#define EXC_LOAD_PAGE_FAULT  13
+#define EXC_STORE_PAGE_FAULT 15
+
+/* Register numbers, index into trap_frame_t.regs */
+#define REG_RA 1
+#define REG_SP 2
+#define REG_GP 3
+#define REG_TP 4
+#define REG_T0 5
+#define REG_S0 8
+#define REG_A0 10
+#define REG_A1 11
+#define REG_A2 12
+#define REG_A5 15
+#define REG_A6 16
+#define REG_A7 17
+#define REG_S3 19
+#define REG_S4 20
+
+/*
+ * User context of a thread. While the thread is in the kernel through
+ * the ecall or interrupt path only the caller-saved registers, sp, gp
+ * and tp are stored here, s0-s11 stay live in the registers and C code
+ * preserves them. They are written back when the hart switches to
+ * another frame, so the frame of a thread that isn't running is always
+ * complete. trap.s relies on this layout.
+ */
+typedef struct trap_frame
+{
+    uintptr_t regs[32];    // regs[0] is unused
+    uintptr_t sepc;
+    uint64_t busy;         // Set while a hart runs the frame or has yet to write s0-s11 back
+}
+trap_frame_t;
+
+/* Install the trap vector on the executing hart */
+void trap_init(void);
+
+/*
+ * Run user code from frame until a trap handler has nothing left to run
+ * and returns 0. Handlers switch between frames directly, without coming
+ * back here. Must not be called from a trap handler.
+ */
+void trap_run_user(trap_frame_t* frame);
+
+/*
+ * C side of the trap paths in trap.s. The user handlers return the frame
+ * to resume, which may belong to another thread, or 0 to return from
+ * trap_run_user. A handler must not free the frame it was entered with.
+ */
+trap_frame_t* trap_syscall(trap_frame_t* frame);
+trap_frame_t* trap_user_interrupt(trap_frame_t* frame, uint64_t cause);
+trap_frame_t* trap_user_exception(trap_frame_t* frame, uint64_t cause, uint64_t tval);
+void trap_kernel(uint64_t cause, uint64_t tval, uint64_t epc);
+
+#ifdef IRIS_BENCH
+/* Time the null syscall round trip from user mode with rdcycle */
+void trap_bench(void);
+#endif
+
+#endif // TRAP_H
@@ -0,0 +1,313 @@
+.option norvc
+
+/* hart_t offsets, checked in trap.c */
+.equ HART_FRAME,      24
+.equ HART_KERNEL_SP,  32
+.equ HART_SCRATCH,    40
+.equ HART_CONTEXT,    48
+
+/* trap_frame_t offsets, regs[n] lives at 8 * n */
+.equ FRAME_SEPC,      256
+.equ FRAME_BUSY,      264
+
+/* Kernel trap frame: ra, t0-t6, a0-a7 */
+.equ KFRAME_SIZE,     128
+
+.equ SSTATUS_SPIE,    0x20
+.equ SSTATUS_SPP,     0x100
+.equ EXC_ECALL_U,     8
+
+/*
+ * Entry from user mode: tp becomes the hart_t, sp the thread's frame.
+ * Saves everything the C calling convention lets a callee clobber plus
+ * sp, gp and tp, which is all the ecall path ever needs.
+ */
+.macro SAVE_USER
+	csrrw tp, sscratch, tp
+	beqz tp, trap_from_kernel
+
+	sd sp, HART_SCRATCH(tp)
+	ld sp, HART_FRAME(tp)
+
+	sd ra, 8(sp)
+	sd gp, 24(sp)
+	sd t0, 40(sp)
+	sd t1, 48(sp)
+	sd t2, 56(sp)
+	sd a0, 80(sp)
+	sd a1, 88(sp)
+	sd a2, 96(sp)
+	sd a3, 104(sp)
+	sd a4, 112(sp)
+	sd a5, 120(sp)
+	sd a6, 128(sp)
+	sd a7, 136(sp)
+	sd t3, 224(sp)
+	sd t4, 232(sp)
+	sd t5, 240(sp)
+	sd t6, 248(sp)
+
+	ld t0, HART_SCRATCH(tp)
+	sd t0, 16(sp)
+	csrr t0, sscratch
+	sd t0, 32(sp)
+	csrw sscratch, zero
+	csrr t0, sepc
+	sd t0, FRAME_SEPC(sp)
+
+.option push
+.option norelax
+	la gp, global_pointer
+.option pop
+.endm
+
+/* s0-s11 between a register file and the frame in \base */
+.macro CALLEE_SAVED op, base
+	\op s0, 64(\base)
+	\op s1, 72(\base)
+	\op s2, 144(\base)
+	\op s3, 152(\base)
+	\op s4, 160(\base)
+	\op s5, 168(\base)
+	\op s6, 176(\base)
+	\op s7, 184(\base)
+	\op s8, 192(\base)
+	\op s9, 200(\base)
+	\op s10, 208(\base)
+	\op s11, 216(\base)
+.endm
+
+/* Move from the frame in sp to the kernel stack, remembering the frame */
+.macro ENTER_KERNEL
+	mv a0, sp
+	ld sp, HART_KERNEL_SP(tp)
+	addi sp, sp, -16
+	sd a0, 0(sp)
+.endm
+
+.section .text
+
+/*
+ * Vectored stvec: exceptions land on entry 0, interrupt n on entry n.
+ * The ecall path thus only has to tell ecalls apart from faults.
+ */
+.balign 256
+.global trap_vector
+trap_vector:
+	j trap_exception
+	.rept 15
+	j trap_interrupt
+	.endr
+
+trap_exception:
+	SAVE_USER
+
+	csrr t1, scause
+	li t2, EXC_ECALL_U
+	bne t1, t2, trap_user_fault
+
+	/* Fast path: ecall from user mode, skip the instruction and dispatch */
+	addi t0, t0, 4
+	sd t0, FRAME_SEPC(sp)
+
+	ENTER_KERNEL
+	call trap_syscall
+	j trap_exit
+
+trap_user_fault:
+	/* Slow path: full context, fault handlers may want to look at all of it */
+	CALLEE_SAVED sd, sp
+
+	ENTER_KERNEL
+	csrr a1, scause
+	csrr a2, stval
+	call trap_user_exception
+	j trap_exit
+
+trap_interrupt:
+	SAVE_USER
+
+	ENTER_KERNEL
+	csrr a1, scause
+	call trap_user_interrupt
+
+/*
+ * a0 is the frame to resume, 0(sp) the frame the hart entered with. s0-s11
+ * still hold the entering thread's values, so leaving for another frame
+ * writes them back and loads the new ones.
+ */
+trap_exit:
+	ld t0, 0(sp)
+	beq a0, t0, trap_resume
+
+	/* Once busy is clear another hart may resume the old frame */
+	CALLEE_SAVED sd, t0
+	fence rw, w
+	sd zero, FRAME_BUSY(t0)
+	beqz a0, trap_leave
+
+	CALLEE_SAVED ld, a0
+	li t1, 1
+	sd t1, FRAME_BUSY(a0)
+
+/* Return to user mode into the frame in a0 with s0-s11 already loaded */
+trap_resume:
+	sd a0, HART_FRAME(tp)
+	csrw sscratch, tp
+
+	li t0, SSTATUS_SPP
+	csrc sstatus, t0
+	li t0, SSTATUS_SPIE
+	csrs sstatus, t0
+
+	mv sp, a0
+	ld t0, FRAME_SEPC(sp)
+	csrw sepc, t0
+
+	ld ra, 8(sp)
+	ld gp, 24(sp)
+	ld tp, 32(sp)
+	ld t0, 40(sp)
+	ld t1, 48(sp)
+	ld t2, 56(sp)
+	ld a0, 80(sp)
+	ld a1, 88(sp)
+	ld a2, 96(sp)
+	ld a3, 104(sp)
+	ld a4, 112(sp)
+	ld a5, 120(sp)
+	ld a6, 128(sp)
+	ld a7, 136(sp)
+	ld t3, 224(sp)
+	ld t4, 232(sp)
+	ld t5, 240(sp)
+	ld t6, 248(sp)
+	ld sp, 16(sp)
+	sret
+
+/* Nothing left to run in user mode, return from trap_run_user */
+trap_leave:
+	ld ra, HART_CONTEXT + 0(tp)
+	ld sp, HART_CONTEXT + 8(tp)
+	ld s0, HART_CONTEXT + 16(tp)
+	ld s1, HART_CONTEXT + 24(tp)
+	ld s2, HART_CONTEXT + 32(tp)
+	ld s3, HART_CONTEXT + 40(tp)
+	ld s4, HART_CONTEXT + 48(tp)
+	ld s5, HART_CONTEXT + 56(tp)
+	ld s6, HART_CONTEXT + 64(tp)
+	ld s7, HART_CONTEXT + 72(tp)
+	ld s8, HART_CONTEXT + 80(tp)
+	ld s9, HART_CONTEXT + 88(tp)
+	ld s10, HART_CONTEXT + 96(tp)
+	ld s11, HART_CONTEXT + 104(tp)
+	sd zero, HART_FRAME(tp)
+	ret
+
+.global trap_run_user
+trap_run_user:
+	sd ra, HART_CONTEXT + 0(tp)
+	sd sp, HART_CONTEXT + 8(tp)
+	sd s0, HART_CONTEXT + 16(tp)
+	sd s1, HART_CONTEXT + 24(tp)
+	sd s2, HART_CONTEXT + 32(tp)
+	sd s3, HART_CONTEXT + 40(tp)
+	sd s4, HART_CONTEXT + 48(tp)
+	sd s5, HART_CONTEXT + 56(tp)
+	sd s6, HART_CONTEXT + 64(tp)
+	sd s7, HART_CONTEXT + 72(tp)
+	sd s8, HART_CONTEXT + 80(tp)
+	sd s9, HART_CONTEXT + 88(tp)
+	sd s10, HART_CONTEXT + 96(tp)
+	sd s11, HART_CONTEXT + 104(tp)
+
+	/* Traps from user mode use the stack below the caller's */
+	sd sp, HART_KERNEL_SP(tp)
+
+	CALLEE_SAVED ld, a0
+	li t1, 1
+	sd t1, FRAME_BUSY(a0)
+	j trap_resume
+
+/*
+ * Trap taken in supervisor mode. The kernel never enables interrupts in
+ * a handler, so there is no nesting and sepc/sstatus survive in the CSRs.
+ */
+trap_from_kernel:
+	csrrw tp, sscratch, tp
+
+	addi sp, sp, -KFRAME_SIZE
+	sd ra, 0(sp)
+	sd t0, 8(sp)
+	sd t1, 16(sp)
+	sd t2, 24(sp)
+	sd t3, 32(sp)
+	sd t4, 40(sp)
+	sd t5, 48(sp)
+	sd t6, 56(sp)
+	sd a0, 64(sp)
+	sd a1, 72(sp)
+	sd a2, 80(sp)
+	sd a3, 88(sp)
+	sd a4, 96(sp)
+	sd a5, 104(sp)
+	sd a6, 112(sp)
+	sd a7, 120(sp)
+
+	csrr a0, scause
+	csrr a1, stval
+	csrr a2, sepc
+	call trap_kernel
+
+	ld ra, 0(sp)
+	ld t0, 8(sp)
+	ld t1, 16(sp)
+	ld t2, 24(sp)
+	ld t3, 32(sp)
+	ld t4, 40(sp)
+	ld t5, 48(sp)
+	ld t6, 56(sp)
+	ld a0, 64(sp)
+	ld a1, 72(sp)
+	ld a2, 80(sp)
+	ld a3, 88(sp)
+	ld a4, 96(sp)
+	ld a5, 104(sp)
+	ld a6, 112(sp)
+	ld a7, 120(sp)
+	addi sp, sp, KFRAME_SIZE
+	sret
+
+/*
+ * User-mode code for trap_bench, copied into a user page. Runs a0 null
+ * syscalls timed one by one with rdcycle, then exits with the total in
+ * a0 and the fastest round trip in a1.
+ */
+.global trap_bench_user
+.global trap_bench_user_end
+trap_bench_user:
+	mv s0, a0
+	li s3, 0
+	li s4, -1
+1:
+	rdcycle s1
+	li a7, 0		/* SYS_NULL */
+	ecall
+	rdcycle s2
+	sub s2, s2, s1
+	add s3, s3, s2
+	bgeu s2, s4, 2f
+	mv s4, s2
+2:
+	addi s0, s0, -1
+	bnez s0, 1b
+
+	mv a0, s3
+	mv a1, s4
+	li a7, 1		/* SYS_EXIT */
+	ecall
+3:
+	j 3b
+trap_bench_user_end:
+
+.end
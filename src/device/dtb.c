@@ -1,8 +1,9 @@
 #include "dtb.h"
-
-// External UART functions for debugging
-extern void uart_puts(const char* str);
-extern void uart_putx(uint64_t val);
+#include "../cpu/trap.h"
+#include "../memory/early.h"
+#include "../memory/physical.h"
+#include "../kernel/bootprof.h"
+#include "../kernel/klog.h"
 
 #define FDT_MAGIC       0xd00dfeed
 #define FDT_BEGIN_NODE  0x1
@@ -41,6 +42,14 @@ static int my_strlen(const char* str)
     return len;
 }
 
+/* Length of str, or max if there is no terminator in its first max bytes */
+static uint32_t my_strnlen(const char* str, uint32_t max)
+{
+    uint32_t len = 0;
+    while (len < max && str[len]) len++;
+    return len;
+}
+
 static int my_strcmp(const char* a, const char* b) 
 {
     while (*a && (*a == *b)) 
@@ -111,131 +120,810 @@ static uint64_t fdt64_to_cpu(uint64_t x)
            ((x & 0x00000000000000FFULL) << 56);
 }
 
-static const char* fdt_get_string(const void* dtb, uint32_t offset) 
+
+/* Index built by dtb_parse and the blob it describes */
+static const dtb_index_t* dtb_idx;
+static const char* dtb_blob;
+
+size_t dtb_total_size(const void* dtb)
 {
     const fdt_header_t* hdr = (const fdt_header_t*)dtb;
-    return (const char*)dtb + fdt32_to_cpu(hdr->off_dt_strings) + offset;
+
+    if (!dtb || fdt32_to_cpu(hdr->magic) != FDT_MAGIC)
+        return 0;
+
+    return fdt32_to_cpu(hdr->totalsize);
 }
 
-static void parse_reserved_memory_map(const void* dtb_ptr, boot_info_t* out)
+/* Shell sort, the tables are built once and are mostly in order already */
+static void sort_keys(dtb_key_t* keys, uint32_t count)
 {
-    const fdt_header_t* hdr = (const fdt_header_t*)dtb_ptr;
-    const fdt_reserve_entry_t* rsvmap = (const fdt_reserve_entry_t*)
-        ((const char*)dtb_ptr + fdt32_to_cpu(hdr->off_mem_rsvmap));
+    static const uint32_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
 
-    out->reserved_region_count = 0;
-    
-    // Parse the reserved memory map entries
-    for (int i = 0; i < MEM_RESERVED_MAX; i++) 
+    for (int g = 0; g < (int)(sizeof(gaps) / sizeof(gaps[0])); g++)
     {
-        uint64_t address = fdt64_to_cpu(rsvmap[i].address);
-        uint64_t size = fdt64_to_cpu(rsvmap[i].size);
-        
-        // End of reserved memory map is marked by entry with address=0 and size=0
-        if (address == 0 && size == 0) 
-            break;
-            
-        out->reserved_regions[out->reserved_region_count].base = address;
-        out->reserved_regions[out->reserved_region_count].size = size;
-        out->reserved_region_count++;
+        uint32_t gap = gaps[g];
+
+        for (uint32_t i = gap; i < count; i++)
+        {
+            dtb_key_t key = keys[i];
+            uint32_t j = i;
+
+            while (j >= gap && (keys[j - gap].key > key.key ||
+                   (keys[j - gap].key == key.key && keys[j - gap].node > key.node)))
+            {
+                keys[j] = keys[j - gap];
+                j -= gap;
+            }
+
+            keys[j] = key;
+        }
     }
 }
 
-static void parse_reserved_memory_nodes(const void* dtb_ptr, boot_info_t* out,
-                                        const char* struct_block)
+/* First entry with a key not below key */
+static uint32_t lower_bound(const dtb_key_t* keys, uint32_t count, uint32_t key)
 {
-    const char* ptr = struct_block;
-    int depth = 0;
-    int in_reserved_memory = 0;
-    int in_reserved_child = 0;
-    
-    while (1) 
+    uint32_t low = 0;
+    uint32_t high = count;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (keys[mid].key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/*
+ * One walk over the structure block. Nodes fill the scratch area from the
+ * bottom and properties from the top, every node and property takes at
+ * least 12 bytes of the block, so both fit. The properties are then moved
+ * down behind the nodes and the lookup tables built behind them.
+ */
+static bool index_build(const void* dtb_ptr)
+{
+    const fdt_header_t* hdr = (const fdt_header_t*)dtb_ptr;
+    const char* blob = (const char*)dtb_ptr;
+
+    uint32_t struct_off = fdt32_to_cpu(hdr->off_dt_struct);
+    uint32_t strings_off = fdt32_to_cpu(hdr->off_dt_strings);
+    uint32_t total = fdt32_to_cpu(hdr->totalsize);
+    uint32_t rsvmap_off = fdt32_to_cpu(hdr->off_mem_rsvmap);
+
+    if (total < sizeof(fdt_header_t) || struct_off >= total || strings_off > total ||
+        rsvmap_off >= total || struct_off % 4 != 0 || rsvmap_off % 8 != 0)
+        return false;
+
+    bool sized = fdt32_to_cpu(hdr->version) >= 17;
+    uint32_t struct_size = sized ? fdt32_to_cpu(hdr->size_dt_struct) : total - struct_off;
+    uint32_t strings_size = sized ? fdt32_to_cpu(hdr->size_dt_strings) : total - strings_off;
+
+    /* Nothing below trusts the blob, names and strings get checked against these bounds */
+    if (struct_size > total - struct_off || strings_size > total - strings_off)
+        return false;
+
+    uint32_t bound = struct_size / 12 + 1;
+    size_t scratch = sizeof(dtb_index_t) + (size_t)bound * sizeof(dtb_node_t);
+
+    /* Page aligned, the index may get mapped into user space on its own */
+    dtb_index_t* index = early_alloc(scratch, PAGE_SIZE);
+    if (!index)
+        return false;
+
+    dtb_node_t* nodes = (dtb_node_t*)(index + 1);
+    dtb_prop_t* props_top = (dtb_prop_t*)((char*)index + scratch);
+    uint32_t node_count = 0;
+    uint32_t prop_count = 0;
+    uint32_t phandle_count = 0;
+    uint32_t compatible_count = 0;
+
+    uint32_t current = DTB_NONE;
+    uint32_t offset = struct_off;
+    uint32_t end = struct_off + struct_size;
+
+    while (offset + 4 <= end)
     {
-        uint32_t token = fdt32_to_cpu(*(uint32_t*)ptr);
-        ptr += 4;
+        uint32_t token = fdt32_to_cpu(*(const uint32_t*)(blob + offset));
+        offset += 4;
 
-        switch (token) 
+        switch (token)
         {
-            case FDT_BEGIN_NODE: 
+            case FDT_BEGIN_NODE:
             {
-                const char* name = ptr;
-                int len = my_strlen(name);
-                
-                // Look for reserved-memory node at depth 1
-                if (my_strcmp(name, "reserved-memory") == 0 && depth == 1) 
-                {
-                    in_reserved_memory = 1;
-                }
-                // Look for child nodes of reserved-memory at depth 2
-                else if (in_reserved_memory && depth == 2) 
+                const char* name = blob + offset;
+                uint32_t len = my_strnlen(name, end - offset);
+
+                if (len == end - offset || node_count + prop_count >= bound)
+                    return false;
+
+                dtb_node_t* node = &nodes[node_count];
+                node->name = offset;
+                node->parent = current;
+                node->first_child = DTB_NONE;
+                node->next_sibling = DTB_NONE;
+                node->first_prop = prop_count;
+                node->prop_count = 0;
+                node->compatible = DTB_NONE;
+                node->phandle = 0;
+                node->path_hash = DTB_HASH_INIT;
+
+                /*
+                 * While a node is open its next_sibling holds its last
+                 * child, the real sibling can only come after it closes.
+                 */
+                if (current != DTB_NONE)
                 {
-                    in_reserved_child = 1;
+                    dtb_node_t* parent = &nodes[current];
+
+                    if (parent->first_child == DTB_NONE)
+                        parent->first_child = node_count;
+                    else
+                        nodes[parent->next_sibling].next_sibling = node_count;
+
+                    parent->next_sibling = node_count;
+                    node->path_hash = dtb_hash(dtb_hash(parent->path_hash, "/", 1), name, len);
                 }
 
-                ptr += len + 1;
-                ptr = (const char*)(((uintptr_t)ptr + 3) & ~3); // Align to 4
-                depth++;
+                current = node_count++;
+                offset = (offset + len + 1 + 3) & ~3;
                 break;
             }
             case FDT_END_NODE:
-                depth--;
-                if (depth == 1) 
-                {
-                    in_reserved_memory = 0;
-                }
-                if (depth == 2 && in_reserved_memory) 
-                {
-                    in_reserved_child = 0;
-                }
+                if (current == DTB_NONE)
+                    return false;
+
+                nodes[current].next_sibling = DTB_NONE;
+                current = nodes[current].parent;
                 break;
-            case FDT_PROP: 
+            case FDT_PROP:
             {
-                uint32_t prop_len = fdt32_to_cpu(*(uint32_t*)ptr); ptr += 4;
-                uint32_t nameoff = fdt32_to_cpu(*(uint32_t*)ptr); ptr += 4;
-                const char* prop_name = fdt_get_string(dtb_ptr, nameoff);
-                const void* value = ptr;
-
-                // Parse reg properties in reserved-memory child nodes
-                if (in_reserved_child && my_strcmp(prop_name, "reg") == 0 && 
-                    out->reserved_region_count < MEM_RESERVED_MAX) 
+                if (offset + 8 > end || current == DTB_NONE)
+                    return false;
+
+                uint32_t prop_len = fdt32_to_cpu(*(const uint32_t*)(blob + offset));
+                uint32_t nameoff = fdt32_to_cpu(*(const uint32_t*)(blob + offset + 4));
+                offset += 8;
+
+                if (prop_len > end - offset || nameoff >= strings_size ||
+                    my_strnlen(blob + strings_off + nameoff, strings_size - nameoff) == strings_size - nameoff)
+                    return false;
+
+                dtb_node_t* node = &nodes[current];
+                const char* prop_name = blob + strings_off + nameoff;
+                const char* value = blob + offset;
+
+                /* Properties must come before subnodes, later ones would break the run */
+                if (node->first_child == DTB_NONE && node_count + prop_count < bound)
                 {
-                    // Similar to memory parsing - try 64-bit first
-                    if (prop_len >= 16 && (prop_len % 16) == 0) 
+                    dtb_prop_t* prop = props_top - ++prop_count;
+                    prop->name = strings_off + nameoff;
+                    prop->value = offset;
+                    prop->len = prop_len;
+
+                    /*
+                     * A string list, unless the last one is cut off. Only the
+                     * first one counts, as with dtb_get_prop, the tables are
+                     * sized by what gets recorded here.
+                     */
+                    if (node->compatible == DTB_NONE && prop_name[0] == 'c' &&
+                        my_strcmp(prop_name, "compatible") == 0 &&
+                        prop_len > 0 && value[prop_len - 1] == '\0')
                     {
-                        const uint64_t* data = (const uint64_t*)value;
-                        int entries = prop_len / 16;
-                        for (int i = 0; i < entries && out->reserved_region_count < MEM_RESERVED_MAX; i++) 
-                        {
-                            out->reserved_regions[out->reserved_region_count].base = fdt64_to_cpu(data[i*2]);
-                            out->reserved_regions[out->reserved_region_count].size = fdt64_to_cpu(data[i*2+1]);
-                            out->reserved_region_count++;
-                        }
-                    } 
-                    // Try 32-bit
-                    else if (prop_len >= 8 && (prop_len % 8) == 0) 
+                        node->compatible = node->first_prop + node->prop_count;
+
+                        for (uint32_t i = 0; i < prop_len; i += my_strlen(value + i) + 1)
+                            compatible_count++;
+                    }
+
+                    /* Likewise the first phandle, 0 means none and isn't recorded */
+                    if (prop_len == 4 && !node->phandle && (my_strcmp(prop_name, "phandle") == 0 ||
+                                                            my_strcmp(prop_name, "linux,phandle") == 0))
                     {
-                        const uint32_t* data32 = (const uint32_t*)value;
-                        int entries = prop_len / 8;
-                        for (int i = 0; i < entries && out->reserved_region_count < MEM_RESERVED_MAX; i++) 
-                        {
-                            out->reserved_regions[out->reserved_region_count].base = fdt32_to_cpu(data32[i*2]);
-                            out->reserved_regions[out->reserved_region_count].size = fdt32_to_cpu(data32[i*2+1]);
-                            out->reserved_region_count++;
-                        }
+                        node->phandle = fdt32_to_cpu(*(const uint32_t*)value);
+
+                        if (node->phandle)
+                            phandle_count++;
                     }
+
+                    node->prop_count++;
                 }
 
-                ptr += (prop_len + 3) & ~3; // Align to 4-byte boundary
+                offset = (offset + prop_len + 3) & ~3;
                 break;
             }
             case FDT_NOP:
                 break;
             case FDT_END:
-                return;
+                offset = end;
+                break;
             default:
-                return; // Unknown token
+                klog("Unknown DTB token: %x\n", token);
+                return false;
+        }
+    }
+
+    if (node_count == 0 || current != DTB_NONE)
+        return false;
+
+    /* Properties were stacked downwards, lay them out in order after the nodes */
+    dtb_prop_t* props = (dtb_prop_t*)(nodes + node_count);
+    for (uint32_t i = 0; i < prop_count; i++)
+        props[i] = props_top[-1 - (int64_t)i];
+
+    uint32_t props_end = (uint32_t)((char*)(props + prop_count) - (char*)index);
+    uint32_t tables = ALIGN_UP(props_end, 8);
+    uint32_t size = tables + (phandle_count + compatible_count + node_count) * sizeof(dtb_key_t);
+
+    if (!early_resize(index, ALIGN_UP(size, PAGE_SIZE)))
+        return false;
+
+    index->magic = DTB_INDEX_MAGIC;
+    index->size = size;
+    index->blob_size = total;
+    index->node_count = node_count;
+    index->prop_count = prop_count;
+    index->phandle_count = phandle_count;
+    index->compatible_count = compatible_count;
+    index->nodes = sizeof(dtb_index_t);
+    index->props = (uint32_t)((char*)props - (char*)index);
+    index->phandles = tables;
+    index->compatibles = index->phandles + phandle_count * sizeof(dtb_key_t);
+    index->paths = index->compatibles + compatible_count * sizeof(dtb_key_t);
+
+    dtb_key_t* phandles = (dtb_key_t*)((char*)index + index->phandles);
+    dtb_key_t* compatibles = (dtb_key_t*)((char*)index + index->compatibles);
+    dtb_key_t* paths = (dtb_key_t*)((char*)index + index->paths);
+    uint32_t p = 0;
+    uint32_t c = 0;
+
+    for (uint32_t i = 0; i < node_count; i++)
+    {
+        paths[i].key = nodes[i].path_hash;
+        paths[i].node = i;
+
+        if (nodes[i].phandle)
+        {
+            phandles[p].key = nodes[i].phandle;
+            phandles[p++].node = i;
+        }
+
+        if (nodes[i].compatible != DTB_NONE)
+        {
+            const dtb_prop_t* prop = &props[nodes[i].compatible];
+            const char* value = blob + prop->value;
+
+            for (uint32_t j = 0; j < prop->len; j += my_strlen(value + j) + 1)
+            {
+                compatibles[c].key = dtb_hash(DTB_HASH_INIT, value + j, my_strlen(value + j));
+                compatibles[c++].node = i;
+            }
+        }
+    }
+
+    sort_keys(phandles, phandle_count);
+    sort_keys(compatibles, compatible_count);
+    sort_keys(paths, node_count);
+
+    dtb_idx = index;
+    dtb_blob = blob;
+    return true;
+}
+
+const dtb_node_t* dtb_node(uint32_t node)
+{
+    if (!dtb_idx || node >= dtb_idx->node_count)
+        return 0;
+
+    return &dtb_index_nodes(dtb_idx)[node];
+}
+
+const char* dtb_node_name(uint32_t node)
+{
+    const dtb_node_t* n = dtb_node(node);
+    return n ? dtb_blob + n->name : 0;
+}
+
+const dtb_prop_t* dtb_get_prop(uint32_t node, const char* name)
+{
+    const dtb_node_t* n = dtb_node(node);
+    if (!n)
+        return 0;
+
+    const dtb_prop_t* props = dtb_index_props(dtb_idx) + n->first_prop;
+    for (uint32_t i = 0; i < n->prop_count; i++)
+    {
+        if (my_strcmp(dtb_blob + props[i].name, name) == 0)
+            return &props[i];
+    }
+
+    return 0;
+}
+
+const void* dtb_prop_value(const dtb_prop_t* prop)
+{
+    return dtb_blob + prop->value;
+}
+
+/* Value of a string or string list property, 0 unless it ends in a terminator */
+static const char* prop_string(const dtb_prop_t* prop)
+{
+    if (!prop || prop->len == 0 || dtb_blob[prop->value + prop->len - 1] != '\0')
+        return 0;
+
+    return dtb_blob + prop->value;
+}
+
+/* Whether node is the one at the first len characters of path */
+static bool path_matches(uint32_t node, const char* path, int len)
+{
+    const dtb_node_t* nodes = dtb_index_nodes(dtb_idx);
+
+    while (nodes[node].parent != DTB_NONE)
+    {
+        const char* name = dtb_blob + nodes[node].name;
+        int name_len = my_strlen(name);
+
+        if (len < name_len + 1 || path[len - name_len - 1] != '/' ||
+            my_strncmp(path + len - name_len, name, name_len) != 0)
+            return false;
+
+        len -= name_len + 1;
+        node = nodes[node].parent;
+    }
+
+    return len == 0;
+}
+
+uint32_t dtb_find_path(const char* path)
+{
+    if (!dtb_idx || !path || path[0] != '/')
+        return DTB_NONE;
+
+    int len = my_strlen(path);
+    if (path[len - 1] == '/')
+        len--;
+
+    uint32_t hash = dtb_hash(DTB_HASH_INIT, path, len);
+    const dtb_key_t* paths = dtb_index_keys(dtb_idx, dtb_idx->paths);
+
+    for (uint32_t i = lower_bound(paths, dtb_idx->node_count, hash); i < dtb_idx->node_count && paths[i].key == hash; i++)
+    {
+        if (path_matches(paths[i].node, path, len))
+            return paths[i].node;
+    }
+
+    return DTB_NONE;
+}
+
+uint32_t dtb_find_phandle(uint32_t phandle)
+{
+    if (!dtb_idx)
+        return DTB_NONE;
+
+    const dtb_key_t* phandles = dtb_index_keys(dtb_idx, dtb_idx->phandles);
+    uint32_t i = lower_bound(phandles, dtb_idx->phandle_count, phandle);
+
+    if (i < dtb_idx->phandle_count && phandles[i].key == phandle)
+        return phandles[i].node;
+
+    return DTB_NONE;
+}
+
+/* Whether node's compatible property lists the string compatible */
+static bool is_compatible(uint32_t node, const char* compatible)
+{
+    if (dtb_node(node)->compatible == DTB_NONE)
+        return false;
+
+    const dtb_prop_t* prop = &dtb_index_props(dtb_idx)[dtb_node(node)->compatible];
+    const char* value = dtb_blob + prop->value;
+
+    for (uint32_t i = 0; i < prop->len; i += my_strlen(value + i) + 1)
+    {
+        if (my_strcmp(value + i, compatible) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+uint32_t dtb_next_compatible(const char* compatible, uint32_t* cursor)
+{
+    if (!dtb_idx)
+        return DTB_NONE;
+
+    const dtb_key_t* keys = dtb_index_keys(dtb_idx, dtb_idx->compatibles);
+    uint32_t hash = dtb_hash(DTB_HASH_INIT, compatible, my_strlen(compatible));
+
+    /* The cursor is the table position to continue at, plus one */
+    uint32_t i = *cursor ? *cursor - 1 : lower_bound(keys, dtb_idx->compatible_count, hash);
+
+    for (; i < dtb_idx->compatible_count && keys[i].key == hash; i++)
+    {
+        /* Hashes can collide, check the node really lists the string */
+        if (is_compatible(keys[i].node, compatible))
+        {
+            *cursor = i + 2;
+            return keys[i].node;
+        }
+    }
+
+    *cursor = i + 1;
+    return DTB_NONE;
+}
+
+/* Big-endian number of count cells, wider numbers keep their low 64 bits */
+static uint64_t read_cells(const uint32_t* cells, uint32_t count)
+{
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++)
+        value = value << 32 | fdt32_to_cpu(cells[i]);
+
+    return value;
+}
+
+/* Integer property of 1 or 2 cells */
+static uint64_t prop_uint(const dtb_prop_t* prop)
+{
+    if (!prop || (prop->len != 4 && prop->len != 8))
+        return 0;
+
+    // Values are only 4-byte aligned, read 64-bit ones a cell at a time
+    return read_cells((const uint32_t*)dtb_prop_value(prop), prop->len / 4);
+}
+
+#define DTB_CELLS_MAX 4
+
+/*
+ * #address-cells or #size-cells of node, with the spec's default if it has
+ * none. Counts past DTB_CELLS_MAX are broken, they get the default too.
+ */
+static uint32_t cell_count(uint32_t node, const char* name, uint32_t fallback)
+{
+    const dtb_prop_t* prop = node == DTB_NONE ? 0 : dtb_get_prop(node, name);
+    uint32_t cells = prop && prop->len == 4 ? fdt32_to_cpu(*(const uint32_t*)dtb_prop_value(prop)) : fallback;
+
+    return cells <= DTB_CELLS_MAX ? cells : fallback;
+}
+
+static bool name_is(uint32_t node, const char* name)
+{
+    int len = my_strlen(name);
+    const char* node_name = dtb_node_name(node);
+
+    return my_strncmp(node_name, name, len) == 0 && (node_name[len] == '\0' || node_name[len] == '@');
+}
+
+/*
+ * (address, size) entries of a reg property, laid out by the parent's
+ * #address-cells and #size-cells. Without regions only counts them,
+ * otherwise fills in at most max and returns how many.
+ */
+static int read_reg(uint32_t node, mem_region_t* regions, int max)
+{
+    const dtb_prop_t* prop = dtb_get_prop(node, "reg");
+    if (!prop)
+        return 0;
+
+    uint32_t parent = dtb_node(node)->parent;
+    uint32_t address_cells = cell_count(parent, "#address-cells", 2);
+    uint32_t size_cells = cell_count(parent, "#size-cells", 1);
+    uint32_t entry = (address_cells + size_cells) * 4;
+
+    if (address_cells == 0 || prop->len % entry != 0)
+    {
+        klog("    Unexpected reg property length\n");
+        return 0;
+    }
+
+    int count = prop->len / entry;
+    if (regions && count > max)
+        count = max;
+
+    const uint32_t* cells = (const uint32_t*)dtb_prop_value(prop);
+
+    for (int i = 0; regions && i < count; i++, cells += address_cells + size_cells)
+    {
+        regions[i].base = read_cells(cells, address_cells);
+        regions[i].size = read_cells(cells + address_cells, size_cells);
+    }
+
+    return count;
+}
+
+static const fdt_reserve_entry_t* reserve_map(const void* dtb_ptr)
+{
+    const fdt_header_t* hdr = (const fdt_header_t*)dtb_ptr;
+    return (const fdt_reserve_entry_t*)((const char*)dtb_ptr + fdt32_to_cpu(hdr->off_mem_rsvmap));
+}
+
+/* Entries of the reserved memory map in the header, it ends with address=0 and size=0 */
+static int reserve_map_count(const void* dtb_ptr)
+{
+    const fdt_header_t* hdr = (const fdt_header_t*)dtb_ptr;
+    const fdt_reserve_entry_t* rsvmap = reserve_map(dtb_ptr);
+    int max = (dtb_idx->blob_size - fdt32_to_cpu(hdr->off_mem_rsvmap)) / sizeof(fdt_reserve_entry_t);
+    int count = 0;
+
+    while (count < max && (rsvmap[count].address || rsvmap[count].size))
+        count++;
+
+    return count;
+}
+
+static void parse_reserved_memory(const void* dtb_ptr, boot_info_t* out)
+{
+    const fdt_reserve_entry_t* rsvmap = reserve_map(dtb_ptr);
+    int map_count = reserve_map_count(dtb_ptr);
+    int count = map_count;
+
+    uint32_t reserved = dtb_find_path("/reserved-memory");
+    if (reserved != DTB_NONE)
+    {
+        for (uint32_t node = dtb_node(reserved)->first_child; node != DTB_NONE; node = dtb_node(node)->next_sibling)
+            count += read_reg(node, 0, 0);
+    }
+
+    out->reserved_regions = early_alloc(count * sizeof(mem_region_t), 8);
+    if (!out->reserved_regions)
+        return;
+
+    for (int i = 0; i < map_count; i++)
+    {
+        out->reserved_regions[i].base = fdt64_to_cpu(rsvmap[i].address);
+        out->reserved_regions[i].size = fdt64_to_cpu(rsvmap[i].size);
+    }
+
+    out->reserved_region_count = map_count;
+
+    if (reserved != DTB_NONE)
+    {
+        for (uint32_t node = dtb_node(reserved)->first_child; node != DTB_NONE; node = dtb_node(node)->next_sibling)
+            out->reserved_region_count += read_reg(node, out->reserved_regions + out->reserved_region_count, count - out->reserved_region_count);
+    }
+}
+
+static void parse_memory(boot_info_t* out)
+{
+    int count = 0;
+
+    // Memory nodes hang off the root
+    for (uint32_t node = dtb_node(0)->first_child; node != DTB_NONE; node = dtb_node(node)->next_sibling)
+    {
+        if (name_is(node, "memory"))
+            count += read_reg(node, 0, 0);
+    }
+
+    out->memory_regions = early_alloc(count * sizeof(mem_region_t), 8);
+    if (!out->memory_regions)
+        return;
+
+    for (uint32_t node = dtb_node(0)->first_child; node != DTB_NONE; node = dtb_node(node)->next_sibling)
+    {
+        if (name_is(node, "memory"))
+            out->memory_region_count += read_reg(node, out->memory_regions + out->memory_region_count, count - out->memory_region_count);
+    }
+}
+
+static void parse_cpus(boot_info_t* out)
+{
+    uint32_t cpus = dtb_find_path("/cpus");
+    if (cpus == DTB_NONE)
+        return;
+
+    // Usually on /cpus, some boards only put it on each cpu node
+    out->timebase_frequency = prop_uint(dtb_get_prop(cpus, "timebase-frequency"));
+
+    uint32_t address_cells = cell_count(cpus, "#address-cells", 1);
+
+    for (uint32_t cpu = dtb_node(cpus)->first_child; cpu != DTB_NONE; cpu = dtb_node(cpu)->next_sibling)
+    {
+        if (my_strncmp(dtb_node_name(cpu), "cpu@", 4) != 0 || out->core_count >= HARTS_MAX)
+            continue;
+
+        // Hart ID, the first address of reg
+        const dtb_prop_t* reg = dtb_get_prop(cpu, "reg");
+        out->hart_ids[out->core_count++] = reg && reg->len >= address_cells * 4
+            ? read_cells((const uint32_t*)dtb_prop_value(reg), address_cells) : 0;
+
+        if (!out->timebase_frequency)
+            out->timebase_frequency = prop_uint(dtb_get_prop(cpu, "timebase-frequency"));
+
+        // Sstc lets S-mode program its timer without going through SBI
+        bool sstc = false;
+        const char* isa = prop_string(dtb_get_prop(cpu, "riscv,isa"));
+        if (isa && my_strstr(isa, "_sstc"))
+            sstc = true;
+
+        // Newer DTBs list extensions one string at a time
+        const dtb_prop_t* extensions = dtb_get_prop(cpu, "riscv,isa-extensions");
+        const char* value = prop_string(extensions);
+        if (value)
+        {
+            for (uint32_t offset = 0; offset < extensions->len; offset += my_strlen(value + offset) + 1)
+            {
+                if (my_strcmp(value + offset, "sstc") == 0)
+                    sstc = true;
+            }
         }
+
+        if (sstc)
+            out->sstc_count++;
+    }
+}
+
+static void parse_syscons(boot_info_t* out)
+{
+    static const char* const compatibles[] = { "syscon", "simple-mfd", "sifive,test0", "sifive,test1" };
+    const int compatible_count = sizeof(compatibles) / sizeof(compatibles[0]);
+
+    // A device listing several of the strings shows up more than once here
+    int max = 0;
+    for (int c = 0; c < compatible_count; c++)
+    {
+        uint32_t cursor = 0;
+        while (dtb_next_compatible(compatibles[c], &cursor) != DTB_NONE)
+            max++;
+    }
+
+    out->syscon_devices = early_alloc(max * sizeof(syscon_device_t), 8);
+    if (!out->syscon_devices)
+        return;
+
+    for (int c = 0; c < compatible_count; c++)
+    {
+        uint32_t cursor = 0;
+        uint32_t node;
+
+        while ((node = dtb_next_compatible(compatibles[c], &cursor)) != DTB_NONE)
+        {
+            // Only the first reg entry, the register block itself
+            mem_region_t regs[1];
+            if (read_reg(node, regs, 1) == 0)
+                continue;
+
+            bool known = false;
+            for (int i = 0; i < out->syscon_device_count; i++)
+                known |= out->syscon_devices[i].base == regs[0].base;
+            if (known)
+                continue;
+
+            syscon_device_t* dev = &out->syscon_devices[out->syscon_device_count++];
+            dev->base = regs[0].base;
+            dev->size = regs[0].size;
+            my_strncpy(dev->name, dtb_node_name(node), sizeof(dev->name));
+
+            klog("Found syscon device: %s @ 0x%016lx\n", dev->name, dev->base);
+        }
+    }
+}
+
+/* The node stdout-path names, directly or through an alias, options after ':' dropped */
+static uint32_t stdout_node(uint32_t chosen)
+{
+    const dtb_prop_t* prop = dtb_get_prop(chosen, "stdout-path");
+    if (!prop)
+        prop = dtb_get_prop(chosen, "linux,stdout-path");
+
+    const char* value = prop_string(prop);
+    if (!value)
+        return DTB_NONE;
+
+    char path[256];
+    int len = 0;
+
+    while (len < (int)sizeof(path) - 1 && value[len] && value[len] != ':')
+    {
+        path[len] = value[len];
+        len++;
+    }
+    path[len] = '\0';
+
+    if (path[0] == '/')
+        return dtb_find_path(path);
+
+    uint32_t aliases = dtb_find_path("/aliases");
+    const dtb_prop_t* alias = aliases == DTB_NONE ? 0 : dtb_get_prop(aliases, path);
+
+    return dtb_find_path(prop_string(alias));
+}
+
+/* Interrupt controller of node, interrupt-parent is inherited from the ancestors */
+static uint32_t interrupt_parent(uint32_t node)
+{
+    for (; node != DTB_NONE; node = dtb_node(node)->parent)
+    {
+        const dtb_prop_t* prop = dtb_get_prop(node, "interrupt-parent");
+        if (prop)
+            return dtb_find_phandle(prop_uint(prop));
+    }
+
+    return DTB_NONE;
+}
+
+/*
+ * Context of the PLIC that delivers supervisor external interrupts to
+ * hartid. interrupts-extended lists one (cpu interrupt controller, cause)
+ * pair per context, in context order.
+ */
+static uint32_t plic_context(uint32_t plic, uint64_t hartid)
+{
+    const dtb_prop_t* prop = dtb_get_prop(plic, "interrupts-extended");
+    if (!prop)
+        return DTB_NONE;
+
+    const uint32_t* cells = (const uint32_t*)dtb_prop_value(prop);
+    uint32_t count = prop->len / 4;
+    uint32_t context = 0;
+
+    for (uint32_t i = 0; i < count; context++)
+    {
+        uint32_t intc = dtb_find_phandle(fdt32_to_cpu(cells[i]));
+        if (intc == DTB_NONE)
+            return DTB_NONE;
+
+        uint32_t interrupt_cells = cell_count(intc, "#interrupt-cells", 1);
+        if (interrupt_cells == 0 || i + 1 + interrupt_cells > count)
+            return DTB_NONE;
+
+        // The interrupt controller sits in its cpu node, whose reg is the hart ID
+        uint32_t cpu = dtb_node(intc)->parent;
+        const dtb_prop_t* reg = cpu == DTB_NONE ? 0 : dtb_get_prop(cpu, "reg");
+        uint32_t address_cells = reg ? cell_count(dtb_node(cpu)->parent, "#address-cells", 1) : 0;
+
+        if (reg && reg->len >= address_cells * 4 &&
+            read_cells((const uint32_t*)dtb_prop_value(reg), address_cells) == hartid &&
+            fdt32_to_cpu(cells[i + 1]) == IRQ_S_EXT)
+            return context;
+
+        i += 1 + interrupt_cells;
+    }
+
+    return DTB_NONE;
+}
+
+/* The ns16550a console and the PLIC behind its interrupt */
+static void parse_console(uint32_t chosen, boot_info_t* out)
+{
+    uint32_t uart = chosen == DTB_NONE ? DTB_NONE : stdout_node(chosen);
+
+    // Without stdout-path take the first 16550 there is
+    if (uart == DTB_NONE || !(is_compatible(uart, "ns16550a") || is_compatible(uart, "ns16550")))
+    {
+        uint32_t cursor = 0;
+        uart = dtb_next_compatible("ns16550a", &cursor);
     }
+
+    mem_region_t regs[1];
+    if (uart == DTB_NONE || read_reg(uart, regs, 1) == 0)
+        return;
+
+    out->uart_base = regs[0].base;
+    out->uart_size = regs[0].size;
+    out->uart_reg_shift = prop_uint(dtb_get_prop(uart, "reg-shift"));
+    out->uart_reg_width = prop_uint(dtb_get_prop(uart, "reg-io-width")) == 4 ? 4 : 1;
+
+    const dtb_prop_t* interrupts = dtb_get_prop(uart, "interrupts");
+    uint32_t plic = interrupt_parent(uart);
+
+    if (!interrupts || interrupts->len < 4 || plic == DTB_NONE ||
+        !(is_compatible(plic, "riscv,plic0") || is_compatible(plic, "sifive,plic-1.0.0")))
+        return;
+
+    uint32_t context = plic_context(plic, out->boot_hart_id);
+    if (context == DTB_NONE || read_reg(plic, regs, 1) == 0)
+        return;
+
+    out->uart_irq = fdt32_to_cpu(*(const uint32_t*)dtb_prop_value(interrupts));
+    out->plic_base = regs[0].base;
+    out->plic_size = regs[0].size;
+    out->plic_context = context;
 }
 
 void dtb_parse(const void* dtb_ptr, boot_info_t* out)
@@ -246,202 +934,64 @@ void dtb_parse(const void* dtb_ptr, boot_info_t* out)
 
     if (fdt32_to_cpu(hdr->magic) != FDT_MAGIC) return;
 
-    // Initialize counters
+    // Initialize counters, the arrays come from the early arena once their size is known
     out->core_count = 0;
     out->memory_region_count = 0;
     out->reserved_region_count = 0;
     out->syscon_device_count = 0;
+    out->memory_regions = 0;
+    out->reserved_regions = 0;
+    out->syscon_devices = 0;
 
     out->dtb_base = (uintptr_t)dtb_ptr;
     out->dtb_size = fdt32_to_cpu(hdr->totalsize);
+    out->dtb_index = 0;
+    out->dtb_index_size = 0;
 
-    // First, parse the reserved memory map from the header
-    parse_reserved_memory_map(dtb_ptr, out);
+    out->initrd_base = 0;
+    out->initrd_size = 0;
 
-    const char* struct_block = (const char*)dtb_ptr + fdt32_to_cpu(hdr->off_dt_struct);
-    const char* ptr = struct_block;
+    out->uart_base = 0;
+    out->uart_size = 0;
+    out->uart_reg_shift = 0;
+    out->uart_reg_width = 1;
+    out->uart_irq = 0;
+    out->plic_base = 0;
+    out->plic_size = 0;
+    out->plic_context = 0;
 
-    int depth = 0;
-    int in_cpus = 0;
-    int in_memory = 0;
-    int in_cpu_node = 0;
-    int checking_syscon = 0;
-    
-    // Store current node name for syscon parsing
-    char current_node_name[32] = {0};
+    out->timebase_frequency = 0;
+    out->sstc_count = 0;
 
-    // Parse the device tree structure for memory regions, CPUs, and syscon devices
-    while (1) 
+    if (!index_build(dtb_ptr))
     {
-        uint32_t token = fdt32_to_cpu(*(uint32_t*)ptr);
-        ptr += 4;
+        klog("Failed to index the DTB\n");
+        return;
+    }
 
-        switch (token) 
-        {
-            case FDT_BEGIN_NODE: 
-            {
-                const char* name = ptr;
-                int len = my_strlen(name);
-            
-                // Check nodes at the correct depth BEFORE incrementing
-                // Root node is at depth 0, its children (cpus, memory) are at depth 1
-                if (my_strcmp(name, "cpus") == 0 && depth == 1) 
-                {
-                    in_cpus = 1;
-                }
-                else if (in_cpus && depth == 2 && my_strncmp(name, "cpu@", 4) == 0) 
-                {
-                    in_cpu_node = 1;
-                    out->core_count++;
-                }
-                
-                if ((my_strcmp(name, "memory") == 0 || my_strncmp(name, "memory@", 7) == 0) && depth == 1) 
-                {
-                    in_memory = 1;
-                }
-                
-                // Store node name for potential syscon device and mark for checking
-                if (depth >= 1 && out->syscon_device_count < SYSCON_MAX) 
-                {
-                    my_strncpy(current_node_name, name, sizeof(current_node_name));
-                    checking_syscon = 1;
-                }
+    boot_checkpoint(BOOT_DTB_INDEXED);
 
-                ptr += len + 1;
-                ptr = (const char*)(((uintptr_t)ptr + 3) & ~3); // Align to 4
-                depth++; // Increment depth AFTER processing the node
-                break;
-            }
-            case FDT_END_NODE:
-                depth--;
-                if (depth == 1) 
-                {
-                    in_cpus = 0;
-                    in_memory = 0;
-                }
-                if (depth == 2 && in_cpus) 
-                {
-                    in_cpu_node = 0;
-                }
-                checking_syscon = 0;
-                current_node_name[0] = '\0';
-                break;
-            case FDT_PROP: 
-            {
-                uint32_t prop_len = fdt32_to_cpu(*(uint32_t*)ptr); ptr += 4;
-                uint32_t nameoff = fdt32_to_cpu(*(uint32_t*)ptr); ptr += 4;
-                const char* prop_name = fdt_get_string(dtb_ptr, nameoff);
-                const void* value = ptr;
-
-                // Parse memory regions
-                if (in_memory && my_strcmp(prop_name, "reg") == 0 && 
-                    out->memory_region_count < MEM_REGIONS_MAX) 
-                {
-                    // Memory reg properties are typically arrays of (address, size) pairs
-                    // Each pair can be 32-bit or 64-bit values
-                    // Try 64-bit first (16 bytes per entry)
-                    if (prop_len >= 16 && (prop_len % 16) == 0) 
-                    {
-                        const uint64_t* data = (const uint64_t*)value;
-                        int entries = prop_len / 16;
-                        for (int i = 0; i < entries && out->memory_region_count < MEM_REGIONS_MAX; i++) 
-                        {
-                            out->memory_regions[out->memory_region_count].base = fdt64_to_cpu(data[i*2]);
-                            out->memory_regions[out->memory_region_count].size = fdt64_to_cpu(data[i*2+1]);
-                            out->memory_region_count++;
-                        }
-                    } 
-                    // Try 32-bit (8 bytes per entry)
-                    else if (prop_len >= 8 && (prop_len % 8) == 0) 
-                    {
-                        const uint32_t* data32 = (const uint32_t*)value;
-                        int entries = prop_len / 8;
-                        for (int i = 0; i < entries && out->memory_region_count < MEM_REGIONS_MAX; i++) 
-                        {
-                            out->memory_regions[out->memory_region_count].base = fdt32_to_cpu(data32[i*2]);
-                            out->memory_regions[out->memory_region_count].size = fdt32_to_cpu(data32[i*2+1]);
-                            out->memory_region_count++;
-                        }
-                    }
-                    else 
-                    {
-                        uart_puts("    Unexpected reg property length\n");
-                    }
-                }
+    out->dtb_index = (uintptr_t)dtb_idx;
+    out->dtb_index_size = dtb_idx->size;
 
-                // Check for syscon devices by looking at compatible property
-                if (checking_syscon && my_strcmp(prop_name, "compatible") == 0) 
-                {
-                    const char* compat_str = (const char*)value;
-                    
-                    // Check if this is a syscon device
-                    // Compatible strings are null-terminated and may contain multiple entries
-                    int offset = 0;
-                    while (offset < (int)prop_len) 
-                    {
-                        const char* current_compat = compat_str + offset;
-                        
-                        if (my_strstr(current_compat, "syscon") || 
-                            my_strcmp(current_compat, "simple-mfd") == 0 ||
-                            my_strstr(current_compat, "sifive,test") || 
-                            my_strstr(current_compat, "shutdown"))
-                        {
-                            // This is a syscon device, now we need to find its reg property
-                            // We'll mark it and handle it when we encounter the reg property
-                            checking_syscon = 2; // Mark as confirmed syscon
-                            break;
-                        }
-                        
-                        offset += my_strlen(current_compat) + 1;
-                    }
-                }
-                
-                // Parse syscon device registers
-                if (checking_syscon == 2 && my_strcmp(prop_name, "reg") == 0 && 
-                    out->syscon_device_count < SYSCON_MAX) 
-                {
-                    // Parse the first reg entry for the syscon device
-                    if (prop_len >= 16 && (prop_len % 16) == 0) 
-                    {
-                        const uint64_t* data = (const uint64_t*)value;
-                        out->syscon_devices[out->syscon_device_count].base = fdt64_to_cpu(data[0]);
-                        out->syscon_devices[out->syscon_device_count].size = fdt64_to_cpu(data[1]);
-                        my_strncpy(out->syscon_devices[out->syscon_device_count].name, 
-                                  current_node_name, sizeof(out->syscon_devices[out->syscon_device_count].name));
-                        out->syscon_device_count++;
-                    } 
-                    else if (prop_len >= 8 && (prop_len % 8) == 0) 
-                    {
-                        const uint32_t* data32 = (const uint32_t*)value;
-                        out->syscon_devices[out->syscon_device_count].base = fdt32_to_cpu(data32[0]);
-                        out->syscon_devices[out->syscon_device_count].size = fdt32_to_cpu(data32[1]);
-                        my_strncpy(out->syscon_devices[out->syscon_device_count].name, 
-                                  current_node_name, sizeof(out->syscon_devices[out->syscon_device_count].name));
-                        out->syscon_device_count++;
-                    }
-                    
-                    uart_puts("Found syscon device: ");
-                    uart_puts(out->syscon_devices[out->syscon_device_count - 1].name);
-                    uart_puts(" @ ");
-                    uart_putx(out->syscon_devices[out->syscon_device_count - 1].base);
-                    uart_puts("\n");
-                    checking_syscon = 0; // Reset after processing
-                }
+    parse_cpus(out);
+    parse_memory(out);
+    parse_reserved_memory(dtb_ptr, out);
 
-                ptr += (prop_len + 3) & ~3; // Align to 4-byte boundary
-                break;
-            }
-            case FDT_NOP:
-                break;
-            case FDT_END:
-                // After parsing the main structure, parse reserved-memory nodes
-                parse_reserved_memory_nodes(dtb_ptr, out, struct_block);
-                return;
-            default:
-                uart_puts("Unknown DTB token: ");
-                uart_putx(token);
-                uart_puts("\n");
-                return; // Unknown token
+    // Initrd location handed over by the bootloader, either 32 or 64 bit
+    uint32_t chosen = dtb_find_path("/chosen");
+    if (chosen != DTB_NONE)
+    {
+        uint64_t initrd_start = prop_uint(dtb_get_prop(chosen, "linux,initrd-start"));
+        uint64_t initrd_end = prop_uint(dtb_get_prop(chosen, "linux,initrd-end"));
+
+        if (initrd_start && initrd_end > initrd_start)
+        {
+            out->initrd_base = initrd_start;
+            out->initrd_size = initrd_end - initrd_start;
         }
     }
-}
\ No newline at end of file
+
+    parse_syscons(out);
+    parse_console(chosen, out);
+}
@@ -1,8 +1,118 @@
 #ifndef DTB_PARSER_H
 #define DTB_PARSER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
 #include "../bootinfo.h"
 
+/*
+ * Index of the flattened device tree, built in one pass over the
+ * structure block. Everything in it is an offset, into the blob for names
+ * and values and from the index header for the tables, so the index
+ * works wherever it and the blob are mapped.
+ */
+#define DTB_INDEX_MAGIC 0x69726973  // "iris"
+#define DTB_NONE 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t name;             // Blob offset of the unit name, "" for the root
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t first_prop;       // Properties of a node are consecutive
+    uint32_t prop_count;
+    uint32_t compatible;       // Property index, DTB_NONE if there is none
+    uint32_t phandle;          // 0 if the node has none
+    uint32_t path_hash;
+}
+dtb_node_t;
+
+typedef struct
+{
+    uint32_t name;             // Blob offset of the property name
+    uint32_t value;            // Blob offset of the value
+    uint32_t len;
+}
+dtb_prop_t;
+
+/* Sorted by key, then node, for bisection */
+typedef struct
+{
+    uint32_t key;
+    uint32_t node;
+}
+dtb_key_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size;             // Header and tables in bytes
+    uint32_t blob_size;
+
+    uint32_t node_count;
+    uint32_t prop_count;
+    uint32_t phandle_count;
+    uint32_t compatible_count; // One entry per string of every compatible property
+
+    /* Offsets from the header */
+    uint32_t nodes;
+    uint32_t props;
+    uint32_t phandles;         // Keyed by phandle
+    uint32_t compatibles;      // Keyed by dtb_hash of the string
+    uint32_t paths;            // Keyed by path hash, node_count entries
+}
+dtb_index_t;
+
+static inline const dtb_node_t* dtb_index_nodes(const dtb_index_t* index)
+{
+    return (const dtb_node_t*)((const char*)index + index->nodes);
+}
+
+static inline const dtb_prop_t* dtb_index_props(const dtb_index_t* index)
+{
+    return (const dtb_prop_t*)((const char*)index + index->props);
+}
+
+static inline const dtb_key_t* dtb_index_keys(const dtb_index_t* index, uint32_t table)
+{
+    return (const dtb_key_t*)((const char*)index + table);
+}
+
+/* FNV-1a, paths hash as the parent's hash continued with "/" and the name */
+#define DTB_HASH_INIT 0x811c9dc5
+
+static inline uint32_t dtb_hash(uint32_t hash, const char* str, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)str[i]) * 0x01000193;
+
+    return hash;
+}
+
+/* totalsize from the header, 0 if dtb isn't a flattened device tree */
+size_t dtb_total_size(const void* dtb);
+
+/* Index dtb and fill out from it, the index goes into the early arena */
 void dtb_parse(const void* dtb_ptr, boot_info_t* out);
 
-#endif
\ No newline at end of file
+/*
+ * Lookups on the index dtb_parse built. All return a node index or
+ * DTB_NONE. Paths are absolute and use full unit names, "/cpus/cpu@0".
+ * dtb_next_compatible walks every node listing compatible, start with
+ * *cursor = 0.
+ */
+uint32_t dtb_find_path(const char* path);
+uint32_t dtb_find_phandle(uint32_t phandle);
+uint32_t dtb_next_compatible(const char* compatible, uint32_t* cursor);
+
+const dtb_node_t* dtb_node(uint32_t node);
+const char* dtb_node_name(uint32_t node);
+
+/* Property name of node, 0 if it has none */
+const dtb_prop_t* dtb_get_prop(uint32_t node, const char* name);
+const void* dtb_prop_value(const dtb_prop_t* prop);
+
+#endif
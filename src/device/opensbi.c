@@ -1,13 +1,119 @@
 #include "opensbi.h"
 
-#define SBI_ECALL_HFENCE_GVMA    0   // internal, ignore
+// Legacy (v0.1) extension IDs
+#define SBI_ECALL_SET_TIMER      0
+#define SBI_ECALL_CONSOLE_PUTCHAR 1
 #define SBI_ECALL_SHUTDOWN       8
-#define SBI_ECALL_SYSTEM_RESET   2
+
+#define SBI_BASE_GET_SPEC_VERSION  0
+#define SBI_BASE_PROBE_EXTENSION   3
+
+#define SBI_TIME_SET_TIMER       0
+#define SBI_IPI_SEND_IPI         0
+#define SBI_RFENCE_SFENCE_VMA       1
+#define SBI_RFENCE_SFENCE_VMA_ASID  2
+#define SBI_HSM_HART_START       0
+#define SBI_SRST_SYSTEM_RESET    0
+#define SBI_PMU_NUM_COUNTERS     0
+#define SBI_PMU_COUNTER_GET_INFO 1
+#define SBI_PMU_COUNTER_CONFIG_MATCHING 2
+
+#define SBI_SRST_TYPE_SHUTDOWN     0
+#define SBI_SRST_TYPE_COLD_REBOOT  1
 
 #include <stdint.h>
 
+typedef struct
+{
+    long spec_version;
+    bool time;
+    bool ipi;
+    bool rfence;
+    bool hsm;
+    bool srst;
+    bool pmu;
+}
+sbi_state_t;
+
+static sbi_state_t sbi_state;
+
+sbiret_t sbi_ecall(int ext, int fid, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2,
+                   uintptr_t arg3, uintptr_t arg4, uintptr_t arg5)
+{
+    register uintptr_t a0 asm("a0") = arg0;
+    register uintptr_t a1 asm("a1") = arg1;
+    register uintptr_t a2 asm("a2") = arg2;
+    register uintptr_t a3 asm("a3") = arg3;
+    register uintptr_t a4 asm("a4") = arg4;
+    register uintptr_t a5 asm("a5") = arg5;
+    register uintptr_t a6 asm("a6") = fid;
+    register uintptr_t a7 asm("a7") = ext;
+
+    asm volatile("ecall"
+                 : "+r"(a0), "+r"(a1)
+                 : "r"(a2), "r"(a3), "r"(a4), "r"(a5), "r"(a6), "r"(a7)
+                 : "memory");
+
+    sbiret_t ret;
+    ret.error = a0;
+    ret.value = a1;
+    return ret;
+}
+
+long sbi_probe_extension(long ext)
+{
+    sbiret_t ret = sbi_ecall(SBI_EXT_BASE, SBI_BASE_PROBE_EXTENSION, ext, 0, 0, 0, 0, 0);
+
+    if(ret.error != SBI_SUCCESS)
+        return 0;
+
+    return ret.value;
+}
+
+void sbi_init(void)
+{
+    /* Firmware with only the legacy interface fails the base call */
+    sbiret_t ret = sbi_ecall(SBI_EXT_BASE, SBI_BASE_GET_SPEC_VERSION, 0, 0, 0, 0, 0, 0);
+    if(ret.error != SBI_SUCCESS)
+    {
+        sbi_state.spec_version = 0;
+        return;
+    }
+
+    sbi_state.spec_version = ret.value;
+    sbi_state.time = sbi_probe_extension(SBI_EXT_TIME) != 0;
+    sbi_state.ipi = sbi_probe_extension(SBI_EXT_IPI) != 0;
+    sbi_state.rfence = sbi_probe_extension(SBI_EXT_RFENCE) != 0;
+    sbi_state.hsm = sbi_probe_extension(SBI_EXT_HSM) != 0;
+    sbi_state.srst = sbi_probe_extension(SBI_EXT_SRST) != 0;
+    sbi_state.pmu = sbi_probe_extension(SBI_EXT_PMU) != 0;
+}
+
+long sbi_spec_version(void)
+{
+    return sbi_state.spec_version;
+}
+
+bool sbi_has_extension(long ext)
+{
+    switch(ext)
+    {
+        case SBI_EXT_BASE:   return sbi_state.spec_version != 0;
+        case SBI_EXT_TIME:   return sbi_state.time;
+        case SBI_EXT_IPI:    return sbi_state.ipi;
+        case SBI_EXT_RFENCE: return sbi_state.rfence;
+        case SBI_EXT_HSM:    return sbi_state.hsm;
+        case SBI_EXT_SRST:   return sbi_state.srst;
+        case SBI_EXT_PMU:    return sbi_state.pmu;
+        default:             return sbi_probe_extension(ext) != 0;
+    }
+}
+
 void sbi_shutdown(void) 
 {
+    if(sbi_state.srst)
+        sbi_ecall(SBI_EXT_SRST, SBI_SRST_SYSTEM_RESET, SBI_SRST_TYPE_SHUTDOWN, 0, 0, 0, 0, 0);
+
     register uintptr_t a7 asm("a7") = SBI_ECALL_SHUTDOWN;
     register uintptr_t a0 asm("a0") = 0;  // unused
 
@@ -20,13 +126,136 @@ void sbi_shutdown(void)
 
 void sbi_reboot(void) 
 {
-    register uintptr_t a0 asm("a0") = 0;
-    register uintptr_t a1 asm("a1") = 0;
-    register uintptr_t a7 asm("a7") = SBI_ECALL_SYSTEM_RESET;
+    // The legacy interface has no reboot
+    if(sbi_state.srst)
+        sbi_ecall(SBI_EXT_SRST, SBI_SRST_SYSTEM_RESET, SBI_SRST_TYPE_COLD_REBOOT, 0, 0, 0, 0, 0);
 
-    asm volatile("ecall"
-                 : "+r"(a0), "+r"(a1)
-                 : "r"(a7)
-                 : "memory");
     for (;;);
-}
\ No newline at end of file
+}
+
+void sbi_console_putchar(char c)
+{
+    // Legacy only, but every firmware with a console still has it
+    sbi_ecall(SBI_ECALL_CONSOLE_PUTCHAR, 0, (uint8_t)c, 0, 0, 0, 0, 0);
+}
+
+sbiret_t sbi_set_timer(uint64_t stime_value)
+{
+    if(sbi_state.time)
+        return sbi_ecall(SBI_EXT_TIME, SBI_TIME_SET_TIMER, stime_value, 0, 0, 0, 0, 0);
+
+    // Legacy set_timer returns nothing
+    sbi_ecall(SBI_ECALL_SET_TIMER, 0, stime_value, 0, 0, 0, 0, 0);
+
+    sbiret_t ret = { SBI_SUCCESS, 0 };
+    return ret;
+}
+
+sbiret_t sbi_hart_start(uint64_t hartid, uintptr_t start_addr, uintptr_t opaque)
+{
+    if(!sbi_state.hsm)
+    {
+        sbiret_t ret = { SBI_ERR_NOT_SUPPORTED, 0 };
+        return ret;
+    }
+
+    return sbi_ecall(SBI_EXT_HSM, SBI_HSM_HART_START, hartid, start_addr, opaque, 0, 0, 0);
+}
+
+/*
+ * Issue one ecall per window of 64 consecutive hart IDs covered by harts.
+ * arg2..arg4 are passed through after hart_mask and hart_mask_base.
+ */
+static sbiret_t sbi_ecall_harts(int ext, int fid, hart_mask_t harts,
+                                uintptr_t arg2, uintptr_t arg3, uintptr_t arg4)
+{
+    sbiret_t ret = { SBI_SUCCESS, 0 };
+
+    while(harts)
+    {
+        /* The lowest remaining hart ID starts the next window */
+        uint64_t base = UINT64_MAX;
+        for(int i = 0; i < HARTS_MAX; i++)
+        {
+            if((harts & HART_MASK(i)) && hart_get(i)->hartid < base)
+                base = hart_get(i)->hartid;
+        }
+
+        uint64_t mask = 0;
+        for(int i = 0; i < HARTS_MAX; i++)
+        {
+            uint64_t hartid = hart_get(i)->hartid;
+
+            if((harts & HART_MASK(i)) && hartid - base < 64)
+            {
+                mask |= 1ULL << (hartid - base);
+                harts &= ~HART_MASK(i);
+            }
+        }
+
+        sbiret_t r = sbi_ecall(ext, fid, mask, base, arg2, arg3, arg4, 0);
+        if(r.error != SBI_SUCCESS)
+            ret = r;
+    }
+
+    return ret;
+}
+
+sbiret_t sbi_send_ipi(hart_mask_t harts)
+{
+    if(!sbi_state.ipi)
+    {
+        sbiret_t ret = { SBI_ERR_NOT_SUPPORTED, 0 };
+        return ret;
+    }
+
+    return sbi_ecall_harts(SBI_EXT_IPI, SBI_IPI_SEND_IPI, harts, 0, 0, 0);
+}
+
+sbiret_t sbi_remote_sfence_vma(hart_mask_t harts, uintptr_t start, size_t size)
+{
+    if(!sbi_state.rfence)
+    {
+        sbiret_t ret = { SBI_ERR_NOT_SUPPORTED, 0 };
+        return ret;
+    }
+
+    if(start == 0 && size == 0)
+        size = (size_t)-1;
+
+    return sbi_ecall_harts(SBI_EXT_RFENCE, SBI_RFENCE_SFENCE_VMA, harts, start, size, 0);
+}
+
+sbiret_t sbi_remote_sfence_vma_asid(hart_mask_t harts, uintptr_t start, size_t size, uint64_t asid)
+{
+    if(!sbi_state.rfence)
+    {
+        sbiret_t ret = { SBI_ERR_NOT_SUPPORTED, 0 };
+        return ret;
+    }
+
+    if(start == 0 && size == 0)
+        size = (size_t)-1;
+
+    return sbi_ecall_harts(SBI_EXT_RFENCE, SBI_RFENCE_SFENCE_VMA_ASID, harts, start, size, asid);
+}
+
+long sbi_pmu_num_counters(void)
+{
+    if(!sbi_state.pmu)
+        return 0;
+
+    sbiret_t ret = sbi_ecall(SBI_EXT_PMU, SBI_PMU_NUM_COUNTERS, 0, 0, 0, 0, 0, 0);
+    return ret.error == SBI_SUCCESS ? ret.value : 0;
+}
+
+sbiret_t sbi_pmu_counter_info(unsigned long counter)
+{
+    return sbi_ecall(SBI_EXT_PMU, SBI_PMU_COUNTER_GET_INFO, counter, 0, 0, 0, 0, 0);
+}
+
+sbiret_t sbi_pmu_counter_config(unsigned long base, unsigned long mask, unsigned long flags,
+                                unsigned long event, uint64_t event_data)
+{
+    return sbi_ecall(SBI_EXT_PMU, SBI_PMU_COUNTER_CONFIG_MATCHING, base, mask, flags, event, event_data, 0);
+}
@@ -1,8 +1,87 @@
 #ifndef OPENSBI_H
 #define OPENSBI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../cpu/hart.h"
+
+#define SBI_SUCCESS                 0
+#define SBI_ERR_FAILED             -1
+#define SBI_ERR_NOT_SUPPORTED      -2
+#define SBI_ERR_INVALID_PARAM      -3
+#define SBI_ERR_DENIED             -4
+#define SBI_ERR_INVALID_ADDRESS    -5
+#define SBI_ERR_ALREADY_AVAILABLE  -6
+
+#define SBI_EXT_BASE    0x10
+#define SBI_EXT_TIME    0x54494D45
+#define SBI_EXT_IPI     0x735049
+#define SBI_EXT_RFENCE  0x52464E43
+#define SBI_EXT_HSM     0x48534D
+#define SBI_EXT_SRST    0x53525354
+#define SBI_EXT_PMU     0x504D55
+
+typedef struct
+{
+    long error;
+    long value;
+}
+sbiret_t;
+
+sbiret_t sbi_ecall(int ext, int fid, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2,
+                   uintptr_t arg3, uintptr_t arg4, uintptr_t arg5);
+
+/* Query the spec version and which extensions are there, call once at boot */
+void sbi_init(void);
+
+long sbi_spec_version(void);
+long sbi_probe_extension(long ext);
+bool sbi_has_extension(long ext);
+
 void sbi_shutdown(void);
 
 void sbi_reboot(void);
 
-#endif // OPENSBI_H
\ No newline at end of file
+/* Firmware console, for when there is no UART of our own */
+void sbi_console_putchar(char c);
+
+/* TIME: program the next timer interrupt of the calling hart, in timebase ticks */
+sbiret_t sbi_set_timer(uint64_t stime_value);
+
+/* HSM: start a stopped hart at start_addr with a0 = hartid, a1 = opaque */
+sbiret_t sbi_hart_start(uint64_t hartid, uintptr_t start_addr, uintptr_t opaque);
+
+/*
+ * IPI and RFENCE take a set of logical harts. The set is translated to SBI
+ * hart IDs and sent as one ecall for every 64 consecutive IDs it spans,
+ * which on usual boards means one ecall for the whole batch.
+ * A size of 0 with start 0 flushes everything.
+ */
+sbiret_t sbi_send_ipi(hart_mask_t harts);
+sbiret_t sbi_remote_sfence_vma(hart_mask_t harts, uintptr_t start, size_t size);
+sbiret_t sbi_remote_sfence_vma_asid(hart_mask_t harts, uintptr_t start, size_t size, uint64_t asid);
+
+/*
+ * PMU: counters are numbered by SBI, hardware ones map onto a counter
+ * CSR. Configuring and starting counters only affects the calling hart.
+ */
+#define SBI_PMU_INFO_CSR(info)     ((info) & 0xFFF)
+#define SBI_PMU_INFO_WIDTH(info)   ((((info) >> 12) & 0x3F) + 1)
+#define SBI_PMU_INFO_FIRMWARE(info) ((uint64_t)(info) >> 63)
+
+#define SBI_PMU_CFG_CLEAR_VALUE  (1 << 1)
+#define SBI_PMU_CFG_AUTO_START   (1 << 2)
+#define SBI_PMU_CFG_SET_UINH     (1 << 5)  // Don't count in U-mode
+#define SBI_PMU_CFG_SET_SINH     (1 << 6)  // Don't count in S-mode
+#define SBI_PMU_CFG_SET_MINH     (1 << 7)  // Don't count in M-mode
+
+long sbi_pmu_num_counters(void);
+sbiret_t sbi_pmu_counter_info(unsigned long counter);
+
+/* Find a counter in base + mask that can count event and set it up, value is its index */
+sbiret_t sbi_pmu_counter_config(unsigned long base, unsigned long mask, unsigned long flags,
+                                unsigned long event, uint64_t event_data);
+
+#endif // OPENSBI_H
@@ -0,0 +1,80 @@
+#include "plic.h"
+#include "../cpu/csr.h"
+#include "../cpu/trap.h"
+
+#define PLIC_PRIORITY(irq)      (0x4 * (irq))
+#define PLIC_ENABLE(context)    (0x2000 + 0x80 * (context))
+#define PLIC_THRESHOLD(context) (0x200000 + 0x1000 * (context))
+#define PLIC_CLAIM(context)     (0x200004 + 0x1000 * (context))
+
+typedef struct
+{
+    uint32_t irq;
+    void (*handler)(void);
+}
+plic_handler_t;
+
+typedef struct
+{
+    uintptr_t base;
+    uint32_t context;
+    int handler_count;
+    plic_handler_t handlers[PLIC_HANDLERS_MAX];
+}
+plic_state_t;
+
+static plic_state_t plic_state;
+
+static inline volatile uint32_t* plic_reg(uintptr_t offset)
+{
+    return (volatile uint32_t*)(plic_state.base + offset);
+}
+
+bool plic_init(boot_info_t* info)
+{
+    if(!info->plic_base)
+        return false;
+
+    plic_state.base = info->plic_base;
+    plic_state.context = info->plic_context;
+    plic_state.handler_count = 0;
+
+    // Every source with a non-zero priority gets through
+    *plic_reg(PLIC_THRESHOLD(plic_state.context)) = 0;
+
+    /* Only the boot hart takes external interrupts, in user mode or to leave wfi */
+    csr_set(sie, 1ULL << IRQ_S_EXT);
+    return true;
+}
+
+bool plic_enable(uint32_t irq, void (*handler)(void))
+{
+    if(!plic_state.base || irq == 0 || plic_state.handler_count >= PLIC_HANDLERS_MAX)
+        return false;
+
+    plic_handler_t* entry = &plic_state.handlers[plic_state.handler_count++];
+    entry->irq = irq;
+    entry->handler = handler;
+
+    *plic_reg(PLIC_PRIORITY(irq)) = 1;
+    *plic_reg(PLIC_ENABLE(plic_state.context) + (irq / 32) * 4) |= 1U << (irq % 32);
+    return true;
+}
+
+void plic_handle(void)
+{
+    if(!plic_state.base)
+        return;
+
+    uint32_t irq;
+    while((irq = *plic_reg(PLIC_CLAIM(plic_state.context))) != 0)
+    {
+        for(int i = 0; i < plic_state.handler_count; i++)
+        {
+            if(plic_state.handlers[i].irq == irq)
+                plic_state.handlers[i].handler();
+        }
+
+        *plic_reg(PLIC_CLAIM(plic_state.context)) = irq;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef PLIC_H
+#define PLIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+
+/* Interrupt sources with a handler, the console for now */
+#define PLIC_HANDLERS_MAX 8
+
+/*
+ * Platform-level interrupt controller. Sources are routed to the boot
+ * hart's supervisor context only, the other harts never see them.
+ */
+bool plic_init(boot_info_t* info);
+
+/* Route source irq to the boot hart and run handler for it, false without a PLIC */
+bool plic_enable(uint32_t irq, void (*handler)(void));
+
+/* Claim, handle and complete every pending source, called on sip.SEIP */
+void plic_handle(void);
+
+#endif // PLIC_H
@@ -0,0 +1,182 @@
+#include "uart.h"
+#include "plic.h"
+#include "opensbi.h"
+#include "../cpu/spinlock.h"
+
+// Register numbers, apart by 1 << reg-shift bytes
+#define UART_THR 0     // Transmit holding, write
+#define UART_IER 1
+#define UART_FCR 2     // FIFO control, write
+#define UART_IIR 2     // Interrupt identification, read
+#define UART_MCR 4
+#define UART_LSR 5
+
+#define UART_IER_THRI    0x02
+#define UART_FCR_ENABLE  0x01
+#define UART_FCR_CLEAR   0x06  // Both FIFOs
+#define UART_MCR_OUT2    0x08  // Gates the interrupt line on PC-style parts
+#define UART_LSR_THRE    0x20  // FIFO empty
+#define UART_LSR_TEMT    0x40  // FIFO and shift register empty
+
+_Static_assert((UART_TX_BUFFER & (UART_TX_BUFFER - 1)) == 0, "UART_TX_BUFFER must be a power of two");
+
+typedef struct
+{
+    uintptr_t base;
+    uint32_t reg_shift;
+    uint32_t reg_width;
+    bool irq;              // TX-empty interrupt wired up
+
+    spinlock_t lock;
+    uint32_t head;         // Next byte to queue
+    uint32_t tail;         // Next byte for the FIFO
+    char tx[UART_TX_BUFFER];
+}
+uart_state_t;
+
+static uart_state_t uart_state;
+
+static inline uint8_t uart_read(int reg)
+{
+    uintptr_t addr = uart_state.base + ((uintptr_t)reg << uart_state.reg_shift);
+
+    if(uart_state.reg_width == 4)
+        return (uint8_t)*(volatile uint32_t*)addr;
+
+    return *(volatile uint8_t*)addr;
+}
+
+static inline void uart_write(int reg, uint8_t value)
+{
+    uintptr_t addr = uart_state.base + ((uintptr_t)reg << uart_state.reg_shift);
+
+    if(uart_state.reg_width == 4)
+        *(volatile uint32_t*)addr = value;
+    else
+        *(volatile uint8_t*)addr = value;
+}
+
+/* Hand the FIFO up to its size from the ring if it ran empty, lock held */
+static void fifo_fill(void)
+{
+    if(!(uart_read(UART_LSR) & UART_LSR_THRE))
+        return;
+
+    for(int i = 0; i < UART_FIFO_SIZE && uart_state.tail != uart_state.head; i++)
+        uart_write(UART_THR, uart_state.tx[uart_state.tail++ & (UART_TX_BUFFER - 1)]);
+}
+
+/* Ask for the TX-empty interrupt only while there is something left to send */
+static void update_irq(void)
+{
+    if(uart_state.irq)
+        uart_write(UART_IER, uart_state.tail != uart_state.head ? UART_IER_THRI : 0);
+}
+
+void uart_init(boot_info_t* info)
+{
+    uart_state.base = info->uart_base;
+    uart_state.reg_shift = info->uart_reg_shift;
+    uart_state.reg_width = info->uart_reg_width;
+    uart_state.irq = false;
+    uart_state.head = 0;
+    uart_state.tail = 0;
+
+    if(!uart_state.base)
+        return;
+
+    // Firmware already set the line up, only the FIFOs are ours
+    uart_write(UART_IER, 0);
+    uart_write(UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR);
+}
+
+static void uart_interrupt(void)
+{
+    spin_lock(&uart_state.lock);
+
+    // Reading IIR acknowledges a TX-empty interrupt
+    uart_read(UART_IIR);
+    fifo_fill();
+    update_irq();
+
+    spin_unlock(&uart_state.lock);
+}
+
+bool uart_init_irq(boot_info_t* info)
+{
+    if(!uart_state.base || !info->uart_irq || !plic_enable(info->uart_irq, uart_interrupt))
+        return false;
+
+    spin_lock(&uart_state.lock);
+
+    uart_write(UART_MCR, uart_read(UART_MCR) | UART_MCR_OUT2);
+    uart_state.irq = true;
+    update_irq();
+
+    spin_unlock(&uart_state.lock);
+    return true;
+}
+
+/* Queue c, polling the FIFO empty while the ring is full, lock held */
+static void queue(char c)
+{
+    while(uart_state.head - uart_state.tail == UART_TX_BUFFER)
+        fifo_fill();
+
+    uart_state.tx[uart_state.head++ & (UART_TX_BUFFER - 1)] = c;
+}
+
+void uart_putc(char c)
+{
+    if(!uart_state.base)
+    {
+        sbi_console_putchar(c);
+        return;
+    }
+
+    spin_lock(&uart_state.lock);
+
+    queue(c);
+    fifo_fill();
+    update_irq();
+
+    spin_unlock(&uart_state.lock);
+}
+
+void uart_puts(const char* str)
+{
+    if(!uart_state.base)
+    {
+        while(*str)
+            sbi_console_putchar(*str++);
+        return;
+    }
+
+    spin_lock(&uart_state.lock);
+
+    while(*str)
+        queue(*str++);
+
+    fifo_fill();
+    update_irq();
+
+    spin_unlock(&uart_state.lock);
+}
+
+void uart_flush(void)
+{
+    if(!uart_state.base)
+        return;
+
+    spin_lock(&uart_state.lock);
+
+    while(uart_state.tail != uart_state.head)
+        fifo_fill();
+
+    while(!(uart_read(UART_LSR) & UART_LSR_TEMT))
+        ;
+
+    update_irq();
+
+    spin_unlock(&uart_state.lock);
+}
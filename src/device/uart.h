@@ -0,0 +1,31 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+
+/* Software ring in front of the hardware FIFO, a power of two */
+#define UART_TX_BUFFER 4096
+#define UART_FIFO_SIZE 16
+
+/*
+ * ns16550a console. Output goes into a ring and leaves it a FIFO fill at
+ * a time, refilled from the TX-empty interrupt once uart_init_irq has
+ * wired it up. A full ring and uart_flush fall back to polling, so
+ * nothing is lost before interrupts or when shutting down. Without a
+ * console in the DTB output goes to the legacy SBI console.
+ */
+void uart_init(boot_info_t* info);
+
+/* Take the TX-empty interrupt through the PLIC, false if it has to stay polled */
+bool uart_init_irq(boot_info_t* info);
+
+void uart_putc(char c);
+void uart_puts(const char* str);
+
+/* Wait until everything queued has left the transmitter */
+void uart_flush(void);
+
+#endif // UART_H
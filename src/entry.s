@@ -7,6 +7,10 @@
 _start:
 	.cfi_startproc
 
+	/* Boot profile, held in t3 and t4 until the BSS is clear */
+	rdtime t3
+	rdcycle t4
+
 .option push
 .option norelax
 	la gp, global_pointer
@@ -15,6 +19,9 @@ _start:
 	/* Setup stack */
 	la sp, stack_top
 
+	/* The boot hart is logical hart 0, tp points at its hart_t */
+	la tp, harts
+
 	/* Clear the BSS section */
 	la t5, bss_start
 	la t6, bss_end
@@ -23,13 +30,39 @@ bss_clear:
 	addi t5, t5, 8
 	bltu t5, t6, bss_clear
 
+	/* boot_stamps[BOOT_ENTRY] */
+	la t5, boot_stamps
+	sd t3, 0(t5)
+	sd t4, 8(t5)
+
 	/* OpenSBI passes DTB pointer in a1, hartid in a0 */
-	/* Move DTB pointer from a1 to a0 for boot_cmain */
+	/* boot_cmain takes the DTB pointer first and the hartid second */
+	mv t0, a0
 	mv a0, a1
+	mv a1, t0
 
 	/* Jump to C */
 	tail boot_cmain
 
 	.cfi_endproc
 
-.end
\ No newline at end of file
+.type _secondary_start, @function
+.global _secondary_start
+_secondary_start:
+	.cfi_startproc
+
+.option push
+.option norelax
+	la gp, global_pointer
+.option pop
+
+	/* SBI HSM passes the hartid in a0 and our hart_t in a1 */
+	mv tp, a1
+	ld sp, 16(tp)	/* hart_t.stack_top */
+
+	mv a0, a1
+	tail hart_secondary_main
+
+	.cfi_endproc
+
+.end
@@ -0,0 +1,58 @@
+#include "bootprof.h"
+#include "klog.h"
+
+_Static_assert(sizeof(boot_stamp_t) == 16 && BOOT_ENTRY == 0, "entry.s stores BOOT_ENTRY at boot_stamps + 0 and + 8");
+
+boot_stamp_t boot_stamps[BOOT_CHECKPOINTS];
+
+/* Phase that ends at each checkpoint */
+static const char* const phase_names[BOOT_CHECKPOINTS] =
+{
+    [BOOT_ENTRY]       = "firmware",
+    [BOOT_CMAIN]       = "bss clear",
+    [BOOT_DTB_INDEXED] = "dtb index",
+    [BOOT_DTB_PARSED]  = "dtb parse",
+    [BOOT_CONSOLE]     = "console",
+    [BOOT_PHYS_ZONES]  = "pmm zones",
+    [BOOT_PHYS_INIT]   = "pmm free lists",
+    [BOOT_PAGING]      = "paging",
+    [BOOT_SERVICES]    = "services",
+    [BOOT_BENCH]       = "benchmarks",
+    [BOOT_ROOT]        = "root service",
+    [BOOT_HARTS]       = "secondary harts",
+};
+
+static uint64_t to_us(uint64_t ticks, uint64_t timebase)
+{
+    return ticks / timebase * 1000000 + ticks % timebase * 1000000 / timebase;
+}
+
+void boot_report(const boot_info_t* info)
+{
+    uint64_t timebase = info->timebase_frequency;
+    const char* unit = timebase ? "us" : "ticks";
+
+    // Firmware ran from reset, when time and cycle were about 0
+    boot_stamp_t previous = { 0, 0 };
+
+    klog("Boot profile:\n");
+
+    for(int i = 0; i < BOOT_CHECKPOINTS; i++)
+    {
+        if(!boot_stamps[i].time)
+            continue;
+
+        uint64_t ticks = boot_stamps[i].time - previous.time;
+        klog("  %s: %lu %s, %lu cycles\n", phase_names[i], timebase ? to_us(ticks, timebase) : ticks,
+             unit, boot_stamps[i].cycle - previous.cycle);
+
+        previous = boot_stamps[i];
+    }
+
+    if(!boot_stamps[BOOT_ENTRY].time)
+        return;
+
+    uint64_t ticks = previous.time - boot_stamps[BOOT_ENTRY].time;
+    klog("  kernel total: %lu %s, %lu cycles\n", timebase ? to_us(ticks, timebase) : ticks,
+         unit, previous.cycle - boot_stamps[BOOT_ENTRY].cycle);
+}
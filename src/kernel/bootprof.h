@@ -0,0 +1,51 @@
+#ifndef BOOTPROF_H
+#define BOOTPROF_H
+
+#include <stdint.h>
+
+#include "../bootinfo.h"
+#include "../cpu/csr.h"
+
+/*
+ * Boot checkpoints, in the order boot passes them. Each one closes the
+ * phase named in the report, which runs from the previous checkpoint
+ * reached. _start stores BOOT_ENTRY itself, the time before it is
+ * firmware.
+ */
+typedef enum
+{
+    BOOT_ENTRY,            // _start, entry.s
+    BOOT_CMAIN,            // boot_cmain
+    BOOT_DTB_INDEXED,      // dtb_parse has the index
+    BOOT_DTB_PARSED,
+    BOOT_CONSOLE,          // kmain has the UART and SBI
+    BOOT_PHYS_ZONES,       // phys_init has the zones and their metadata
+    BOOT_PHYS_INIT,
+    BOOT_PAGING,
+    BOOT_SERVICES,         // Caches, scheduler, timers, interrupts
+    BOOT_BENCH,            // IRIS_BENCH only
+    BOOT_ROOT,
+    BOOT_HARTS,
+    BOOT_CHECKPOINTS,
+}
+boot_checkpoint_t;
+
+typedef struct
+{
+    uint64_t time;         // rdtime, 0 if the checkpoint wasn't reached
+    uint64_t cycle;        // rdcycle
+}
+boot_stamp_t;
+
+extern boot_stamp_t boot_stamps[BOOT_CHECKPOINTS];
+
+static inline void boot_checkpoint(boot_checkpoint_t checkpoint)
+{
+    boot_stamps[checkpoint].time = csr_read(time);
+    boot_stamps[checkpoint].cycle = csr_read(cycle);
+}
+
+/* Log how long each phase took, in microseconds with the DTB's timebase-frequency */
+void boot_report(const boot_info_t* info);
+
+#endif // BOOTPROF_H
@@ -0,0 +1,159 @@
+#include "cap.h"
+#include "../memory/physical.h"
+
+#ifdef IRIS_BENCH
+#include "../cpu/csr.h"
+#include "../memory/aspace.h"
+#include "klog.h"
+#endif
+
+_Static_assert(sizeof(cap_t) == 16, "four cap slots per cache line");
+_Static_assert(CAP_LEAF_SLOTS * sizeof(cap_t) == PAGE_SIZE, "a cap leaf is one page");
+_Static_assert(CAP_ROOT_SLOTS * sizeof(cap_t*) == PAGE_SIZE, "the cap root is one page");
+
+/* Generations are never reused, 48 bits of them don't run out */
+static uint64_t next_generation = 1;
+
+void kobject_init(kobject_t* object)
+{
+    object->generation = __atomic_fetch_add(&next_generation, 1, __ATOMIC_RELAXED);
+}
+
+void cap_revoke(kobject_t* object)
+{
+    __atomic_store_n(&object->generation, __atomic_fetch_add(&next_generation, 1, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+}
+
+void cspace_init(cspace_t* cs)
+{
+    cs->lock.locked = 0;
+    cs->root = 0;
+
+    // Index 0 is never handed out, a zeroed register names no cap
+    cs->free_hint = 1;
+}
+
+void cspace_destroy(cspace_t* cs)
+{
+    if(!cs->root)
+        return;
+
+    for(int i = 0; i < CAP_ROOT_SLOTS; i++)
+        if(cs->root[i])
+            phys_free(cs->root[i]);
+
+    phys_free(cs->root);
+    cs->root = 0;
+}
+
+long cap_insert(cspace_t* cs, cap_type_t type, uint32_t rights, kobject_t* object)
+{
+    spin_lock(&cs->lock);
+
+    if(!cs->root)
+        __atomic_store_n(&cs->root, (cap_t**)phys_alloc_zeroed(), __ATOMIC_RELEASE);
+
+    for(uintptr_t index = cs->free_hint; cs->root && index < CAP_SLOTS; index++)
+    {
+        cap_t** entry = &cs->root[index >> CAP_LEAF_BITS];
+
+        if(!*entry)
+        {
+            cap_t* leaf = phys_alloc_zeroed();
+            if(!leaf)
+                break;
+
+            __atomic_store_n(entry, leaf, __ATOMIC_RELEASE);
+        }
+
+        cap_t* slot = &(*entry)[index & (CAP_LEAF_SLOTS - 1)];
+        if(slot->tag)
+            continue;
+
+        /* The object before the tag, a lookup that sees the tag sees the object */
+        slot->object = object;
+        __atomic_store_n(&slot->tag, CAP_TAG(object->generation, type, rights), __ATOMIC_RELEASE);
+
+        cs->free_hint = index + 1;
+        spin_unlock(&cs->lock);
+        return (long)index;
+    }
+
+    spin_unlock(&cs->lock);
+    return -1;
+}
+
+bool cap_delete(cspace_t* cs, uintptr_t index)
+{
+    if(index == 0 || index >= CAP_SLOTS)
+        return false;
+
+    spin_lock(&cs->lock);
+
+    cap_t* leaf = cs->root ? cs->root[index >> CAP_LEAF_BITS] : 0;
+    cap_t* slot = leaf ? &leaf[index & (CAP_LEAF_SLOTS - 1)] : 0;
+
+    if(!slot || !slot->tag)
+    {
+        spin_unlock(&cs->lock);
+        return false;
+    }
+
+    __atomic_store_n(&slot->tag, 0, __ATOMIC_RELEASE);
+    slot->object = 0;
+
+    if(index < cs->free_hint)
+        cs->free_hint = index;
+
+    spin_unlock(&cs->lock);
+    return true;
+}
+
+#ifdef IRIS_BENCH
+
+#define CAP_BENCH_CAPS 4096
+#define CAP_BENCH_LOOKUPS 4096
+
+void cap_bench(void)
+{
+    aspace_t* as = aspace_create();
+    if(!as)
+    {
+        klog("Cap bench: out of memory\n");
+        return;
+    }
+
+    kobject_t object;
+    kobject_init(&object);
+
+    for(int i = 0; i < CAP_BENCH_CAPS; i++)
+    {
+        if(cap_insert(&as->caps, CAP_ENDPOINT, CAP_RIGHT_SEND, &object) < 0)
+        {
+            klog("Cap bench: out of memory\n");
+            aspace_destroy(as);
+            return;
+        }
+    }
+
+    /* Same slot over and over, everything stays in L1 */
+    kobject_t* volatile sink;
+    uint64_t start = csr_read(cycle);
+    for(int i = 0; i < CAP_BENCH_LOOKUPS; i++)
+        sink = cap_lookup(&as->caps, 1, CAP_ENDPOINT, CAP_RIGHT_SEND);
+    uint64_t hot = csr_read(cycle) - start;
+
+    /* Stride through every leaf so each lookup touches a new line */
+    start = csr_read(cycle);
+    for(int i = 0; i < CAP_BENCH_LOOKUPS; i++)
+        sink = cap_lookup(&as->caps, 1 + (i * 4 + i / (CAP_BENCH_CAPS / 4)) % CAP_BENCH_CAPS, CAP_ENDPOINT, CAP_RIGHT_SEND);
+    uint64_t spread = csr_read(cycle) - start;
+
+    (void)sink;
+
+    klog("Cap lookup: hot %lu cycles, spread %lu cycles\n", hot / CAP_BENCH_LOOKUPS, spread / CAP_BENCH_LOOKUPS);
+
+    aspace_destroy(as);
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef CAP_H
+#define CAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../cpu/spinlock.h"
+
+/*
+ * Capability spaces are two-level radix tables: the upper bits of a cap
+ * index pick a leaf from the root page, the lower bits a slot in the
+ * leaf. Both levels are one page, a leaf holds 256 16-byte slots, four
+ * to a cache line.
+ */
+#define CAP_LEAF_BITS  8
+#define CAP_LEAF_SLOTS (1 << CAP_LEAF_BITS)
+#define CAP_ROOT_SLOTS 512
+#define CAP_SLOTS      (CAP_ROOT_SLOTS * CAP_LEAF_SLOTS)
+
+typedef enum
+{
+    CAP_NULL,
+    CAP_ENDPOINT,
+    CAP_CHANNEL,
+}
+cap_type_t;
+
+/* Endpoints: send to call, receive to recv and reply. Channels: producer and consumer end */
+#define CAP_RIGHT_SEND (1 << 0)
+#define CAP_RIGHT_RECV (1 << 1)
+
+/*
+ * Header of every object a capability can name. Its generation is unique
+ * for the lifetime of the system, a cap is valid only while it carries
+ * the same generation, so revoking is just moving the object to a new
+ * one. Caps are never walked, stale ones fail their next lookup.
+ *
+ * The object's memory has to stay an object of the same type, see
+ * SLAB_TYPESAFE, since a stale cap still points at it.
+ */
+typedef struct
+{
+    volatile uint64_t generation;
+}
+kobject_t;
+
+/* tag = generation << 16 | type << 8 | rights, 0 for an empty slot */
+typedef struct
+{
+    kobject_t* object;
+    volatile uint64_t tag;
+}
+cap_t;
+
+#define CAP_TAG(generation, type, rights) ((generation) << 16 | (uint64_t)(type) << 8 | (rights))
+
+typedef struct
+{
+    spinlock_t lock;           // Taken by inserts and deletes, lookups don't lock
+    cap_t** root;              // CAP_ROOT_SLOTS leaves, 0 until the first insert
+    uintptr_t free_hint;       // No free slot below this index
+}
+cspace_t;
+
+/* Give a new object its first generation */
+void kobject_init(kobject_t* object);
+
+/* Every cap to object stops working, new ones can be inserted after */
+void cap_revoke(kobject_t* object);
+
+void cspace_init(cspace_t* cs);
+void cspace_destroy(cspace_t* cs);
+
+/* Put a cap in the lowest free slot and return its index, or -1 */
+long cap_insert(cspace_t* cs, cap_type_t type, uint32_t rights, kobject_t* object);
+bool cap_delete(cspace_t* cs, uintptr_t index);
+
+/*
+ * Resolve index to an object of type with at least rights, or 0. Three
+ * dependent loads: root, leaf and the object's generation. Safe against
+ * concurrent inserts and deletes without a lock: a slot read halfway
+ * through a change pairs a tag with an object of a different generation.
+ * The generation the cap carries goes to *generation, an object can be
+ * revoked and reused right after, so check it again under its lock.
+ */
+static inline kobject_t* cap_lookup_generation(cspace_t* cs, uintptr_t index, cap_type_t type, uint32_t rights,
+                                               uint64_t* generation)
+{
+    cap_t** root = __atomic_load_n(&cs->root, __ATOMIC_ACQUIRE);
+
+    if(index >= CAP_SLOTS || !root)
+        return 0;
+
+    cap_t* leaf = __atomic_load_n(&root[index >> CAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if(!leaf)
+        return 0;
+
+    cap_t* slot = &leaf[index & (CAP_LEAF_SLOTS - 1)];
+    uint64_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    kobject_t* object = __atomic_load_n(&slot->object, __ATOMIC_RELAXED);
+
+    if(!object || ((tag >> 8) & 0xFF) != type || (tag & rights) != rights)
+        return 0;
+
+    if(__atomic_load_n(&object->generation, __ATOMIC_ACQUIRE) != tag >> 16)
+        return 0;
+
+    *generation = tag >> 16;
+    return object;
+}
+
+static inline kobject_t* cap_lookup(cspace_t* cs, uintptr_t index, cap_type_t type, uint32_t rights)
+{
+    uint64_t generation;
+    return cap_lookup_generation(cs, index, type, rights, &generation);
+}
+
+/* Whether object is still what a cap of generation named, call with its lock held */
+static inline bool kobject_live(kobject_t* object, uint64_t generation)
+{
+    return __atomic_load_n(&object->generation, __ATOMIC_ACQUIRE) == generation;
+}
+
+#ifdef IRIS_BENCH
+/* Time cap_lookup on a hot slot and across many leaves */
+void cap_bench(void);
+#endif
+
+#endif // CAP_H
@@ -0,0 +1,201 @@
+#include "channel.h"
+#include "../memory/physical.h"
+#include "../memory/slab.h"
+
+#define CHANNEL_ERROR ((uintptr_t)-1)
+
+_Static_assert(sizeof(channel_ring_t) == 2 * CACHE_LINE_SIZE, "channel_ring_t keeps each side on its own line");
+
+static slab_cache_t* channel_cache;
+
+/* Only when the slab is carved, a stale waiter may still spin on a freed channel's lock */
+static void channel_ctor(void* object)
+{
+    channel_t* channel = object;
+
+    kobject_init(&channel->object);
+    channel->lock.locked = 0;
+}
+
+bool channel_init(void)
+{
+    channel_cache = slab_cache_create("channel", sizeof(channel_t), SLAB_TYPESAFE, channel_ctor);
+    return channel_cache != 0;
+}
+
+static channel_t* channel_fail(channel_t* channel, channel_ring_t* ring, size_t pages)
+{
+    if(ring)
+        phys_free_contiguous(ring, pages);
+    if(channel)
+        slab_free(channel_cache, channel);
+
+    return 0;
+}
+
+channel_t* channel_create(uint32_t slots, uint32_t slot_size,
+                   aspace_t* producer, uintptr_t producer_va,
+                   aspace_t* consumer, uintptr_t consumer_va)
+{
+    if(slots == 0 || (slots & (slots - 1)) || slot_size == 0)
+        return 0;
+
+    size_t data_size = ALIGN_UP((size_t)slots * slot_size, PAGE_SIZE);
+    size_t pages = 1 + data_size / PAGE_SIZE;
+
+    channel_t* channel = slab_alloc(channel_cache);
+    channel_ring_t* ring = phys_alloc_contiguous(pages, PAGE_SIZE);
+
+    if(!channel || !ring)
+        return channel_fail(channel, ring, pages);
+
+    uint64_t* words = (uint64_t*)ring;
+    for(size_t i = 0; i < pages * PAGE_SIZE / 8; i++)
+        words[i] = 0;
+
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+
+    /*
+     * The same physical pages in both address spaces, nothing is ever
+     * copied. There is no unmap yet, so a failure halfway leaves the
+     * first mappings behind until the address space goes. User space can
+     * still reach the ring then, so it is leaked rather than freed.
+     */
+    uintptr_t data = (uintptr_t)ring + PAGE_SIZE;
+    if(!aspace_map(producer, producer_va, (uintptr_t)ring, pages * PAGE_SIZE, PTE_R | PTE_W) ||
+       !aspace_map(consumer, consumer_va, (uintptr_t)ring, PAGE_SIZE, PTE_R | PTE_W) ||
+       !aspace_map(consumer, consumer_va + PAGE_SIZE, data, data_size, PTE_R))
+        return channel_fail(channel, 0, 0);
+
+    /* A reused channel keeps the generation it was revoked to, no cap carries it */
+    channel->ring = ring;
+    channel->pages = pages;
+    channel->waiters[CHANNEL_CONSUMER] = 0;
+    channel->waiters[CHANNEL_PRODUCER] = 0;
+
+    return channel;
+}
+
+/*
+ * The channel a6 names in the caller's cap space, if the cap carries
+ * rights, and the generation to check under its lock
+ */
+static inline channel_t* channel_get(trap_frame_t* frame, uint32_t rights, uint64_t* generation)
+{
+    thread_t* thread = (thread_t*)frame;
+    return (channel_t*)cap_lookup_generation(&thread->aspace->caps, frame->regs[REG_A6], CAP_CHANNEL, rights,
+                                             generation);
+}
+
+trap_frame_t* channel_wait(trap_frame_t* frame)
+{
+    uintptr_t end = frame->regs[REG_A0];
+    uint64_t generation;
+    channel_t* channel = end > CHANNEL_PRODUCER ? 0 : channel_get(frame, CHANNEL_RIGHT(end), &generation);
+
+    if(!channel)
+    {
+        frame->regs[REG_A0] = CHANNEL_ERROR;
+        return frame;
+    }
+
+    thread_t* thread = (thread_t*)frame;
+
+    frame->regs[REG_A0] = 0;
+
+    spin_lock(&channel->lock);
+
+    /*
+     * Gone, and maybe reused, since the lookup. One waiter per end, a
+     * second one would overwrite the first and leave it asleep.
+     */
+    if(!kobject_live(&channel->object, generation) || channel->waiters[end])
+    {
+        spin_unlock(&channel->lock);
+        frame->regs[REG_A0] = CHANNEL_ERROR;
+        return frame;
+    }
+
+    /*
+     * The peer publishes its index before checking our event index, and
+     * notify takes the lock, so either we see the new index here or the
+     * peer finds us in waiters.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    volatile uint32_t* index = end == CHANNEL_CONSUMER ? &channel->ring->head : &channel->ring->tail;
+    if(*index != (uint32_t)frame->regs[REG_A1])
+    {
+        spin_unlock(&channel->lock);
+        return frame;
+    }
+
+    thread->state = THREAD_BLOCKED_EVENT;
+    channel->waiters[end] = thread;
+    thread->channel = channel;
+
+    spin_unlock(&channel->lock);
+
+    return thread_switch_next();
+}
+
+trap_frame_t* channel_notify(trap_frame_t* frame)
+{
+    uintptr_t end = frame->regs[REG_A0];
+
+    /* Waking an end is what its peer does */
+    uint64_t generation;
+    channel_t* channel = end > CHANNEL_PRODUCER ? 0 : channel_get(frame, CHANNEL_RIGHT(end ^ 1), &generation);
+
+    if(!channel)
+    {
+        frame->regs[REG_A0] = CHANNEL_ERROR;
+        return frame;
+    }
+
+    frame->regs[REG_A0] = 0;
+
+    spin_lock(&channel->lock);
+
+    if(!kobject_live(&channel->object, generation))
+    {
+        spin_unlock(&channel->lock);
+        frame->regs[REG_A0] = CHANNEL_ERROR;
+        return frame;
+    }
+
+    thread_t* waiter = channel->waiters[end];
+    channel->waiters[end] = 0;
+    if(waiter)
+        waiter->channel = 0;
+
+    spin_unlock(&channel->lock);
+
+    if(waiter)
+        thread_wake(waiter);
+
+    return frame;
+}
+
+void channel_cancel(thread_t* thread)
+{
+    channel_t* channel = __atomic_load_n(&thread->channel, __ATOMIC_RELAXED);
+    if(!channel)
+        return;
+
+    spin_lock(&channel->lock);
+
+    /* A notify may have taken it out while the lock was free */
+    if(thread->channel == channel)
+    {
+        for(int end = CHANNEL_CONSUMER; end <= CHANNEL_PRODUCER; end++)
+        {
+            if(channel->waiters[end] == thread)
+                channel->waiters[end] = 0;
+        }
+
+        thread->channel = 0;
+    }
+
+    spin_unlock(&channel->lock);
+}
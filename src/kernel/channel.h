@@ -0,0 +1,89 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../cpu/hart.h"
+#include "../cpu/spinlock.h"
+#include "cap.h"
+#include "thread.h"
+
+/* Which end a waiter or notification refers to */
+#define CHANNEL_CONSUMER 0
+#define CHANNEL_PRODUCER 1
+
+/* Right a cap needs to act as an end */
+#define CHANNEL_RIGHT(end) ((end) == CHANNEL_CONSUMER ? CAP_RIGHT_RECV : CAP_RIGHT_SEND)
+
+/*
+ * Shared header on the first page of a channel, the slots follow on the
+ * next page. Indices run freely and wrap, slot i lives at i & (slots - 1).
+ * Each side only writes its own cache line.
+ */
+typedef struct
+{
+    /* Written by the producer */
+    volatile uint32_t head;        // Next slot to fill
+    volatile uint32_t tail_event;  // Notify the producer once tail passes this
+    uint32_t slots;
+    uint32_t slot_size;
+    uint8_t pad0[CACHE_LINE_SIZE - 16];
+
+    /* Written by the consumer */
+    volatile uint32_t tail;        // Next slot to drain
+    volatile uint32_t head_event;  // Notify the consumer once head passes this
+    uint8_t pad1[CACHE_LINE_SIZE - 8];
+}
+channel_ring_t;
+
+/*
+ * After moving an index from old to new, the peer wants a notification
+ * only if the event index it published lies in [old, new). A peer that is
+ * running leaves its event index behind, so it gets no notifications.
+ * Same rule as virtio's event index.
+ */
+static inline bool channel_need_event(uint32_t event, uint32_t new_index, uint32_t old_index)
+{
+    return (uint32_t)(new_index - event - 1) < (uint32_t)(new_index - old_index);
+}
+
+/* The kobject comes first, caps point at it */
+typedef struct channel
+{
+    kobject_t object;
+    spinlock_t lock;
+    channel_ring_t* ring;
+    size_t pages;
+    thread_t* waiters[2];  // Sleeping consumer and producer
+}
+channel_t;
+
+/* Object cache for channel_t */
+bool channel_init(void);
+
+/*
+ * Create a channel of slots * slot_size bytes, slots a power of two, and
+ * map it at producer_va in producer and consumer_va in consumer. The
+ * consumer gets the slots read-only. The producer's cap needs
+ * CAP_RIGHT_SEND, the consumer's CAP_RIGHT_RECV.
+ */
+channel_t* channel_create(uint32_t slots, uint32_t slot_size,
+                   aspace_t* producer, uintptr_t producer_va,
+                   aspace_t* consumer, uintptr_t consumer_va);
+
+/*
+ * Syscalls on the channel cap in a6. wait blocks the caller as end a0
+ * unless the index the peer moves (head for the consumer, tail for the
+ * producer) differs from a1, and fails if another thread already waits
+ * as that end. notify wakes end a0 if it sleeps. Both need the rights of
+ * the end the caller acts as.
+ */
+trap_frame_t* channel_wait(trap_frame_t* frame);
+trap_frame_t* channel_notify(trap_frame_t* frame);
+
+/* Take a thread that goes away out of the waiters slot it sleeps in */
+void channel_cancel(thread_t* thread);
+
+#endif // CHANNEL_H
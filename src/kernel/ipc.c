@@ -0,0 +1,382 @@
+#include "ipc.h"
+#include "../memory/physical.h"
+#include "../memory/slab.h"
+#include "klog.h"
+
+#define IPC_ERROR ((uintptr_t)-1)
+
+static slab_cache_t* endpoint_cache;
+
+/* Only when the slab is carved, a stale caller may still spin on a freed endpoint's lock */
+static void endpoint_ctor(void* object)
+{
+    endpoint_t* ep = object;
+
+    kobject_init(&ep->object);
+    ep->lock.locked = 0;
+}
+
+bool ipc_init(void)
+{
+    endpoint_cache = slab_cache_create("endpoint", sizeof(endpoint_t), SLAB_TYPESAFE, endpoint_ctor);
+    return endpoint_cache != 0;
+}
+
+endpoint_t* ipc_endpoint_create(void)
+{
+    endpoint_t* ep = slab_alloc(endpoint_cache);
+    if(!ep)
+        return 0;
+
+    /* A reused endpoint keeps the generation it was revoked to, no cap carries it */
+    ep->senders = 0;
+    ep->senders_tail = 0;
+    ep->receivers = 0;
+
+    return ep;
+}
+
+void ipc_endpoint_destroy(endpoint_t* ep)
+{
+    /* Under the lock, so whoever checked the generation under it is done with ep */
+    spin_lock(&ep->lock);
+    cap_revoke(&ep->object);
+    spin_unlock(&ep->lock);
+
+    slab_free(endpoint_cache, ep);
+}
+
+/* Unlink thread from a singly linked queue, ep->lock must be held */
+static thread_t* queue_remove(thread_t** head, thread_t* thread)
+{
+    thread_t* prev = 0;
+
+    for(thread_t** link = head; *link; prev = *link, link = &(*link)->next)
+    {
+        if(*link == thread)
+        {
+            *link = thread->next;
+            break;
+        }
+    }
+
+    return prev;
+}
+
+void ipc_cancel(thread_t* thread)
+{
+    endpoint_t* ep = __atomic_load_n(&thread->endpoint, __ATOMIC_RELAXED);
+
+    if(ep)
+    {
+        spin_lock(&ep->lock);
+
+        /* It may have been handed a message while the lock was free */
+        if(thread->endpoint == ep)
+        {
+            if(thread->state == THREAD_BLOCKED_SEND)
+            {
+                thread_t* prev = queue_remove(&ep->senders, thread);
+                if(ep->senders_tail == thread)
+                    ep->senders_tail = prev;
+            }
+            else
+            {
+                queue_remove(&ep->receivers, thread);
+            }
+
+            thread->endpoint = 0;
+        }
+
+        spin_unlock(&ep->lock);
+    }
+
+    /* A server still holding it as its caller would reply into a freed thread */
+    thread_t* replier = thread->replier;
+    thread->replier = 0;
+
+    if(replier)
+    {
+        thread_t* expected = thread;
+        __atomic_compare_exchange_n(&replier->reply_to, &expected, 0, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    thread_t* reply = __atomic_exchange_n(&thread->reply_to, 0, __ATOMIC_RELAXED);
+
+    if(reply)
+    {
+        reply->replier = 0;
+        reply->frame.regs[REG_A0] = IPC_ERROR;
+        thread_wake(reply);
+    }
+}
+
+/* The endpoint a6 names in the caller's cap space, and the generation to check under its lock */
+static inline endpoint_t* endpoint_get(trap_frame_t* frame, uint32_t rights, uint64_t* generation)
+{
+    thread_t* thread = (thread_t*)frame;
+    return (endpoint_t*)cap_lookup_generation(&thread->aspace->caps, frame->regs[REG_A6], CAP_ENDPOINT, rights,
+                                              generation);
+}
+
+static inline void copy_msg(thread_t* from, thread_t* to)
+{
+    for(int i = 0; i < IPC_MSG_REGS; i++)
+        to->frame.regs[REG_A0 + i] = from->frame.regs[REG_A0 + i];
+}
+
+trap_frame_t* ipc_call(trap_frame_t* frame)
+{
+    thread_t* caller = (thread_t*)frame;
+    uint64_t generation;
+    endpoint_t* ep = endpoint_get(frame, CAP_RIGHT_SEND, &generation);
+
+    if(!ep)
+    {
+        frame->regs[REG_A0] = IPC_ERROR;
+        return frame;
+    }
+
+    spin_lock(&ep->lock);
+
+    /* Destroyed, and maybe reused, since the lookup */
+    if(!kobject_live(&ep->object, generation))
+    {
+        spin_unlock(&ep->lock);
+        frame->regs[REG_A0] = IPC_ERROR;
+        return frame;
+    }
+
+    thread_t* receiver = ep->receivers;
+    if(receiver)
+    {
+        ep->receivers = receiver->next;
+        receiver->endpoint = 0;
+        caller->state = THREAD_BLOCKED_REPLY;
+    }
+    else
+    {
+        caller->state = THREAD_BLOCKED_SEND;
+        caller->endpoint = ep;
+        caller->next = 0;
+
+        if(ep->senders_tail)
+            ep->senders_tail->next = caller;
+        else
+            ep->senders = caller;
+        ep->senders_tail = caller;
+    }
+
+    spin_unlock(&ep->lock);
+
+    if(!receiver)
+        return thread_switch_next();
+
+    /*
+     * Fast path: the message goes register to register and the receiver
+     * runs on the rest of the caller's timeslice, the scheduler never
+     * sees the hand-off.
+     */
+    copy_msg(caller, receiver);
+    receiver->reply_to = caller;
+    caller->replier = receiver;
+    receiver->timeslice = caller->timeslice;
+
+    return thread_switch_to(receiver);
+}
+
+/* Wait on ep for the next caller after replying to reply, if any */
+static trap_frame_t* ipc_wait(thread_t* receiver, endpoint_t* ep, uint64_t generation, thread_t* reply)
+{
+    spin_lock(&ep->lock);
+
+    if(!kobject_live(&ep->object, generation))
+    {
+        spin_unlock(&ep->lock);
+        receiver->frame.regs[REG_A0] = IPC_ERROR;
+
+        if(reply)
+            thread_wake(reply);
+
+        return &receiver->frame;
+    }
+
+    thread_t* sender = ep->senders;
+    if(sender)
+    {
+        ep->senders = sender->next;
+        if(!ep->senders)
+            ep->senders_tail = 0;
+
+        sender->endpoint = 0;
+        sender->state = THREAD_BLOCKED_REPLY;
+    }
+    else
+    {
+        receiver->state = THREAD_BLOCKED_RECV;
+        receiver->endpoint = ep;
+        receiver->next = ep->receivers;
+        ep->receivers = receiver;
+    }
+
+    spin_unlock(&ep->lock);
+
+    if(sender)
+    {
+        /* Someone was already queued, serve it and let the old caller queue for the hart */
+        copy_msg(sender, receiver);
+        receiver->reply_to = sender;
+        sender->replier = receiver;
+
+        if(reply)
+            thread_wake(reply);
+
+        return &receiver->frame;
+    }
+
+    /* Switch straight back to the caller, handing the timeslice back */
+    if(reply)
+        return thread_switch_to(reply);
+
+    return thread_switch_next();
+}
+
+trap_frame_t* ipc_reply_recv(trap_frame_t* frame)
+{
+    thread_t* receiver = (thread_t*)frame;
+    uint64_t generation;
+    endpoint_t* ep = endpoint_get(frame, CAP_RIGHT_RECV, &generation);
+
+    if(!ep)
+    {
+        frame->regs[REG_A0] = IPC_ERROR;
+        return frame;
+    }
+
+    /* Reply before waiting, once queued a new caller may overwrite the message */
+    thread_t* reply = __atomic_exchange_n(&receiver->reply_to, 0, __ATOMIC_RELAXED);
+
+    if(reply)
+    {
+        reply->replier = 0;
+        copy_msg(receiver, reply);
+        reply->timeslice = receiver->timeslice;
+    }
+
+    return ipc_wait(receiver, ep, generation, reply);
+}
+
+trap_frame_t* ipc_recv(trap_frame_t* frame)
+{
+    thread_t* receiver = (thread_t*)frame;
+    uint64_t generation;
+    endpoint_t* ep = endpoint_get(frame, CAP_RIGHT_RECV, &generation);
+
+    if(!ep)
+    {
+        frame->regs[REG_A0] = IPC_ERROR;
+        return frame;
+    }
+
+    /* A caller left without a reply would wait forever, fail its call instead */
+    thread_t* reply = __atomic_exchange_n(&receiver->reply_to, 0, __ATOMIC_RELAXED);
+
+    if(reply)
+    {
+        reply->replier = 0;
+        reply->frame.regs[REG_A0] = IPC_ERROR;
+        thread_wake(reply);
+    }
+
+    return ipc_wait(receiver, ep, generation, 0);
+}
+
+#ifdef IRIS_BENCH
+
+#define IPC_BENCH_ITERATIONS 1000
+
+extern char ipc_bench_user[];
+extern char ipc_bench_client[];
+extern char ipc_bench_server[];
+extern char ipc_bench_user_end[];
+
+/* Set up a client and a server on ep and time them, the caller frees everything given */
+static void ipc_bench_run(endpoint_t* ep, aspace_t* client_as, aspace_t* server_as, char* code)
+{
+    long client_cap = cap_insert(&client_as->caps, CAP_ENDPOINT, CAP_RIGHT_SEND, &ep->object);
+    long server_cap = cap_insert(&server_as->caps, CAP_ENDPOINT, CAP_RIGHT_RECV, &ep->object);
+
+    if(client_cap < 0 || server_cap < 0)
+    {
+        klog("IPC bench: out of memory\n");
+        return;
+    }
+
+    for(char* src = ipc_bench_user; src < ipc_bench_user_end; src++)
+        code[src - ipc_bench_user] = *src;
+    asm volatile("fence.i" : : : "memory");
+
+    /* Same code page, two address spaces, so every call switches satp */
+    if(!aspace_map(client_as, ASPACE_USER_BASE, (uintptr_t)code, PAGE_SIZE, PTE_R | PTE_X) ||
+       !aspace_map(server_as, ASPACE_USER_BASE, (uintptr_t)code, PAGE_SIZE, PTE_R | PTE_X))
+    {
+        klog("IPC bench: mapping failed\n");
+        return;
+    }
+
+    thread_t* client = thread_create(client_as, ASPACE_USER_BASE + (ipc_bench_client - ipc_bench_user), 0);
+    thread_t* server = thread_create(server_as, ASPACE_USER_BASE + (ipc_bench_server - ipc_bench_user), 0);
+
+    if(!client || !server)
+    {
+        klog("IPC bench: out of memory\n");
+
+        if(client)
+            thread_destroy(client);
+        if(server)
+            thread_destroy(server);
+        return;
+    }
+
+    client->frame.regs[REG_A0] = IPC_BENCH_ITERATIONS;
+    client->frame.regs[REG_A6] = client_cap;
+    server->frame.regs[REG_A6] = server_cap;
+
+    // The server blocks in recv, then the client calls it until done
+    thread_run(server);
+    thread_run(client);
+
+    klog("IPC call one-way: avg %lu cycles, min %lu cycles\n",
+         server->frame.regs[REG_S3] / IPC_BENCH_ITERATIONS, server->frame.regs[REG_S4]);
+    klog("IPC round trip: avg %lu cycles, min %lu cycles\n",
+         client->frame.regs[REG_A0] / IPC_BENCH_ITERATIONS, client->frame.regs[REG_A1]);
+
+    // The server is still queued on the endpoint, destroying it takes it off
+    thread_destroy(client);
+    thread_destroy(server);
+}
+
+void ipc_bench(void)
+{
+    endpoint_t* ep = ipc_endpoint_create();
+    aspace_t* client_as = aspace_create();
+    aspace_t* server_as = aspace_create();
+    char* code = phys_alloc(PAGE_SIZE);
+
+    if(ep && client_as && server_as && code)
+        ipc_bench_run(ep, client_as, server_as, code);
+    else
+        klog("IPC bench: out of memory\n");
+
+    if(client_as)
+        aspace_destroy(client_as);
+    if(server_as)
+        aspace_destroy(server_as);
+    if(ep)
+        ipc_endpoint_destroy(ep);
+    if(code)
+        phys_free(code);
+}
+
+#endif
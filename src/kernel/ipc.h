@@ -0,0 +1,56 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../cpu/spinlock.h"
+#include "cap.h"
+#include "thread.h"
+
+/* Message registers a0-a5 are copied from sender to receiver */
+#define IPC_MSG_REGS 6
+
+/* The kobject comes first, caps point at it */
+typedef struct endpoint
+{
+    kobject_t object;
+    spinlock_t lock;
+    thread_t* senders;         // Callers waiting for a receiver, FIFO
+    thread_t* senders_tail;
+    thread_t* receivers;       // Receivers waiting for a caller
+}
+endpoint_t;
+
+/* Object cache for endpoints */
+bool ipc_init(void);
+
+/* A new endpoint, reachable once cap_insert hands out caps to it */
+endpoint_t* ipc_endpoint_create(void);
+
+/* Revoke every cap to ep and free it, no thread may be queued on it */
+void ipc_endpoint_destroy(endpoint_t* ep);
+
+/*
+ * Take thread out of IPC before it goes away: off the queue it waits in,
+ * out of the server that owes it a reply, and a caller still waiting for
+ * its reply gets an error instead.
+ */
+void ipc_cancel(thread_t* thread);
+
+/*
+ * Syscalls, a6 holds the endpoint cap and a0-a5 the message. Calling
+ * needs CAP_RIGHT_SEND, the other two CAP_RIGHT_RECV.
+ * call sends and waits for the reply, reply_recv answers the last
+ * caller and waits for the next one, recv only waits.
+ */
+trap_frame_t* ipc_call(trap_frame_t* frame);
+trap_frame_t* ipc_reply_recv(trap_frame_t* frame);
+trap_frame_t* ipc_recv(trap_frame_t* frame);
+
+#ifdef IRIS_BENCH
+/* Time call/reply between two address spaces with rdcycle */
+void ipc_bench(void);
+#endif
+
+#endif // IPC_H
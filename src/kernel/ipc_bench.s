@@ -0,0 +1,71 @@
+.option norvc
+
+.equ SYS_EXIT,        1
+.equ SYS_CALL,        2
+.equ SYS_REPLY_RECV,  3
+.equ SYS_RECV,        4
+
+.section .text
+
+/*
+ * User-mode code for ipc_bench, copied into a page both threads map.
+ * Both start with their endpoint cap in a6.
+ */
+.global ipc_bench_user
+.global ipc_bench_client
+.global ipc_bench_server
+.global ipc_bench_user_end
+ipc_bench_user:
+
+/*
+ * a0 calls, each carrying its start time. Exits with the total round
+ * trip in a0 and the fastest in a1.
+ */
+ipc_bench_client:
+	mv s0, a0
+	mv s5, a6
+	li s3, 0
+	li s4, -1
+1:
+	rdcycle s1
+	mv a0, s1
+	mv a6, s5
+	li a7, SYS_CALL
+	ecall
+	rdcycle s2
+	sub s2, s2, s1
+	add s3, s3, s2
+	bgeu s2, s4, 2f
+	mv s4, s2
+2:
+	addi s0, s0, -1
+	bnez s0, 1b
+
+	mv a0, s3
+	mv a1, s4
+	li a7, SYS_EXIT
+	ecall
+3:
+	j 3b
+
+/* Replies forever, keeps the total call latency in s3 and the fastest in s4 */
+ipc_bench_server:
+	mv s5, a6
+	li s3, 0
+	li s4, -1
+	li a7, SYS_RECV
+	ecall
+1:
+	rdcycle s2
+	sub s2, s2, a0
+	add s3, s3, s2
+	bgeu s2, s4, 2f
+	mv s4, s2
+2:
+	mv a6, s5
+	li a7, SYS_REPLY_RECV
+	ecall
+	j 1b
+ipc_bench_user_end:
+
+.end
@@ -0,0 +1,347 @@
+#include <stdarg.h>
+
+#include "klog.h"
+#include "../cpu/csr.h"
+#include "../device/uart.h"
+#include "../memory/physical.h"
+
+_Static_assert((KLOG_RING_WORDS & (KLOG_RING_WORDS - 1)) == 0, "KLOG_RING_WORDS must be a power of two");
+_Static_assert(__builtin_offsetof(klog_ring_t, tail) == CACHE_LINE_SIZE, "klog_ring_t keeps the writer and the drain on their own lines");
+
+/* Hart 0 logs before there is a PMM to allocate rings from */
+static klog_ring_t boot_ring;
+static klog_ring_t* rings[HARTS_MAX] = { &boot_ring };
+static int ring_count = 1;
+
+static uint32_t drain_lock;
+static void (*klog_sink)(const char* line) = uart_puts;
+
+/* Conversion of a format, as far as klog needs to know */
+typedef struct
+{
+    char conv;     // d i u x c s p, 0 at the end of the format
+    bool wide;     // 64-bit argument
+    bool zero;
+    int width;
+}
+klog_spec_t;
+
+/* Step over literal text to the next conversion, *fmt ends up behind it */
+static klog_spec_t next_spec(const char** fmt)
+{
+    klog_spec_t spec = { 0, false, false, 0 };
+    const char* p = *fmt;
+
+    while(*p)
+    {
+        if(*p++ != '%')
+            continue;
+
+        if(*p == '%')
+        {
+            p++;
+            continue;
+        }
+
+        if(*p == '0')
+        {
+            spec.zero = true;
+            p++;
+        }
+
+        while(*p >= '0' && *p <= '9')
+            spec.width = spec.width * 10 + (*p++ - '0');
+
+        while(*p == 'l' || *p == 'z')
+        {
+            spec.wide = true;
+            p++;
+        }
+
+        spec.conv = *p ? *p++ : 0;
+        spec.wide |= spec.conv == 's' || spec.conv == 'p';
+        break;
+    }
+
+    *fmt = p;
+    return spec;
+}
+
+bool klog_init(boot_info_t* info)
+{
+    int harts = info->core_count > 0 ? info->core_count : 1;
+    if(harts > HARTS_MAX)
+        harts = HARTS_MAX;
+
+    for(int i = 1; i < harts; i++)
+    {
+        klog_ring_t* ring = phys_alloc(sizeof(klog_ring_t));
+        if(!ring)
+            return false;
+
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->reported = 0;
+        ring->timer_ready = false;
+        rings[i] = ring;
+    }
+
+    __atomic_store_n(&ring_count, harts, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void drain_timer_fn(ktimer_t* timer)
+{
+    (void)timer;
+    klog_drain();
+}
+
+void klog_init_hart(void)
+{
+    unsigned int self = hart_current();
+
+    if(self >= (unsigned int)ring_count)
+        return;
+
+    timer_setup(&rings[self]->drain_timer, drain_timer_fn, 0);
+    rings[self]->timer_ready = true;
+}
+
+void klog(const char* fmt, ...)
+{
+    unsigned int self = hart_current();
+    if(self >= (unsigned int)__atomic_load_n(&ring_count, __ATOMIC_ACQUIRE))
+        return;
+
+    /* Only this hart writes the ring and kernel code runs with interrupts off */
+    klog_ring_t* ring = rings[self];
+    uint64_t args[KLOG_ARGS_MAX];
+    int argc = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    const char* p = fmt;
+    for(klog_spec_t spec = next_spec(&p); spec.conv && argc < KLOG_ARGS_MAX; spec = next_spec(&p))
+    {
+        if(spec.conv == 's' || spec.conv == 'p')
+            args[argc++] = (uintptr_t)va_arg(ap, void*);
+        else if(spec.wide)
+            args[argc++] = va_arg(ap, uint64_t);
+        else if(spec.conv == 'd' || spec.conv == 'i')
+            args[argc++] = (uint64_t)(int64_t)va_arg(ap, int);
+        else
+            args[argc++] = va_arg(ap, unsigned int);
+    }
+
+    va_end(ap);
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(head + 2 + argc - tail > KLOG_RING_WORDS)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    ring->words[head++ & (KLOG_RING_WORDS - 1)] = csr_read(time);
+    ring->words[head++ & (KLOG_RING_WORDS - 1)] = (uintptr_t)fmt;
+    for(int i = 0; i < argc; i++)
+        ring->words[head++ & (KLOG_RING_WORDS - 1)] = args[i];
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    if(ring->timer_ready && !timer_armed(&ring->drain_timer))
+        timer_arm(&ring->drain_timer, KLOG_DRAIN_TICKS);
+}
+
+void klog_set_sink(void (*sink)(const char* line))
+{
+    __atomic_store_n(&klog_sink, sink, __ATOMIC_RELEASE);
+}
+
+/* Line builder for the drain */
+typedef struct
+{
+    char text[KLOG_LINE_MAX];
+    int len;
+}
+klog_line_t;
+
+static void put_char(klog_line_t* line, char c)
+{
+    if(line->len < KLOG_LINE_MAX - 1)
+        line->text[line->len++] = c;
+}
+
+static void put_number(klog_line_t* line, uint64_t value, int base, bool negative, int width, char fill)
+{
+    char digits[24];
+    int count = 0;
+
+    do
+    {
+        int digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    }
+    while(value);
+
+    if(negative && fill == '0')
+        put_char(line, '-');
+
+    for(int i = count + negative; i < width; i++)
+        put_char(line, fill);
+
+    if(negative && fill != '0')
+        put_char(line, '-');
+
+    while(count)
+        put_char(line, digits[--count]);
+}
+
+/* Format the record at tail of ring, returns its length in words */
+static int format_record(klog_ring_t* ring, uint64_t tail, unsigned int hart, klog_line_t* line)
+{
+    uint64_t stamp = ring->words[tail & (KLOG_RING_WORDS - 1)];
+    const char* fmt = (const char*)(uintptr_t)ring->words[(tail + 1) & (KLOG_RING_WORDS - 1)];
+    int argc = 0;
+
+    line->len = 0;
+
+    /* Seconds since boot once the timebase is known, raw rdtime before */
+    uint64_t timebase = timer_timebase();
+    put_char(line, '[');
+    if(timebase)
+    {
+        put_number(line, stamp / timebase, 10, false, 5, ' ');
+        put_char(line, '.');
+        put_number(line, (stamp % timebase) * 1000000 / timebase, 10, false, 6, '0');
+    }
+    else
+        put_number(line, stamp, 10, false, 12, ' ');
+
+    put_char(line, ' ');
+    put_char(line, 'h');
+    put_number(line, hart, 10, false, 0, ' ');
+    put_char(line, ']');
+    put_char(line, ' ');
+
+    for(const char* p = fmt; *p; )
+    {
+        /* Copy literal text up to the next conversion */
+        if(*p != '%' || p[1] == '%')
+        {
+            put_char(line, *p);
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        klog_spec_t spec = next_spec(&p);
+        if(!spec.conv)
+            break;
+
+        uint64_t value = argc < KLOG_ARGS_MAX ? ring->words[(tail + 2 + argc) & (KLOG_RING_WORDS - 1)] : 0;
+        argc++;
+
+        char fill = spec.zero ? '0' : ' ';
+        switch(spec.conv)
+        {
+            case 'd':
+            case 'i':
+            {
+                int64_t v = spec.wide ? (int64_t)value : (int32_t)value;
+                put_number(line, v < 0 ? -(uint64_t)v : (uint64_t)v, 10, v < 0, spec.width, fill);
+                break;
+            }
+            case 'u':
+                put_number(line, value, 10, false, spec.width, fill);
+                break;
+            case 'x':
+                put_number(line, value, 16, false, spec.width, fill);
+                break;
+            case 'p':
+                put_char(line, '0');
+                put_char(line, 'x');
+                put_number(line, value, 16, false, 16, '0');
+                break;
+            case 'c':
+                put_char(line, (char)value);
+                break;
+            case 's':
+                for(const char* s = value ? (const char*)(uintptr_t)value : "(null)"; *s; s++)
+                    put_char(line, *s);
+                break;
+            default:
+                put_char(line, '?');
+                break;
+        }
+    }
+
+    line->text[line->len] = '\0';
+    return 2 + (argc < KLOG_ARGS_MAX ? argc : KLOG_ARGS_MAX);
+}
+
+void klog_drain(void)
+{
+    /* One drain at a time keeps lines whole, a busy drain will pick up our records too */
+    if(__atomic_exchange_n(&drain_lock, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    klog_line_t line;
+
+    while(true)
+    {
+        /* Merge the rings by timestamp, oldest record first */
+        klog_ring_t* oldest = 0;
+        unsigned int hart = 0;
+
+        for(int i = 0; i < count; i++)
+        {
+            klog_ring_t* ring = rings[i];
+            uint64_t tail = ring->tail;
+
+            if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                continue;
+
+            if(!oldest || ring->words[tail & (KLOG_RING_WORDS - 1)] < oldest->words[oldest->tail & (KLOG_RING_WORDS - 1)])
+            {
+                oldest = ring;
+                hart = i;
+            }
+        }
+
+        if(!oldest)
+            break;
+
+        int words = format_record(oldest, oldest->tail, hart, &line);
+        __atomic_store_n(&oldest->tail, oldest->tail + words, __ATOMIC_RELEASE);
+
+        klog_sink(line.text);
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        uint64_t dropped = __atomic_load_n(&rings[i]->dropped, __ATOMIC_RELAXED);
+        if(dropped == rings[i]->reported)
+            continue;
+
+        line.len = 0;
+        for(const char* s = "[klog] records dropped on hart "; *s; s++)
+            put_char(&line, *s);
+        put_number(&line, i, 10, false, 0, ' ');
+        put_char(&line, ':');
+        put_char(&line, ' ');
+        put_number(&line, dropped - rings[i]->reported, 10, false, 0, ' ');
+        put_char(&line, '\n');
+        line.text[line.len] = '\0';
+
+        rings[i]->reported = dropped;
+        klog_sink(line.text);
+    }
+
+    __atomic_store_n(&drain_lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,60 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../bootinfo.h"
+#include "../cpu/hart.h"
+#include "timer.h"
+
+/*
+ * Kernel log. klog only stores a binary record in the executing hart's
+ * ring: rdtime, the format string's address and the raw arguments.
+ * Formatting and the console happen later in klog_drain, which idle
+ * harts and a short per-hart timer run, so logging neither stalls the
+ * caller on the UART nor interleaves the output of several harts.
+ *
+ * Formats take %d %i %u %x %c %s %p and %%, with an optional 0 flag,
+ * width and l, ll or z. The format and %s strings are read at drain
+ * time and must stay around, string literals and boot data do.
+ */
+#define KLOG_RING_WORDS 1024       // Per hart, a power of two
+#define KLOG_ARGS_MAX   8
+#define KLOG_LINE_MAX   256
+
+/* Ticks between a record and the drain its hart schedules */
+#define KLOG_DRAIN_TICKS 10
+
+typedef struct
+{
+    volatile uint64_t head;        // Written by the owning hart
+    uint64_t dropped;              // Records that didn't fit
+    ktimer_t drain_timer;
+    bool timer_ready;
+    uint8_t pad0[CACHE_LINE_SIZE - 2 * sizeof(uint64_t) - sizeof(ktimer_t) - sizeof(bool)];
+
+    volatile uint64_t tail;        // Written by the drain
+    uint64_t reported;             // Drops already reported
+    uint8_t pad1[CACHE_LINE_SIZE - 2 * sizeof(uint64_t)];
+
+    uint64_t words[KLOG_RING_WORDS];
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) klog_ring_t;
+
+/* Rings for every hart but the boot hart, which logs from the start */
+bool klog_init(boot_info_t* info);
+
+/* Let the executing hart schedule drains on its timer wheel */
+void klog_init_hart(void);
+
+void klog(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Format and write out everything logged so far, oldest first across harts */
+void klog_drain(void);
+
+/* Where drained lines go, the UART until a console service takes over */
+void klog_set_sink(void (*sink)(const char* line));
+
+#endif // KLOG_H
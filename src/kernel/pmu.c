@@ -0,0 +1,266 @@
+#include "pmu.h"
+#include "klog.h"
+#include "thread.h"
+#include "../cpu/csr.h"
+#include "../device/opensbi.h"
+
+// SBI event indices, the type goes in bits 16-19
+#define EVENT_HW_CPU_CYCLES    1
+#define EVENT_HW_INSTRUCTIONS  2
+#define EVENT_HW_CACHE_MISSES  4
+#define EVENT_CACHE(cache, op, result) (1 << 16 | (cache) << 3 | (op) << 1 | (result))
+
+#define CACHE_DTLB        3
+#define CACHE_ITLB        4
+#define CACHE_OP_READ     0
+#define CACHE_RESULT_MISS 1
+
+// User-readable counter CSRs, cycle to hpmcounter31
+#define CSR_CYCLE         0xC00
+#define CSR_INSTRET       0xC02
+#define CSR_HPMCOUNTER31  0xC1F
+
+#define PMU_COUNTERS_MAX 64
+
+_Static_assert(PMU_EVENTS <= 5, "SYS_PMU returns every count in a1-a5");
+
+static const unsigned long sbi_events[PMU_EVENTS] =
+{
+    [PMU_CYCLES]       = EVENT_HW_CPU_CYCLES,
+    [PMU_INSTRET]      = EVENT_HW_INSTRUCTIONS,
+    [PMU_CACHE_MISSES] = EVENT_HW_CACHE_MISSES,
+    [PMU_DTLB_MISSES]  = EVENT_CACHE(CACHE_DTLB, CACHE_OP_READ, CACHE_RESULT_MISS),
+    [PMU_ITLB_MISSES]  = EVENT_CACHE(CACHE_ITLB, CACHE_OP_READ, CACHE_RESULT_MISS),
+};
+
+static const char* const event_names[PMU_EVENTS] =
+{
+    [PMU_CYCLES]       = "cycles",
+    [PMU_INSTRET]      = "instructions",
+    [PMU_CACHE_MISSES] = "cache misses",
+    [PMU_DTLB_MISSES]  = "dTLB misses",
+    [PMU_ITLB_MISSES]  = "iTLB misses",
+};
+
+/* SBI counters the kernel can read itself, the same on every hart */
+typedef struct
+{
+    uint64_t hardware;                 // Bit per counter with a counter CSR
+    uint16_t csr[PMU_COUNTERS_MAX];
+    uint8_t width[PMU_COUNTERS_MAX];
+}
+pmu_state_t;
+
+static pmu_state_t pmu_state;
+
+pmu_hart_t pmu_harts[HARTS_MAX];
+
+#define COUNTER_CASE(n) case CSR_CYCLE + n: return csr_read(hpmcounter##n);
+
+/* The CSR number is part of the instruction, so every counter gets its own */
+static uint64_t read_counter(uint16_t csr)
+{
+    switch(csr)
+    {
+        case CSR_CYCLE:   return csr_read(cycle);
+        case CSR_INSTRET: return csr_read(instret);
+        COUNTER_CASE(3)  COUNTER_CASE(4)  COUNTER_CASE(5)  COUNTER_CASE(6)
+        COUNTER_CASE(7)  COUNTER_CASE(8)  COUNTER_CASE(9)  COUNTER_CASE(10)
+        COUNTER_CASE(11) COUNTER_CASE(12) COUNTER_CASE(13) COUNTER_CASE(14)
+        COUNTER_CASE(15) COUNTER_CASE(16) COUNTER_CASE(17) COUNTER_CASE(18)
+        COUNTER_CASE(19) COUNTER_CASE(20) COUNTER_CASE(21) COUNTER_CASE(22)
+        COUNTER_CASE(23) COUNTER_CASE(24) COUNTER_CASE(25) COUNTER_CASE(26)
+        COUNTER_CASE(27) COUNTER_CASE(28) COUNTER_CASE(29) COUNTER_CASE(30)
+        COUNTER_CASE(31)
+        default:          return 0;
+    }
+}
+
+static inline uint64_t width_mask(unsigned int width)
+{
+    return width >= 64 ? ~0ULL : (1ULL << width) - 1;
+}
+
+void pmu_init(void)
+{
+    long count = sbi_pmu_num_counters();
+    if(count > PMU_COUNTERS_MAX)
+        count = PMU_COUNTERS_MAX;
+
+    pmu_state.hardware = 0;
+
+    /* Firmware counters only read through SBI, too slow for every switch */
+    for(long i = 0; i < count; i++)
+    {
+        sbiret_t ret = sbi_pmu_counter_info(i);
+        if(ret.error != SBI_SUCCESS || SBI_PMU_INFO_FIRMWARE(ret.value))
+            continue;
+
+        uint16_t csr = SBI_PMU_INFO_CSR(ret.value);
+        if(csr < CSR_CYCLE || csr > CSR_HPMCOUNTER31)
+            continue;
+
+        pmu_state.hardware |= 1ULL << i;
+        pmu_state.csr[i] = csr;
+        pmu_state.width[i] = SBI_PMU_INFO_WIDTH(ret.value);
+    }
+}
+
+void pmu_init_hart(void)
+{
+    pmu_hart_t* hart = &pmu_harts[hart_current()];
+    uint64_t unused = pmu_state.hardware;
+
+    hart->owner = 0;
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+    {
+        hart->csr[event] = 0;
+        hart->mask[event] = 0;
+
+        if(!unused)
+            continue;
+
+        // Counts S- and U-mode, firmware time is none of our business
+        sbiret_t ret = sbi_pmu_counter_config(0, unused,
+            SBI_PMU_CFG_CLEAR_VALUE | SBI_PMU_CFG_AUTO_START | SBI_PMU_CFG_SET_MINH, sbi_events[event], 0);
+
+        if(ret.error != SBI_SUCCESS || ret.value < 0 || ret.value >= PMU_COUNTERS_MAX || !(unused & (1ULL << ret.value)))
+            continue;
+
+        unused &= ~(1ULL << ret.value);
+        hart->csr[event] = pmu_state.csr[ret.value];
+        hart->mask[event] = width_mask(pmu_state.width[ret.value]);
+    }
+
+    /* Zicntr has these two whether or not SBI hands out counters */
+    if(!hart->csr[PMU_CYCLES])
+    {
+        hart->csr[PMU_CYCLES] = CSR_CYCLE;
+        hart->mask[PMU_CYCLES] = ~0ULL;
+    }
+
+    if(!hart->csr[PMU_INSTRET])
+    {
+        hart->csr[PMU_INSTRET] = CSR_INSTRET;
+        hart->mask[PMU_INSTRET] = ~0ULL;
+    }
+}
+
+uint32_t pmu_supported(void)
+{
+    pmu_hart_t* hart = &pmu_harts[hart_current()];
+    uint32_t supported = 0;
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+    {
+        if(hart->csr[event])
+            supported |= 1U << event;
+    }
+
+    return supported;
+}
+
+void pmu_read(uint64_t counts[PMU_EVENTS])
+{
+    pmu_hart_t* hart = &pmu_harts[hart_current()];
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+        counts[event] = hart->csr[event] ? read_counter(hart->csr[event]) : 0;
+}
+
+void pmu_switch_slow(pmu_thread_t* next)
+{
+    pmu_hart_t* hart = &pmu_harts[hart_current()];
+    uint64_t now[PMU_EVENTS];
+
+    pmu_read(now);
+
+    if(hart->owner)
+    {
+        for(int event = 0; event < PMU_EVENTS; event++)
+            hart->owner->counts[event] += (now[event] - hart->start[event]) & hart->mask[event];
+    }
+
+    hart->owner = next && next->enabled ? next : 0;
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+        hart->start[event] = now[event];
+}
+
+void pmu_thread_read(pmu_thread_t* thread, uint64_t counts[PMU_EVENTS])
+{
+    // Fold in the current run first if thread has the hart
+    if(pmu_harts[hart_current()].owner == thread)
+        pmu_switch_slow(thread);
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+        counts[event] = thread->counts[event];
+}
+
+void pmu_thread_enable(pmu_thread_t* thread, bool enable)
+{
+    pmu_switch(0);
+
+    thread->enabled = enable;
+    for(int event = 0; event < PMU_EVENTS && enable; event++)
+        thread->counts[event] = 0;
+
+    pmu_switch(thread);
+}
+
+trap_frame_t* pmu_control(trap_frame_t* frame)
+{
+    thread_t* thread = (thread_t*)frame;
+
+    switch(frame->regs[REG_A0])
+    {
+        case PMU_OP_READ:
+        {
+            uint64_t counts[PMU_EVENTS];
+            pmu_thread_read(&thread->pmu, counts);
+
+            frame->regs[REG_A0] = pmu_supported();
+            for(int event = 0; event < PMU_EVENTS; event++)
+                frame->regs[REG_A1 + event] = counts[event];
+            break;
+        }
+        case PMU_OP_ENABLE:
+        case PMU_OP_DISABLE:
+            pmu_thread_enable(&thread->pmu, frame->regs[REG_A0] == PMU_OP_ENABLE);
+            frame->regs[REG_A0] = 0;
+            break;
+        default:
+            frame->regs[REG_A0] = (uintptr_t)-1;
+            break;
+    }
+
+    return frame;
+}
+
+void pmu_sample_begin(pmu_sample_t* sample)
+{
+    pmu_read(sample->counts);
+}
+
+void pmu_sample_end(pmu_sample_t* sample)
+{
+    pmu_hart_t* hart = &pmu_harts[hart_current()];
+    uint64_t now[PMU_EVENTS];
+
+    pmu_read(now);
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+        sample->counts[event] = (now[event] - sample->counts[event]) & hart->mask[event];
+}
+
+void pmu_sample_log(const char* label, const pmu_sample_t* sample)
+{
+    uint32_t supported = pmu_supported();
+
+    for(int event = 0; event < PMU_EVENTS; event++)
+    {
+        if(supported & (1U << event))
+            klog("PMU %s: %lu %s\n", label, sample->counts[event], event_names[event]);
+    }
+}
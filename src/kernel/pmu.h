@@ -0,0 +1,100 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../cpu/hart.h"
+#include "../cpu/trap.h"
+
+/*
+ * Hardware performance counters. With the SBI PMU extension every hart
+ * gets a counter CSR programmed for each event the platform supports,
+ * without it only cycle and instret, which Zicntr always has. Events
+ * the hardware can't count read as 0.
+ */
+typedef enum
+{
+    PMU_CYCLES,
+    PMU_INSTRET,
+    PMU_CACHE_MISSES,      // Last level
+    PMU_DTLB_MISSES,       // Reads
+    PMU_ITLB_MISSES,
+    PMU_EVENTS,
+}
+pmu_event_t;
+
+/*
+ * Counts of one thread, only kept while enabled. Counting follows the
+ * thread across switches and harts, a profiler reads its own counts
+ * with SYS_PMU and never sees anyone else's.
+ */
+typedef struct
+{
+    bool enabled;
+    uint64_t counts[PMU_EVENTS];
+}
+pmu_thread_t;
+
+/* What the executing hart's counters are attributed to */
+typedef struct
+{
+    pmu_thread_t* owner;
+    uint64_t start[PMU_EVENTS];     // Counter values when owner got the hart
+    uint16_t csr[PMU_EVENTS];       // Counter CSR of each event, 0 if not counted
+    uint64_t mask[PMU_EVENTS];      // Counter width
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) pmu_hart_t;
+
+extern pmu_hart_t pmu_harts[HARTS_MAX];
+
+/* Find the hardware counters, call once after sbi_init */
+void pmu_init(void);
+
+/* Program the executing hart's counters, SBI configures them per hart */
+void pmu_init_hart(void);
+
+/* Bit per event the executing hart counts */
+uint32_t pmu_supported(void);
+
+/* Raw counters of the executing hart */
+void pmu_read(uint64_t counts[PMU_EVENTS]);
+
+void pmu_switch_slow(pmu_thread_t* next);
+
+/*
+ * The hart goes to next, 0 for the kernel. Only costs counter reads if
+ * the outgoing or incoming thread is being counted.
+ */
+static inline void pmu_switch(pmu_thread_t* next)
+{
+    if(pmu_harts[hart_current()].owner || (next && next->enabled))
+        pmu_switch_slow(next);
+}
+
+/* Counts of thread up to now, including the run it is in */
+void pmu_thread_read(pmu_thread_t* thread, uint64_t counts[PMU_EVENTS]);
+
+/* Start counting the executing thread from zero or stop counting it */
+void pmu_thread_enable(pmu_thread_t* thread, bool enable);
+
+/* Operations of SYS_PMU, in a0 */
+#define PMU_OP_READ    0   // a0 = bit per counted event, a1-a5 = counts by pmu_event_t
+#define PMU_OP_ENABLE  1
+#define PMU_OP_DISABLE 2
+
+/* Syscall, the caller's own counters */
+trap_frame_t* pmu_control(trap_frame_t* frame);
+
+/* Counter deltas of the executing hart over some stretch of kernel code */
+typedef struct
+{
+    uint64_t counts[PMU_EVENTS];
+}
+pmu_sample_t;
+
+void pmu_sample_begin(pmu_sample_t* sample);
+void pmu_sample_end(pmu_sample_t* sample);
+void pmu_sample_log(const char* label, const pmu_sample_t* sample);
+
+#endif // PMU_H
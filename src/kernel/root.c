@@ -0,0 +1,121 @@
+#include "root.h"
+#include "thread.h"
+#include "klog.h"
+#include "../memory/physical.h"
+
+/* The image and the copied part of the FDT, freed again if the root service fails to start */
+#define ROOT_COPIES_MAX 2
+
+static struct
+{
+    char* base;
+    size_t pages;
+}
+root_copies[ROOT_COPIES_MAX];
+
+static int root_copy_count;
+
+static bool map_copy(aspace_t* as, uintptr_t va, const void* data, size_t size, uint64_t flags)
+{
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    char* copy = root_copy_count < ROOT_COPIES_MAX ? phys_alloc_contiguous(pages, PAGE_SIZE) : 0;
+    if(!copy)
+        return false;
+
+    root_copies[root_copy_count].base = copy;
+    root_copies[root_copy_count].pages = pages;
+    root_copy_count++;
+
+    for(size_t i = 0; i < pages * PAGE_SIZE; i++)
+        copy[i] = i < size ? ((const char*)data)[i] : 0;
+
+    /* A failed map may have got partway, the copy is only freed along with as */
+    return aspace_map(as, va, (uintptr_t)copy, pages * PAGE_SIZE, flags);
+}
+
+bool root_map_dtb(aspace_t* as, const boot_info_t* info, uintptr_t* dtb_va)
+{
+    if(!info->dtb_base || !info->dtb_index)
+        return false;
+
+    if(info->dtb_size > ROOT_BOOT_MAX || info->dtb_index_size > ROOT_BOOT_MAX)
+        return false;
+
+    /* The index gets pages to itself in the early arena, nothing else shows through */
+    if(!aspace_map(as, ROOT_INDEX_BASE, info->dtb_index, ALIGN_UP(info->dtb_index_size, PAGE_SIZE), PTE_R))
+        return false;
+
+    *dtb_va = ROOT_DTB_BASE;
+
+    /* Whatever shares the first page with the blob would leak, copy it instead */
+    if(!IS_ALIGNED(info->dtb_base, PAGE_SIZE))
+        return map_copy(as, ROOT_DTB_BASE, (const void*)info->dtb_base, info->dtb_size, PTE_R);
+
+    /* Whole pages go in place, the partial last page is copied with its tail zeroed */
+    size_t whole = ALIGN_DOWN(info->dtb_size, PAGE_SIZE);
+    if(whole && !aspace_map(as, ROOT_DTB_BASE, info->dtb_base, whole, PTE_R))
+        return false;
+
+    if(whole == info->dtb_size)
+        return true;
+
+    return map_copy(as, ROOT_DTB_BASE + whole, (const void*)(info->dtb_base + whole), info->dtb_size - whole, PTE_R);
+}
+
+/* as never ran, so once it is gone nothing can reach the stack or the copies */
+static bool root_fail(aspace_t* as, char* stack, const char* message)
+{
+    klog("Root service: %s\n", message);
+
+    if(as)
+        aspace_destroy(as);
+    if(stack)
+        phys_free(stack);
+
+    while(root_copy_count > 0)
+    {
+        root_copy_count--;
+        phys_free_contiguous(root_copies[root_copy_count].base, root_copies[root_copy_count].pages);
+    }
+
+    return false;
+}
+
+bool root_start(const boot_info_t* info)
+{
+    if(!info->initrd_base || !info->initrd_size)
+    {
+        klog("No root service, the initrd is empty\n");
+        return false;
+    }
+
+    aspace_t* as = aspace_create();
+    char* stack = phys_alloc(ROOT_STACK_SIZE);
+    uintptr_t dtb_va;
+
+    if(!as || !stack)
+        return root_fail(as, stack, "out of memory");
+
+    /* Fresh pages hold whatever the kernel left in them */
+    for(size_t i = 0; i < ROOT_STACK_SIZE; i++)
+        stack[i] = 0;
+
+    /* The image is writable, a flat binary keeps its data next to its code */
+    if(!map_copy(as, ROOT_IMAGE_BASE, (const void*)info->initrd_base, info->initrd_size, PTE_R | PTE_W | PTE_X) ||
+       !aspace_map(as, ROOT_STACK_TOP - ROOT_STACK_SIZE, (uintptr_t)stack, ROOT_STACK_SIZE, PTE_R | PTE_W) ||
+       !root_map_dtb(as, info, &dtb_va))
+        return root_fail(as, stack, "mapping failed");
+
+    asm volatile("fence.i" : : : "memory");
+
+    thread_t* thread = thread_create(as, ROOT_IMAGE_BASE, ROOT_STACK_TOP);
+    if(!thread)
+        return root_fail(as, stack, "out of memory");
+
+    thread->frame.regs[REG_A0] = dtb_va;
+    thread->frame.regs[REG_A1] = info->dtb_size;
+    thread->frame.regs[REG_A2] = ROOT_INDEX_BASE;
+
+    thread_wake(thread);
+    return true;
+}
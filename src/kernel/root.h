@@ -0,0 +1,37 @@
+#ifndef ROOT_H
+#define ROOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+#include "../memory/aspace.h"
+
+/*
+ * Layout of the root service's address space. The image is the initrd,
+ * a flat binary entered at its first byte. The FDT and the kernel's index
+ * of it are mapped read-only at the top, so device managers can look
+ * things up in user space without copies or syscalls.
+ */
+#define ROOT_IMAGE_BASE  ASPACE_USER_BASE
+#define ROOT_STACK_TOP   (ASPACE_USER_END - 0x8000000)
+#define ROOT_STACK_SIZE  0x10000
+#define ROOT_DTB_BASE    (ASPACE_USER_END - 0x4000000)
+#define ROOT_INDEX_BASE  (ASPACE_USER_END - 0x2000000)
+#define ROOT_BOOT_MAX    0x2000000  // Room for each of the FDT and its index
+
+/*
+ * Map the FDT at ROOT_DTB_BASE and its index at ROOT_INDEX_BASE in as.
+ * Whole FDT pages are shared with the kernel, a partial last page is
+ * copied and an FDT that doesn't start on a page boundary is copied
+ * entirely. Sets *dtb_va to its address.
+ */
+bool root_map_dtb(aspace_t* as, const boot_info_t* info, uintptr_t* dtb_va);
+
+/*
+ * Create the root service from the initrd and make it ready. It starts
+ * with the FDT in a0, its size in a1 and the dtb_index_t in a2.
+ */
+bool root_start(const boot_info_t* info);
+
+#endif // ROOT_H
@@ -0,0 +1,246 @@
+#include "sched.h"
+#include "klog.h"
+#include "../cpu/csr.h"
+#include "../cpu/trap.h"
+#include "../device/opensbi.h"
+#include "../device/plic.h"
+#include "../device/uart.h"
+#include "../memory/physical.h"
+
+typedef struct
+{
+    sched_queue_t* queues;     // SCHED_PRIORITIES per hart
+    int hart_count;
+    hart_mask_t idle;          // Harts sleeping in sched_run
+}
+sched_state_t;
+
+static sched_state_t sched_state;
+
+static ktimer_t slice_timers[HARTS_MAX];
+static bool slice_expired[HARTS_MAX];
+
+static inline sched_queue_t* hart_queue(unsigned int hart, int priority)
+{
+    return &sched_state.queues[hart * SCHED_PRIORITIES + priority];
+}
+
+bool sched_init(boot_info_t* info)
+{
+    sched_state.hart_count = info->core_count > 0 ? info->core_count : 1;
+
+    size_t size = (size_t)sched_state.hart_count * SCHED_PRIORITIES * sizeof(sched_queue_t);
+    size_t pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+    sched_state.queues = phys_alloc_contiguous(pages, PAGE_SIZE);
+    if(!sched_state.queues)
+        return false;
+
+    for(int i = 0; i < sched_state.hart_count * SCHED_PRIORITIES; i++)
+    {
+        sched_state.queues[i].top = 0;
+        sched_state.queues[i].bottom = 0;
+    }
+
+    sched_state.idle = 0;
+    return true;
+}
+
+static bool queue_push(sched_queue_t* queue, thread_t* thread)
+{
+    uint64_t bottom = queue->bottom;
+
+    /* A stale top only makes the queue look fuller than it is */
+    if(bottom - __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE) >= SCHED_QUEUE_SIZE)
+        return false;
+
+    queue->slots[bottom % SCHED_QUEUE_SIZE] = thread;
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static thread_t* queue_take(sched_queue_t* queue)
+{
+    uint64_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+
+    while(top < __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE))
+    {
+        /*
+         * The owner only reuses the slot once top has moved past it, in
+         * which case the CAS fails and the stale read is thrown away.
+         */
+        thread_t* thread = queue->slots[top % SCHED_QUEUE_SIZE];
+
+        if(__atomic_compare_exchange_n(&queue->top, &top, top + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return thread;
+    }
+
+    return 0;
+}
+
+static thread_t* take_from(unsigned int hart)
+{
+    for(int priority = SCHED_PRIORITIES - 1; priority >= 0; priority--)
+    {
+        thread_t* thread = queue_take(hart_queue(hart, priority));
+        if(thread)
+            return thread;
+    }
+
+    return 0;
+}
+
+/* Send one sleeping hart an IPI so it comes and steals */
+static void kick_idle(unsigned int self)
+{
+    /*
+     * Store to bottom, then load idle, against sched_wait's store to idle,
+     * then load bottom. Without a full fence on both sides each can miss
+     * the other's store and the work sits there while the hart sleeps.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    hart_mask_t idle = __atomic_load_n(&sched_state.idle, __ATOMIC_RELAXED) & ~HART_MASK(self);
+    if(!idle)
+        return;
+
+    hart_mask_t target = idle & -idle;
+    if(__atomic_fetch_and(&sched_state.idle, ~target, __ATOMIC_ACQ_REL) & target)
+        sbi_send_ipi(target);
+}
+
+void sched_enqueue(thread_t* thread)
+{
+    unsigned int self = hart_current();
+    int priority = thread->priority;
+
+    /* A full level spills into the ones below it */
+    while(priority >= 0 && !queue_push(hart_queue(self, priority), thread))
+        priority--;
+
+    if(priority < 0)
+    {
+        klog("ERROR: Run queue full, thread dropped!\n");
+        return;
+    }
+
+    kick_idle(self);
+}
+
+thread_t* sched_pick(void)
+{
+    unsigned int self = hart_current();
+
+    thread_t* thread = take_from(self);
+    if(thread)
+        return thread;
+
+    for(int i = 1; i < sched_state.hart_count; i++)
+    {
+        thread = take_from((self + i) % sched_state.hart_count);
+        if(thread)
+            return thread;
+    }
+
+    return 0;
+}
+
+static void slice_end(ktimer_t* timer)
+{
+    (void)timer;
+    slice_expired[hart_current()] = true;
+}
+
+void sched_slice_start(uint64_t ticks)
+{
+    unsigned int self = hart_current();
+
+    slice_expired[self] = false;
+    timer_setup(&slice_timers[self], slice_end, 0);
+    timer_arm(&slice_timers[self], ticks);
+}
+
+void sched_slice_stop(void)
+{
+    unsigned int self = hart_current();
+
+    timer_cancel(&slice_timers[self]);
+    slice_expired[self] = false;
+}
+
+bool sched_preempt_due(void)
+{
+    unsigned int self = hart_current();
+
+    if(!slice_expired[self])
+        return false;
+
+    slice_expired[self] = false;
+    return true;
+}
+
+/* Nothing to do, sleep until an IPI, a timer or any other interrupt comes in */
+static void sched_wait(unsigned int self)
+{
+    __atomic_fetch_or(&sched_state.idle, HART_MASK(self), __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* Work queued before the idle bit went up would not have kicked us, see kick_idle */
+    bool empty = true;
+    for(int i = 0; i < sched_state.hart_count && empty; i++)
+    {
+        for(int priority = 0; priority < SCHED_PRIORITIES && empty; priority++)
+        {
+            sched_queue_t* queue = hart_queue(i, priority);
+            empty = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    /* No periodic tick, the hardware only holds the next wheel deadline */
+    if(empty)
+    {
+        /* Nothing else to do, write out the log before sleeping */
+        klog_drain();
+        timer_poll();
+        asm volatile("wfi");
+    }
+
+    __atomic_fetch_and(&sched_state.idle, ~HART_MASK(self), __ATOMIC_RELAXED);
+    csr_clear(sip, 1ULL << IRQ_S_SOFT);
+
+    // Only the boot hart has device interrupts enabled, the console's among them
+    if(csr_read(sip) & (1ULL << IRQ_S_EXT))
+        plic_handle();
+
+    timer_poll();
+}
+
+void sched_run(void)
+{
+    unsigned int self = hart_current();
+
+    /* wfi wakes on an enabled interrupt even with sstatus.SIE clear, timer_init_hart enables STIE */
+    csr_set(sie, 1ULL << IRQ_S_SOFT);
+
+    while(1)
+    {
+        thread_t* thread = sched_pick();
+        if(thread)
+        {
+            thread_run(thread);
+            continue;
+        }
+
+        if(thread_count() == 0 && self == 0)
+        {
+            klog("No threads left, shutting down\n");
+            klog_drain();
+            uart_flush();
+            sbi_shutdown();
+        }
+
+        // Keep the zeroed page pool topped up before going to sleep
+        if(!phys_zero_idle())
+            sched_wait(self);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+#include "../cpu/hart.h"
+#include "thread.h"
+#include "timer.h"
+
+/* Priority levels, higher runs first */
+#define SCHED_PRIORITIES 8
+#define SCHED_PRIORITY_DEFAULT 3
+
+/* Threads one hart can hold per level, a power of two */
+#define SCHED_QUEUE_SIZE 256
+
+/*
+ * Ready threads of one priority on one hart. Only the owning hart adds
+ * threads, any hart takes them from the front with a CAS on top, so the
+ * owner runs them in order and idle harts steal the oldest without a lock.
+ */
+typedef struct
+{
+    volatile uint64_t top;       // Next thread to take
+    uint8_t pad0[CACHE_LINE_SIZE - 8];
+    volatile uint64_t bottom;    // Next free slot, written by the owner only
+    uint8_t pad1[CACHE_LINE_SIZE - 8];
+    thread_t* slots[SCHED_QUEUE_SIZE];
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) sched_queue_t;
+
+bool sched_init(boot_info_t* info);
+
+/* Queue a ready thread on the executing hart */
+void sched_enqueue(thread_t* thread);
+
+/* Take the next thread to run, from this hart or stolen from another */
+thread_t* sched_pick(void);
+
+/*
+ * Timeslices run on a per-hart timer. A thread taken from a run queue
+ * starts a fresh one, direct IPC hand-offs leave it running, which is
+ * what hands the caller's remaining time to the receiver.
+ */
+void sched_slice_start(uint64_t ticks);
+void sched_slice_stop(void);
+
+/* True once if the slice ran out, the caller then preempts the thread */
+bool sched_preempt_due(void);
+
+/*
+ * The hart's scheduling loop. Idle harts zero pages and sleep until
+ * another hart has work for them. Once no threads are left, the boot
+ * hart powers the machine off.
+ */
+void sched_run(void) __attribute__((noreturn));
+
+#endif // SCHED_H
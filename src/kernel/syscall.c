@@ -0,0 +1,38 @@
+#include "syscall.h"
+#include "channel.h"
+#include "ipc.h"
+#include "pmu.h"
+#include "thread.h"
+
+static trap_frame_t* sys_null(trap_frame_t* frame)
+{
+    frame->regs[REG_A0] = 0;
+    return frame;
+}
+
+static trap_frame_t* sys_exit(trap_frame_t* frame)
+{
+    thread_exit((thread_t*)frame);
+    return thread_switch_next();
+}
+
+/* Go to the back of the run queue, the thread may well be picked again */
+static trap_frame_t* sys_yield(trap_frame_t* frame)
+{
+    thread_wake((thread_t*)frame);
+    return thread_switch_next();
+}
+
+const syscall_t syscall_table[SYSCALL_COUNT] =
+{
+    [SYS_NULL] = sys_null,
+    [SYS_EXIT] = sys_exit,
+    [SYS_CALL] = ipc_call,
+    [SYS_REPLY_RECV] = ipc_reply_recv,
+    [SYS_RECV] = ipc_recv,
+    [SYS_CHANNEL_WAIT] = channel_wait,
+    [SYS_CHANNEL_NOTIFY] = channel_notify,
+    [SYS_YIELD] = sys_yield,
+    [SYS_SLEEP] = thread_sleep,
+    [SYS_PMU] = pmu_control,
+};
@@ -0,0 +1,24 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include "../cpu/trap.h"
+
+/* Syscall number in a7, arguments and results in a0-a5 */
+#define SYS_NULL            0
+#define SYS_EXIT            1
+#define SYS_CALL            2
+#define SYS_REPLY_RECV      3
+#define SYS_RECV            4
+#define SYS_CHANNEL_WAIT    5
+#define SYS_CHANNEL_NOTIFY  6
+#define SYS_YIELD           7
+#define SYS_SLEEP           8
+#define SYS_PMU             9
+
+#define SYSCALL_COUNT 10
+
+typedef trap_frame_t* (*syscall_t)(trap_frame_t* frame);
+
+extern const syscall_t syscall_table[SYSCALL_COUNT];
+
+#endif // SYSCALL_H
@@ -0,0 +1,140 @@
+#include "thread.h"
+#include "channel.h"
+#include "ipc.h"
+#include "sched.h"
+#include "timer.h"
+#include "../memory/slab.h"
+
+/* Threads created and not yet exited */
+static int live_threads;
+
+static slab_cache_t* thread_cache;
+
+bool thread_init(void)
+{
+    thread_cache = slab_cache_create("thread", sizeof(thread_t), 0, 0);
+    return thread_cache != 0;
+}
+
+thread_t* thread_create(aspace_t* as, uintptr_t pc, uintptr_t sp)
+{
+    thread_t* thread = slab_alloc(thread_cache);
+    if(!thread)
+        return 0;
+
+    for(int i = 0; i < 32; i++)
+        thread->frame.regs[i] = 0;
+
+    thread->frame.regs[REG_SP] = sp;
+    thread->frame.sepc = pc;
+    thread->frame.busy = 0;
+
+    thread->aspace = as;
+    thread->state = THREAD_READY;
+    thread->priority = SCHED_PRIORITY_DEFAULT;
+    thread->timeslice = THREAD_TIMESLICE;
+    thread->reply_to = 0;
+    thread->replier = 0;
+    thread->endpoint = 0;
+    thread->channel = 0;
+    timer_setup(&thread->sleep_timer, 0, 0);
+    thread->pmu.enabled = false;
+
+    __atomic_fetch_add(&live_threads, 1, __ATOMIC_RELAXED);
+    return thread;
+}
+
+void thread_exit(thread_t* thread)
+{
+    // Settle its counts while it still has the hart, its creator may free it any time now
+    pmu_switch(0);
+
+    thread->state = THREAD_DEAD;
+    __atomic_fetch_sub(&live_threads, 1, __ATOMIC_RELEASE);
+}
+
+void thread_destroy(thread_t* thread)
+{
+    timer_cancel(&thread->sleep_timer);
+    ipc_cancel(thread);
+    channel_cancel(thread);
+
+    if(thread->state != THREAD_DEAD)
+        __atomic_fetch_sub(&live_threads, 1, __ATOMIC_RELEASE);
+
+    slab_free(thread_cache, thread);
+}
+
+int thread_count(void)
+{
+    return __atomic_load_n(&live_threads, __ATOMIC_ACQUIRE);
+}
+
+void thread_wake(thread_t* thread)
+{
+    thread->state = THREAD_READY;
+    sched_enqueue(thread);
+}
+
+trap_frame_t* thread_switch_to(thread_t* thread)
+{
+    /* The hart that ran it last may still be writing its s0-s11 back */
+    if(&thread->frame != hart_self()->frame)
+    {
+        while(__atomic_load_n(&thread->frame.busy, __ATOMIC_ACQUIRE))
+            ;
+    }
+
+    thread->state = THREAD_RUNNING;
+    aspace_switch(thread->aspace);
+    pmu_switch(&thread->pmu);
+
+    return &thread->frame;
+}
+
+trap_frame_t* thread_switch_next(void)
+{
+    thread_t* thread = sched_pick();
+    if(!thread)
+        return 0;
+
+    /* Coming from the run queue, not a donation, so it gets a fresh timeslice */
+    thread->timeslice = THREAD_TIMESLICE;
+    sched_slice_start(thread->timeslice);
+
+    return thread_switch_to(thread);
+}
+
+void thread_run(thread_t* thread)
+{
+    thread->timeslice = THREAD_TIMESLICE;
+    sched_slice_start(thread->timeslice);
+
+    trap_run_user(thread_switch_to(thread));
+
+    pmu_switch(0);
+    sched_slice_stop();
+    vm_activate();
+}
+
+static void sleep_end(ktimer_t* timer)
+{
+    thread_wake(timer->data);
+}
+
+trap_frame_t* thread_sleep(trap_frame_t* frame)
+{
+    thread_t* thread = (thread_t*)frame;
+    uint64_t ticks = frame->regs[REG_A0];
+
+    frame->regs[REG_A0] = 0;
+    if(ticks == 0)
+        return frame;
+
+    /* The wheel belongs to this hart, so the wakeup queues the thread here too */
+    thread->state = THREAD_BLOCKED_SLEEP;
+    timer_setup(&thread->sleep_timer, sleep_end, thread);
+    timer_arm(&thread->sleep_timer, ticks);
+
+    return thread_switch_next();
+}
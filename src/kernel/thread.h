@@ -0,0 +1,91 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../cpu/hart.h"
+#include "../cpu/trap.h"
+#include "../memory/aspace.h"
+#include "pmu.h"
+#include "timer.h"
+
+struct endpoint;
+struct channel;
+
+/* Default timeslice in wheel ticks, handed along by IPC donation */
+#define THREAD_TIMESLICE 10
+
+typedef enum
+{
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED_SEND,   // Waiting on an endpoint for a receiver
+    THREAD_BLOCKED_RECV,   // Waiting on an endpoint for a caller
+    THREAD_BLOCKED_REPLY,  // Waiting for the reply to a call
+    THREAD_BLOCKED_EVENT,  // Waiting for a channel notification
+    THREAD_BLOCKED_SLEEP,  // Waiting for its sleep timer
+    THREAD_DEAD,
+}
+thread_state_t;
+
+/* The frame comes first, trap.s hands out frames and they double as threads */
+typedef struct thread
+{
+    trap_frame_t frame;
+    aspace_t* aspace;
+    thread_state_t state;
+    int priority;              // 0 to SCHED_PRIORITIES - 1, higher runs first
+    uint64_t timeslice;        // Ticks left, donated to the receiver of a call
+    struct thread* next;       // Endpoint queue
+    struct thread* reply_to;   // Caller waiting for this thread's reply
+    struct thread* replier;    // Server whose reply_to holds it while blocked for a reply
+    struct endpoint* endpoint; // Whose queue holds it while blocked in send or recv
+    struct channel* channel;   // Whose waiters slot holds it while blocked on an event
+    ktimer_t sleep_timer;
+    pmu_thread_t pmu;          // Counters, when a profiler asked for them
+}
+thread_t;
+
+static inline thread_t* thread_current(void)
+{
+    return (thread_t*)hart_self()->frame;
+}
+
+/* Object cache for thread_t */
+bool thread_init(void);
+
+/* A new thread starts at pc with stack sp in as, it is not made ready */
+thread_t* thread_create(aspace_t* as, uintptr_t pc, uintptr_t sp);
+/*
+ * Also takes the thread off its endpoint queue or channel and cancels its
+ * sleep.
+ * Timer wheels are per hart, so call it on the hart it last slept on.
+ */
+void thread_destroy(thread_t* thread);
+
+/* The thread is done, it stays around until its creator destroys it */
+void thread_exit(thread_t* thread);
+
+/* Threads created and not exited yet */
+int thread_count(void);
+
+/* Make a blocked or new thread runnable on the executing hart */
+void thread_wake(thread_t* thread);
+
+/*
+ * Hand the hart to thread and return the frame for trap.s to resume.
+ * Used by trap handlers, the scheduler isn't involved.
+ */
+trap_frame_t* thread_switch_to(thread_t* thread);
+
+/* The current thread stopped running, return the next frame or 0 */
+trap_frame_t* thread_switch_next(void);
+
+/* Run thread and whatever it hands the hart to until nothing is left */
+void thread_run(thread_t* thread);
+
+/* Syscall, block for a0 wheel ticks */
+trap_frame_t* thread_sleep(trap_frame_t* frame);
+
+#endif // THREAD_H
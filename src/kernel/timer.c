@@ -0,0 +1,301 @@
+#include "timer.h"
+#include "klog.h"
+#include "../cpu/bitops.h"
+#include "../cpu/csr.h"
+#include "../cpu/hart.h"
+#include "../cpu/trap.h"
+#include "../device/opensbi.h"
+#include "../memory/physical.h"
+
+#define NEVER UINT64_MAX
+
+typedef struct
+{
+    uint64_t timebase;     // rdtime ticks per second
+    uint64_t tick;         // rdtime ticks per wheel tick
+    bool sstc;
+    int hart_count;
+    timer_wheel_t* wheels;
+}
+timer_state_t;
+
+static timer_state_t timer_state;
+
+static inline timer_wheel_t* current_wheel(void)
+{
+    return &timer_state.wheels[hart_current()];
+}
+
+static inline uint64_t read_time(void)
+{
+    return csr_read(time);
+}
+
+static void set_deadline(uint64_t time)
+{
+    /* stimecmp by number, csr_write stringifies its argument and older assemblers lack the name */
+    if(timer_state.sstc)
+        csr_write(0x14d, time);
+    else
+        sbi_set_timer(time);
+}
+
+bool timer_init(boot_info_t* info)
+{
+    timer_state.timebase = info->timebase_frequency;
+    if(timer_state.timebase == 0)
+    {
+        klog("WARNING: No timebase-frequency in the DTB, assuming 10 MHz\n");
+        timer_state.timebase = TIMER_DEFAULT_TIMEBASE;
+    }
+
+    timer_state.tick = timer_state.timebase / TIMER_HZ;
+    if(timer_state.tick == 0)
+        timer_state.tick = 1;
+
+    /* stimecmp only helps if every hart has it */
+    timer_state.sstc = info->core_count > 0 && info->sstc_count == info->core_count;
+
+    timer_state.hart_count = info->core_count > 0 ? info->core_count : 1;
+
+    size_t size = (size_t)timer_state.hart_count * sizeof(timer_wheel_t);
+    timer_state.wheels = phys_alloc_contiguous(ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE, PAGE_SIZE);
+    if(!timer_state.wheels)
+        return false;
+
+    for(int i = 0; i < timer_state.hart_count; i++)
+    {
+        timer_wheel_t* wheel = &timer_state.wheels[i];
+
+        for(int level = 0; level < TIMER_LEVELS; level++)
+        {
+            wheel->pending[level] = 0;
+            for(int slot = 0; slot < TIMER_SLOTS; slot++)
+                wheel->slots[level][slot] = 0;
+        }
+    }
+
+    return true;
+}
+
+void timer_init_hart(void)
+{
+    timer_wheel_t* wheel = current_wheel();
+
+    wheel->now = timer_now();
+    wheel->programmed = NEVER;
+    set_deadline(NEVER);
+
+    csr_set(sie, 1ULL << IRQ_S_TIMER);
+}
+
+uint64_t timer_now(void)
+{
+    return read_time() / timer_state.tick;
+}
+
+uint64_t timer_timebase(void)
+{
+    return timer_state.timebase;
+}
+
+bool timer_has_sstc(void)
+{
+    return timer_state.sstc;
+}
+
+static inline void list_push(ktimer_t** head, ktimer_t* timer)
+{
+    timer->next = *head;
+    if(*head)
+        (*head)->pprev = &timer->next;
+
+    *head = timer;
+    timer->pprev = head;
+}
+
+/*
+ * Level L holds timers whose expiry is less than 64 level-L slots ahead,
+ * filed by the slot the expiry falls in. Each timer goes into the lowest
+ * level that reaches it, so the first time the wheel passes the start of
+ * its slot is the right time to cascade it down a level.
+ */
+static void wheel_insert(timer_wheel_t* wheel, ktimer_t* timer)
+{
+    uint64_t expires = timer->expires > wheel->now ? timer->expires : wheel->now + 1;
+
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 &&
+          (expires >> (TIMER_LEVEL_BITS * level)) - (wheel->now >> (TIMER_LEVEL_BITS * level)) >= TIMER_SLOTS)
+        level++;
+
+    uint64_t base = wheel->now >> (TIMER_LEVEL_BITS * level);
+    uint64_t index = expires >> (TIMER_LEVEL_BITS * level);
+
+    /* Too far out for the top level, park it in the last slot and cascade again later */
+    if(index - base >= TIMER_SLOTS)
+        index = base + TIMER_SLOTS - 1;
+
+    int slot = index & (TIMER_SLOTS - 1);
+    list_push(&wheel->slots[level][slot], timer);
+    wheel->pending[level] |= 1ULL << slot;
+}
+
+/* First tick after now at which level has a slot to process */
+static uint64_t level_next(timer_wheel_t* wheel, int level)
+{
+    uint64_t pending = wheel->pending[level];
+    if(!pending)
+        return NEVER;
+
+    int shift = TIMER_LEVEL_BITS * level;
+    uint64_t index = (wheel->now >> shift) + 1;
+    uint64_t distance = ctz64(ror64(pending, index & (TIMER_SLOTS - 1)));
+
+    return (index + distance) << shift;
+}
+
+static uint64_t wheel_next(timer_wheel_t* wheel)
+{
+    uint64_t next = NEVER;
+
+    for(int level = 0; level < TIMER_LEVELS; level++)
+    {
+        uint64_t t = level_next(wheel, level);
+        if(t < next)
+            next = t;
+    }
+
+    return next;
+}
+
+static ktimer_t* slot_detach(timer_wheel_t* wheel, int level, int slot)
+{
+    ktimer_t* list = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = 0;
+    wheel->pending[level] &= ~(1ULL << slot);
+
+    return list;
+}
+
+/*
+ * Step from one tick with work straight to the next, so after a long
+ * idle stretch only the slots that hold timers are visited.
+ */
+static void wheel_advance(timer_wheel_t* wheel, uint64_t target)
+{
+    while(wheel->now < target)
+    {
+        uint64_t next = wheel_next(wheel);
+        if(next > target)
+        {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now = next;
+
+        ktimer_t* expired = 0;
+
+        for(int level = TIMER_LEVELS - 1; level > 0; level--)
+        {
+            int shift = TIMER_LEVEL_BITS * level;
+            if(next & ((1ULL << shift) - 1))
+                continue;
+
+            ktimer_t* list = slot_detach(wheel, level, (next >> shift) & (TIMER_SLOTS - 1));
+            while(list)
+            {
+                ktimer_t* timer = list;
+                list = timer->next;
+
+                if(timer->expires <= wheel->now)
+                    list_push(&expired, timer);
+                else
+                    wheel_insert(wheel, timer);
+            }
+        }
+
+        ktimer_t* list = slot_detach(wheel, 0, next & (TIMER_SLOTS - 1));
+        while(list)
+        {
+            ktimer_t* timer = list;
+            list = timer->next;
+            list_push(&expired, timer);
+        }
+
+        /* A callback may arm or cancel timers, including ones still on expired */
+        while(expired)
+        {
+            ktimer_t* timer = expired;
+
+            expired = timer->next;
+            if(expired)
+                expired->pprev = &expired;
+
+            timer->next = 0;
+            timer->pprev = 0;
+            timer->fn(timer);
+        }
+    }
+}
+
+static void wheel_program(timer_wheel_t* wheel)
+{
+    uint64_t next = wheel_next(wheel);
+    uint64_t deadline = next == NEVER ? NEVER : next * timer_state.tick;
+
+    if(deadline != wheel->programmed)
+    {
+        set_deadline(deadline);
+        wheel->programmed = deadline;
+    }
+}
+
+void timer_arm(ktimer_t* timer, uint64_t delay)
+{
+    timer_wheel_t* wheel = current_wheel();
+
+    timer_cancel(timer);
+
+    timer->expires = timer_now() + delay;
+    wheel_insert(wheel, timer);
+
+    wheel_program(wheel);
+}
+
+void timer_cancel(ktimer_t* timer)
+{
+    if(!timer->pprev)
+        return;
+
+    ktimer_t** pprev = timer->pprev;
+
+    *pprev = timer->next;
+    if(timer->next)
+        timer->next->pprev = pprev;
+
+    timer->next = 0;
+    timer->pprev = 0;
+
+    /* Was it the last one in its slot? pprev then points into the slot array */
+    timer_wheel_t* wheel = current_wheel();
+    ktimer_t** first = &wheel->slots[0][0];
+
+    if(!*pprev && pprev >= first && pprev < first + TIMER_LEVELS * TIMER_SLOTS)
+    {
+        uintptr_t index = pprev - first;
+        wheel->pending[index / TIMER_SLOTS] &= ~(1ULL << (index % TIMER_SLOTS));
+    }
+
+    /* The hardware may stay armed for a deadline with nothing left, timer_poll sorts it out */
+}
+
+void timer_poll(void)
+{
+    timer_wheel_t* wheel = current_wheel();
+
+    wheel_advance(wheel, timer_now());
+    wheel_program(wheel);
+}
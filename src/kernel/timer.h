@@ -0,0 +1,80 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../bootinfo.h"
+
+/* Wheel resolution, one tick per millisecond */
+#define TIMER_HZ 1000
+
+/* 4 levels of 64 slots cover 64^4 ticks, about 4.6 hours, later timers re-cascade */
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+/* Used when the DTB has no timebase-frequency, QEMU virt's value */
+#define TIMER_DEFAULT_TIMEBASE 10000000
+
+typedef struct ktimer
+{
+    struct ktimer* next;
+    struct ktimer** pprev;     // 0 while the timer is not armed
+    uint64_t expires;          // In wheel ticks
+    void (*fn)(struct ktimer* timer);
+    void* data;
+}
+ktimer_t;
+
+/*
+ * One wheel per hart. Timers are armed, cancelled and fired on the hart
+ * that owns the wheel, with interrupts off, so the wheel needs no lock.
+ */
+typedef struct
+{
+    uint64_t now;              // Every tick up to here has been processed
+    uint64_t programmed;       // Deadline in the timer hardware, in rdtime ticks
+    uint64_t pending[TIMER_LEVELS];  // Bit per non-empty slot
+    ktimer_t* slots[TIMER_LEVELS][TIMER_SLOTS];
+}
+timer_wheel_t;
+
+bool timer_init(boot_info_t* info);
+
+/* Per-hart setup, enables the timer interrupt for wfi and user mode */
+void timer_init_hart(void);
+
+/* Current time in wheel ticks */
+uint64_t timer_now(void);
+
+uint64_t timer_timebase(void);
+bool timer_has_sstc(void);
+
+static inline void timer_setup(ktimer_t* timer, void (*fn)(ktimer_t* timer), void* data)
+{
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/* Fire fn after delay ticks, O(1). Rearming an armed timer moves it */
+void timer_arm(ktimer_t* timer, uint64_t delay);
+
+/* O(1), harmless on a timer that isn't armed */
+void timer_cancel(ktimer_t* timer);
+
+static inline bool timer_armed(ktimer_t* timer)
+{
+    return timer->pprev != 0;
+}
+
+/*
+ * Run everything that expired and program the hardware for the next
+ * deadline, or for none at all. Called from the timer interrupt and by
+ * idle harts after wfi, there is no periodic tick.
+ */
+void timer_poll(void);
+
+#endif // TIMER_H
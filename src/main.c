@@ -1,101 +1,157 @@
 #include "bootinfo.h"
 #include "device/dtb.h"
 #include "memory/physical.h"
+#include "memory/virtual.h"
+#include "memory/aspace.h"
+#include "memory/slab.h"
+#include "memory/early.h"
+#include "cpu/hart.h"
+#include "cpu/trap.h"
+#include "kernel/bootprof.h"
+#include "kernel/cap.h"
+#include "kernel/ipc.h"
+#include "kernel/pmu.h"
+#include "kernel/klog.h"
+#include "kernel/root.h"
+#include "kernel/sched.h"
+#include "kernel/thread.h"
+#include "kernel/channel.h"
+#include "kernel/timer.h"
 #include "device/opensbi.h"
+#include "device/plic.h"
+#include "device/uart.h"
 
-// Simple UART output for debugging (assuming standard QEMU UART at 0x10000000)
-#define UART_BASE 0x10000000
-static volatile char* uart = (volatile char*)UART_BASE;
-
-void uart_putc(char c) 
+static void halt(const char* reason)
 {
-    *uart = c;
-}
+    klog("%s", reason);
+    klog_drain();
+    uart_flush();
 
-void uart_puts(const char* str) 
-{
-    while (*str) 
+    sbi_shutdown();
+
+    // Halt
+    while (1) 
     {
-        uart_putc(*str++);
+        asm volatile("wfi");
     }
 }
 
-void uart_putx(uint64_t val) 
+void kmain(boot_info_t* info) 
 {
-    uart_puts("0x");
-    for (int i = 15; i >= 0; i--) 
-    {
-        int digit = (val >> (i * 4)) & 0xf;
-        uart_putc(digit < 10 ? '0' + digit : 'A' + digit - 10);
-    }
-}
+    uart_init(info);
 
-void uart_puti(int n) {
-    char buf[12];
-    int i = 0;
-    unsigned int un;
+    klog("Iris Kernel pre-rel. 0.0.1\n");
 
-    if (n < 0) 
-    {
-        uart_putc('-');
-        un = (unsigned int)(-(n + 1)) + 1;
-    } else {
-        un = (unsigned int)n;
-    }
-    
-    if (un == 0) 
-    {
-        uart_putc('0');
-        return;
-    }
-    
-    while (un > 0) 
-    {
-        buf[i++] = '0' + (un % 10);
-        un /= 10;
-    }
-    
-    while (i > 0) 
-    {
-        uart_putc(buf[--i]);
-    }
-}
+    sbi_init();
+
+    klog("SBI: v%ld.%ld\n", (sbi_spec_version() >> 24) & 0x7F, sbi_spec_version() & 0xFFFFFF);
+
+    trap_init();
+    pmu_init();
+    pmu_init_hart();
+    boot_checkpoint(BOOT_CONSOLE);
+
+    pmu_sample_t sample;
+    pmu_sample_begin(&sample);
 
-void kmain(boot_info_t* info) 
-{
-    uart_puts("Iris Kernel pre-rel. 0.0.1\n");
-    uart_puts("Core count: ");
-    uart_puti(info->core_count);
-    uart_puts("\n");
-    
     if(!phys_init(info))
-    {
-        uart_puts("ERROR: Failed to Initialize PMM!\n");
+        halt("ERROR: Failed to Initialize PMM!\n");
 
-        sbi_shutdown();
+    pmu_sample_end(&sample);
+    boot_checkpoint(BOOT_PHYS_INIT);
+    pmu_sample_log("phys_init", &sample);
 
-        // Halt
-        while (1) 
-        {
-            asm volatile("wfi");
-        }
-    }
-    
-    sbi_shutdown();
+    if(!klog_init(info))
+        halt("ERROR: Failed to allocate log rings!\n");
 
-    while (1) 
-    {
-        asm volatile("wfi");
-    }
+    if(!slab_init(info))
+        halt("ERROR: Failed to set up slab caches!\n");
+
+    if(!vm_init(info))
+        halt("ERROR: Failed to build kernel page tables!\n");
+
+    vm_activate();
+
+    if(vm_satp_mode() == 0)
+        halt("ERROR: No supported paging mode!\n");
+
+    boot_checkpoint(BOOT_PAGING);
+    klog("Paging: %s\n", vm_satp_mode() == SATP_MODE_SV48 ? "Sv48" : "Sv39");
+
+    if(!aspace_init(info))
+        halt("ERROR: Failed to set up ASID allocation!\n");
+
+    klog("Core count: %d, ASID bits: %d\n", info->core_count, aspace_asid_bits());
+
+    if(!sched_init(info))
+        halt("ERROR: Failed to set up run queues!\n");
+
+    if(!thread_init() || !ipc_init() || !channel_init())
+        halt("ERROR: Failed to create object caches!\n");
+
+    if(!timer_init(info))
+        halt("ERROR: Failed to set up timer wheels!\n");
+
+    timer_init_hart();
+    klog_init_hart();
+
+    klog("Timer: %lu kHz timebase, %s\n", timer_timebase() / 1000, timer_has_sstc() ? "Sstc" : "SBI");
+
+    if(plic_init(info) && uart_init_irq(info))
+        klog("Console: ns16550a @ 0x%lx, PLIC irq %u\n", info->uart_base, info->uart_irq);
+    else if(info->uart_base)
+        klog("Console: ns16550a @ 0x%lx, polled\n", info->uart_base);
+    else
+        klog("Console: SBI\n");
+
+    boot_checkpoint(BOOT_SERVICES);
+
+#ifdef IRIS_BENCH
+    trap_bench();
+    ipc_bench();
+    cap_bench();
+    boot_checkpoint(BOOT_BENCH);
+#endif
+
+    root_start(info);
+    boot_checkpoint(BOOT_ROOT);
+
+    int harts = hart_start_secondaries(info);
+    boot_checkpoint(BOOT_HARTS);
+
+    klog("Harts online: %d\n", harts);
+
+    boot_report(info);
+    phys_print_cache_stats();
+    klog_drain();
+
+    sched_run();
 }
 
-void boot_cmain(const void* dtb_ptr) 
+void boot_cmain(const void* dtb_ptr, uint64_t hartid) 
 {
+    boot_checkpoint(BOOT_CMAIN);
+
     boot_info_t info;
     info.core_count = 0;
+    info.boot_hart_id = hartid;
     info.memory_region_count = 0;
+    info.reserved_region_count = 0;
+    info.syscon_device_count = 0;
+    info.memory_regions = 0;
+    info.reserved_regions = 0;
+    info.syscon_devices = 0;
+    info.initrd_base = 0;
+    info.initrd_size = 0;
+    info.uart_base = 0;
+    info.uart_irq = 0;
+    info.plic_base = 0;
+    info.timebase_frequency = 0;
+    info.sstc_count = 0;
 
+    early_init((uintptr_t)dtb_ptr, dtb_total_size(dtb_ptr));
     dtb_parse(dtb_ptr, &info);
+    boot_checkpoint(BOOT_DTB_PARSED);
     
     kmain(&info);
 }
\ No newline at end of file
@@ -0,0 +1,405 @@
+#include "aspace.h"
+#include "physical.h"
+#include "slab.h"
+#include "../cpu/csr.h"
+#include "../cpu/hart.h"
+#include "../cpu/spinlock.h"
+#include "../device/opensbi.h"
+
+/* Past this many pages a range flush drops the whole address space instead */
+#define FLUSH_PAGES_MAX 64
+
+/*
+ * ASID allocation with generations, after the scheme Linux uses on arm64
+ * and RISC-V. An address space keeps its ASID for as long as its context
+ * carries the current generation, so switching to it needs no TLB flush.
+ * When the ASIDs of a generation run out, the generation is bumped, every
+ * hart is told to flush once before its next switch, and ASIDs still
+ * running somewhere are carried over so remote flushes by ASID stay valid.
+ */
+typedef struct
+{
+    spinlock_t lock;
+    int bits;
+    uint64_t count;         // Number of ASIDs, 0 is kept for the kernel
+    uint64_t generation;    // Current generation, already shifted
+    uint64_t next;          // Next ASID to try in the bitmap
+    uint64_t* map;          // ASIDs taken in the current generation
+
+    int hart_count;
+    uint64_t* active;       // Context each hart runs, 0 while a rollover is pending
+    uint64_t* reserved;     // Context each hart ran when the last rollover happened
+    bool* flush_pending;
+}
+asid_state_t;
+
+static asid_state_t asid_state;
+static slab_cache_t* aspace_cache;
+
+static inline uint64_t context_asid(uint64_t context)
+{
+    return context & ((1ULL << ASID_CONTEXT_SHIFT) - 1);
+}
+
+static inline uint64_t context_generation(uint64_t context)
+{
+    return context & ~((1ULL << ASID_CONTEXT_SHIFT) - 1);
+}
+
+static inline bool map_test(uint64_t asid)
+{
+    return asid_state.map[asid / 64] & (1ULL << (asid % 64));
+}
+
+static inline void map_set(uint64_t asid)
+{
+    asid_state.map[asid / 64] |= 1ULL << (asid % 64);
+}
+
+/* Write all ones into the ASID field and count what sticks */
+static int probe_asid_bits(void)
+{
+    uint64_t old = csr_read(satp);
+    csr_write(satp, old | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    uint64_t asid = (csr_read(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    csr_write(satp, old);
+
+    int bits = 0;
+    while(asid & 1)
+    {
+        bits++;
+        asid >>= 1;
+    }
+
+    return bits;
+}
+
+bool aspace_init(boot_info_t* info)
+{
+    asid_state.hart_count = info->core_count > 0 ? info->core_count : 1;
+    int harts = asid_state.hart_count;
+
+    asid_state.bits = probe_asid_bits();
+    asid_state.count = 1ULL << asid_state.bits;
+    asid_state.generation = 1ULL << ASID_CONTEXT_SHIFT;
+    asid_state.next = 1;
+
+    /* A rollover carries over one ASID per hart and must leave at least one free */
+    if(asid_state.count - 1 <= (uint64_t)harts)
+    {
+        asid_state.bits = 0;
+        asid_state.count = 1;
+    }
+
+    size_t map_size = ALIGN_UP(asid_state.count, 64) / 8;
+    asid_state.map = phys_alloc(map_size);
+    asid_state.active = phys_alloc(harts * sizeof(uint64_t));
+    asid_state.reserved = phys_alloc(harts * sizeof(uint64_t));
+    asid_state.flush_pending = phys_alloc(harts * sizeof(bool));
+
+    if(!asid_state.map || !asid_state.active || !asid_state.reserved || !asid_state.flush_pending)
+        return false;
+
+    for(size_t i = 0; i < map_size / 8; i++)
+        asid_state.map[i] = 0;
+
+    for(int i = 0; i < harts; i++)
+    {
+        asid_state.active[i] = 0;
+        asid_state.reserved[i] = 0;
+        asid_state.flush_pending[i] = false;
+    }
+
+    map_set(0);
+
+    aspace_cache = slab_cache_create("aspace", sizeof(aspace_t), 0, 0);
+    return aspace_cache != 0;
+}
+
+int aspace_asid_bits(void)
+{
+    return asid_state.bits;
+}
+
+/* Start a new generation, asid_state.lock must be held */
+static void rollover(void)
+{
+    asid_state.generation += 1ULL << ASID_CONTEXT_SHIFT;
+
+    for(uint64_t i = 0; i < ALIGN_UP(asid_state.count, 64) / 64; i++)
+        asid_state.map[i] = 0;
+    map_set(0);
+
+    for(int i = 0; i < asid_state.hart_count; i++)
+    {
+        uint64_t context = __atomic_exchange_n(&asid_state.active[i], 0, __ATOMIC_RELAXED);
+
+        /* A hart that hasn't switched since the last rollover still runs its reserved context */
+        if(context == 0)
+            context = asid_state.reserved[i];
+
+        if(context)
+            map_set(context_asid(context));
+
+        asid_state.reserved[i] = context;
+        asid_state.flush_pending[i] = true;
+    }
+
+    asid_state.next = 1;
+}
+
+/* Find an ASID for context in the current generation, asid_state.lock must be held */
+static uint64_t new_context(uint64_t context)
+{
+    if(context)
+    {
+        /* Still running somewhere, keep the ASID so remote flushes reach it */
+        uint64_t updated = asid_state.generation | context_asid(context);
+        bool hit = false;
+
+        for(int i = 0; i < asid_state.hart_count; i++)
+        {
+            if(asid_state.reserved[i] == context)
+            {
+                asid_state.reserved[i] = updated;
+                hit = true;
+            }
+        }
+
+        if(hit)
+            return updated;
+    }
+
+    for(int pass = 0; pass < 2; pass++)
+    {
+        while(asid_state.next < asid_state.count)
+        {
+            uint64_t asid = asid_state.next++;
+
+            if(!map_test(asid))
+            {
+                map_set(asid);
+                return asid_state.generation | asid;
+            }
+        }
+
+        rollover();
+    }
+
+    return 0;
+}
+
+void aspace_switch(aspace_t* as)
+{
+    unsigned int hart = hart_current();
+
+    if(!(__atomic_load_n(&as->harts, __ATOMIC_RELAXED) & HART_MASK(hart)))
+        __atomic_fetch_or(&as->harts, HART_MASK(hart), __ATOMIC_RELAXED);
+
+    /* No ASIDs, every switch has to flush */
+    if(asid_state.bits == 0)
+    {
+        csr_write(satp, vm_make_satp(vm_satp_mode(), 0, as->root));
+        sfence_vma();
+        return;
+    }
+
+    /*
+     * Fast path: the context is current, no rollover has zeroed this
+     * hart's active slot in the meantime and no flush is owed.
+     */
+    uint64_t context = __atomic_load_n(&as->context, __ATOMIC_RELAXED);
+    uint64_t old_active = __atomic_load_n(&asid_state.active[hart], __ATOMIC_RELAXED);
+
+    if(old_active && !__atomic_load_n(&asid_state.flush_pending[hart], __ATOMIC_RELAXED) &&
+       context_generation(context) == __atomic_load_n(&asid_state.generation, __ATOMIC_RELAXED) &&
+       __atomic_compare_exchange_n(&asid_state.active[hart], &old_active, context, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        csr_write(satp, vm_make_satp(vm_satp_mode(), context_asid(context), as->root));
+        return;
+    }
+
+    spin_lock(&asid_state.lock);
+
+    context = as->context;
+    if(context_generation(context) != asid_state.generation)
+    {
+        context = new_context(context);
+        __atomic_store_n(&as->context, context, __ATOMIC_RELAXED);
+    }
+
+    bool flush = asid_state.flush_pending[hart];
+    asid_state.flush_pending[hart] = false;
+    __atomic_store_n(&asid_state.active[hart], context, __ATOMIC_RELAXED);
+
+    spin_unlock(&asid_state.lock);
+
+    csr_write(satp, vm_make_satp(vm_satp_mode(), context_asid(context), as->root));
+
+    if(flush)
+        sfence_vma();
+}
+
+static void flush_local(uint64_t asid, uintptr_t va, size_t size)
+{
+    if(size > FLUSH_PAGES_MAX * PAGE_SIZE)
+    {
+        if(asid)
+            sfence_vma_asid(asid);
+        else
+            sfence_vma();
+        return;
+    }
+
+    for(uintptr_t page = ALIGN_DOWN(va, PAGE_SIZE); page < va + size; page += PAGE_SIZE)
+    {
+        if(asid)
+            sfence_vma_addr_asid(page, asid);
+        else
+            sfence_vma_addr(page);
+    }
+}
+
+void aspace_flush_range(aspace_t* as, uintptr_t va, size_t size)
+{
+    uint64_t asid = asid_state.bits ? context_asid(__atomic_load_n(&as->context, __ATOMIC_RELAXED)) : 0;
+
+    flush_local(asid, va, size);
+
+    hart_mask_t remote = __atomic_load_n(&as->harts, __ATOMIC_RELAXED) & hart_online_mask();
+    remote &= ~HART_MASK(hart_current());
+    if(!remote)
+        return;
+
+    if(size > FLUSH_PAGES_MAX * PAGE_SIZE)
+    {
+        va = 0;
+        size = 0;
+    }
+
+    sbiret_t ret;
+    if(asid)
+        ret = sbi_remote_sfence_vma_asid(remote, va, size, asid);
+    else
+        ret = sbi_remote_sfence_vma(remote, va, size);
+
+    if(ret.error != SBI_SUCCESS)
+    {
+        /*
+         * No RFENCE: have the harts flush everything on their next switch,
+         * the same thing a rollover does.
+         */
+        spin_lock(&asid_state.lock);
+        for(int i = 0; i < asid_state.hart_count; i++)
+        {
+            if(remote & HART_MASK(i))
+                asid_state.flush_pending[i] = true;
+        }
+        spin_unlock(&asid_state.lock);
+    }
+}
+
+void aspace_flush_page(aspace_t* as, uintptr_t va)
+{
+    aspace_flush_range(as, va, PAGE_SIZE);
+}
+
+/*
+ * The table whose entries map 1 GiB each. The user window and the kernel
+ * only part ways at this level: under Sv39 it is the root, under Sv48 the
+ * table below root entry 0, which covers the low 512 GiB of both.
+ */
+static pte_t* split_table(pte_t* root)
+{
+    if(vm_levels() == ASPACE_SPLIT_LEVEL + 1)
+        return root;
+
+    return (root[0] & PTE_V) && !(root[0] & PTE_LEAF) ? pte_table(root[0]) : 0;
+}
+
+aspace_t* aspace_create(void)
+{
+    aspace_t* as = slab_alloc(aspace_cache);
+    if(!as)
+        return 0;
+
+    as->root = phys_alloc_zeroed();
+    as->context = 0;
+    as->harts = 0;
+    cspace_init(&as->caps);
+
+    pte_t* table = vm_levels() == ASPACE_SPLIT_LEVEL + 1 ? as->root : phys_alloc_zeroed();
+
+    if(!as->root || !table)
+    {
+        if(as->root)
+            phys_free(as->root);
+        if(table && table != as->root)
+            phys_free(table);
+        slab_free(aspace_cache, as);
+        return 0;
+    }
+
+    /*
+     * Share the kernel's tables below the split level. Down to it the
+     * tables are copies, so user mappings land in entries of its own.
+     * Copies don't follow later kernel mappings, so there must be none.
+     */
+    vm_kernel_seal();
+
+    pte_t* kernel_root = vm_kernel_root();
+    for(int i = 0; i < PT_ENTRIES; i++)
+        as->root[i] = kernel_root[i];
+
+    if(table != as->root)
+    {
+        pte_t* kernel_table = split_table(kernel_root);
+        for(int i = 0; kernel_table && i < PT_ENTRIES; i++)
+            table[i] = kernel_table[i];
+
+        as->root[0] = (((uintptr_t)table >> PAGE_SHIFT) << PTE_PPN_SHIFT) | PTE_V;
+    }
+
+    return as;
+}
+
+void aspace_destroy(aspace_t* as)
+{
+    pte_t* table = split_table(as->root);
+    pte_t* kernel_table = split_table(vm_kernel_root());
+
+    for(int i = 0; i < PT_ENTRIES; i++)
+    {
+        pte_t entry = table[i];
+
+        if((entry & PTE_V) && !(entry & PTE_LEAF) && (!kernel_table || entry != kernel_table[i]))
+            vm_free_table(pte_table(entry), ASPACE_SPLIT_LEVEL - 1);
+    }
+
+    if(table != as->root)
+        phys_free(table);
+
+    /*
+     * The ASID is not handed out again before the next rollover, which
+     * flushes every hart, so stale entries tagged with it are harmless.
+     */
+    cspace_destroy(&as->caps);
+    phys_free(as->root);
+    slab_free(aspace_cache, as);
+}
+
+bool aspace_map(aspace_t* as, uintptr_t va, uintptr_t pa, size_t size, uint64_t flags)
+{
+    if(va < ASPACE_USER_BASE || va + size > ASPACE_USER_END || va + size < va || size == 0)
+        return false;
+
+    /* A kernel mapping in the window would be shared, writing below it would change every space */
+    pte_t* kernel_table = split_table(vm_kernel_root());
+    for(uintptr_t slot = va / ASPACE_SPLIT_SIZE; kernel_table && slot <= (va + size - 1) / ASPACE_SPLIT_SIZE; slot++)
+    {
+        if(kernel_table[slot] & PTE_V)
+            return false;
+    }
+
+    return vm_map(as->root, va, pa, size, (flags & (PTE_R | PTE_W | PTE_X)) | PTE_U);
+}
@@ -0,0 +1,58 @@
+#ifndef ASPACE_H
+#define ASPACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../bootinfo.h"
+#include "virtual.h"
+#include "../cpu/hart.h"
+#include "../kernel/cap.h"
+
+/*
+ * User mappings live above the kernel's identity direct map and below the
+ * top of the Sv39 lower half, so the same layout works for Sv39 and Sv48.
+ */
+#define ASPACE_USER_BASE 0x0000001000000000ULL  // 64 GiB
+#define ASPACE_USER_END  0x0000004000000000ULL  // 256 GiB
+
+/*
+ * Level where the kernel's and a user space's tables part ways, the user
+ * window takes whole entries of it. Above it every space has copies.
+ */
+#define ASPACE_SPLIT_LEVEL 2
+#define ASPACE_SPLIT_SIZE  VM_LEVEL_SIZE(ASPACE_SPLIT_LEVEL)
+
+/* ASIDs are tagged with a generation: context = generation << 16 | asid */
+#define ASID_CONTEXT_SHIFT 16
+
+typedef struct
+{
+    pte_t* root;
+    uint64_t context;  // 0 until the address space first runs
+    hart_mask_t harts; // Harts that ran as and may still cache its translations
+    cspace_t caps;     // Capabilities of every thread in as
+}
+aspace_t;
+
+bool aspace_init(boot_info_t* info);
+int aspace_asid_bits(void);
+
+aspace_t* aspace_create(void);
+void aspace_destroy(aspace_t* as);
+
+/* Map user memory, flags are PTE_R/W/X, PTE_U is added */
+bool aspace_map(aspace_t* as, uintptr_t va, uintptr_t pa, size_t size, uint64_t flags);
+
+/* Make as the address space of the executing hart */
+void aspace_switch(aspace_t* as);
+
+/*
+ * Drop the TLB entries for [va, va + size) of as on every hart that ran
+ * it, the remote harts are reached with a single batched SBI call.
+ */
+void aspace_flush_range(aspace_t* as, uintptr_t va, size_t size);
+void aspace_flush_page(aspace_t* as, uintptr_t va);
+
+#endif // ASPACE_H
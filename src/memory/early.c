@@ -0,0 +1,66 @@
+#include "early.h"
+#include "physical.h"
+
+// Kernel image bounds from linker.ld
+extern char __kernel_end[];
+
+static struct
+{
+    uintptr_t start;
+    uintptr_t next;
+    uintptr_t last;        // Start of the most recent allocation
+    mem_region_t avoid;
+    bool sealed;
+}
+early_state;
+
+void early_init(uintptr_t dtb_base, size_t dtb_size)
+{
+    early_state.start = ALIGN_UP((uintptr_t)__kernel_end, PAGE_SIZE);
+    early_state.next = early_state.start;
+    early_state.last = 0;
+    early_state.avoid.base = dtb_base;
+    early_state.avoid.size = dtb_size;
+    early_state.sealed = false;
+}
+
+static inline bool hits_avoid(uintptr_t ptr, size_t size)
+{
+    return early_state.avoid.size && ptr < early_state.avoid.base + early_state.avoid.size &&
+           ptr + size > early_state.avoid.base;
+}
+
+void* early_alloc(size_t size, size_t align)
+{
+    if(early_state.sealed || !early_state.start)
+        return 0;
+
+    uintptr_t ptr = ALIGN_UP(early_state.next, align);
+
+    if(hits_avoid(ptr, size))
+        ptr = ALIGN_UP(early_state.avoid.base + early_state.avoid.size, align);
+
+    early_state.last = ptr;
+    early_state.next = ptr + size;
+    return (void*)ptr;
+}
+
+bool early_resize(void* ptr, size_t size)
+{
+    if(early_state.sealed || !early_state.last || (uintptr_t)ptr != early_state.last)
+        return false;
+
+    if(hits_avoid(early_state.last, size))
+        return false;
+
+    early_state.next = early_state.last + size;
+    return true;
+}
+
+mem_region_t early_seal(void)
+{
+    early_state.sealed = true;
+
+    mem_region_t region = { early_state.start, early_state.next - early_state.start };
+    return region;
+}
@@ -0,0 +1,28 @@
+#ifndef EARLY_H
+#define EARLY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../bootinfo.h"
+
+/*
+ * Bump allocator for boot, before the PMM exists. It hands out memory
+ * right behind the kernel image, stepping over the DTB if the firmware
+ * put it there. Nothing is ever freed, phys_init reserves the whole
+ * arena and seals it. The initrd is only known after the DTB is parsed,
+ * boot loaders put it well above the kernel.
+ */
+void early_init(uintptr_t dtb_base, size_t dtb_size);
+
+/* align must be a power of two, returns 0 once sealed */
+void* early_alloc(size_t size, size_t align);
+
+/* Grow or shrink the most recent allocation in place, false if it can't grow */
+bool early_resize(void* ptr, size_t size);
+
+/* Stop handing out memory and return everything the arena used */
+mem_region_t early_seal(void);
+
+#endif // EARLY_H
@@ -1,55 +1,182 @@
 #include "physical.h"
+#include "early.h"
+#include "../kernel/bootprof.h"
+#include "../kernel/klog.h"
+#include "../cpu/bitops.h"
+
+#if defined(__riscv_vector)
+#include <riscv_vector.h>
+#endif
+
+// Kernel image bounds from linker.ld
+extern char __kernel_start[];
+extern char __kernel_end[];
+
+/*
+ * Page metadata, 4 bits per page:
+ *   bit 3    - page is free
+ *   bits 0-2 - order + 1 if the page is the head of a buddy block, 0 otherwise
+ *
+ * A nulled table marks every page as used and not a block head, which is
+ * also how reserved pages look. Only block heads can be freed.
+ */
+#define PAGE_FREE       0x8
+#define PAGE_HEAD(order) ((order) + 1)
+#define PAGE_ORDER(meta) (((meta) & 0x7) - 1)
+#define PAGE_IS_HEAD(meta) (((meta) & 0x7) != 0)
+
+/* Free bits of the 16 pages described by one 64-bit word of metadata */
+#define PAGE_WORD_FREE  0x8888888888888888ULL
+#define PAGES_PER_WORD  16
+
+/* Kernel, DTB, initrd and the early arena */
+#define BOOT_IMAGES 4
+
+/* Smallest gap worth managing, metadata included */
+#define PMM_ZONE_MIN_SIZE (PAGE_SIZE * 4)
+
+/* First word of a page sitting in a hart cache, mixed with its address */
+#define PMM_CACHED_TAG 0x697269735f706167ULL
 
 static void get_overlap(mem_region_t* out, mem_region_t* a, mem_region_t* b);
-static mem_region_t find_largest_gap(mem_region_t* available, int avail_count, mem_region_t* reserved, int reserved_count);
+static int find_gaps(mem_region_t* available, int avail_count, mem_region_t* reserved, int reserved_count, mem_region_t* contained, mem_region_t* out, int out_max);
+static bool zone_init(pmm_zone_t* zone, mem_region_t* gap, mem_region_t* avoid, int avoid_count);
+static void zone_build_free_lists(pmm_zone_t* zone);
+static void reserve_range(pmm_zone_t* zone, uintmax_t first, uintmax_t end);
+static void free_range(pmm_zone_t* zone, size_t first, size_t count);
 
 static pmm_state_t pmm_state;
 
 bool phys_init(boot_info_t* info)
 {
-    mem_region_t best_region = find_largest_gap
+    /* Each reserved region can split a memory region once more */
+    int gap_max = info->memory_region_count * (info->reserved_region_count + 1);
+    mem_region_t* gaps = early_alloc(gap_max * sizeof(mem_region_t), 8);
+    mem_region_t* contained = early_alloc(info->reserved_region_count * sizeof(mem_region_t), 8);
+    pmm_state.zones = early_alloc(gap_max * sizeof(pmm_zone_t), 8);
+
+    if(!gaps || !contained || !pmm_state.zones)
+        return false;
+
+    int gap_count = find_gaps
     (
         info->memory_regions,
         info->memory_region_count,
         info->reserved_regions,
-        info->reserved_region_count
+        info->reserved_region_count,
+        contained,
+        gaps,
+        gap_max
     );
 
-    /* Set page table region */
-    uint64_t original_base = best_region.base;
-    uint64_t original_size = best_region.size;
-    pmm_state.metadata.base = ALIGN_UP(original_base, 64);
-    pmm_state.metadata.size = original_size / (PAGE_SIZE * 2); // 4 bits for each min sized page
+    /* Sort by base so zone lookups can bisect */
+    for (int x = 0; x < gap_count - 1; ++x)
+    {
+        for (int y = x + 1; y < gap_count; ++y)
+        {
+            if (gaps[x].base > gaps[y].base)
+            {
+                mem_region_t tmp = gaps[x];
+                gaps[x] = gaps[y];
+                gaps[y] = tmp;
+            }
+        }
+    }
 
-    /* Set usable region */
-    uint64_t metadata_end = pmm_state.metadata.base + pmm_state.metadata.size;
-    pmm_state.usable.base = ALIGN_UP(metadata_end, PAGE_SIZE);
-    pmm_state.usable.size = (original_base + original_size) - best_region.base;
-    pmm_state.page_count = pmm_state.usable.size / PAGE_SIZE;
+    /* Memory the firmware doesn't know about but that must never be handed out */
+    mem_region_t boot_images[BOOT_IMAGES] =
+    {
+        { (uintptr_t)__kernel_start, (uintptr_t)__kernel_end - (uintptr_t)__kernel_start },
+        { info->dtb_base, info->dtb_size },
+        { info->initrd_base, info->initrd_size },
+        early_seal(),
+    };
 
-    /* Null table */
-    for(size_t i = 0; i < pmm_state.metadata.size; i += 8)
+    pmm_state.ready = false;
+    pmm_state.zone_count = 0;
+
+    for(int i = 0; i < gap_count; i++)
     {
-        uint64_t* pp = pmm_state.metadata.base + i;
-        *pp = 0x0000000000000000;
+        pmm_zone_t* zone = &pmm_state.zones[pmm_state.zone_count];
+
+        if(zone_init(zone, &gaps[i], boot_images, BOOT_IMAGES))
+            pmm_state.zone_count++;
     }
 
-    uart_puts("Available Memory: ");
-    uart_puti(best_region.size / (1024 * 1024));
-    uart_puts(" MiB\n");
+    if(pmm_state.zone_count == 0)
+        return false;
+
+    for(int i = 0; i < BOOT_IMAGES; i++)
+    {
+        if(boot_images[i].size)
+            phys_reserve((void*)boot_images[i].base, boot_images[i].size);
+    }
+
+    boot_checkpoint(BOOT_PHYS_ZONES);
+
+    /* Only now are all reserved runs known and the free pages safe to link */
+    size_t total_size = 0;
+    for(int i = 0; i < pmm_state.zone_count; i++)
+    {
+        zone_build_free_lists(&pmm_state.zones[i]);
+        total_size += pmm_state.zones[i].free_pages * PAGE_SIZE;
+    }
+
+    pmm_state.ready = true;
+
+    /* Per-hart page caches, taken from the pool itself */
+    int harts = info->core_count > 0 ? info->core_count : 1;
+    pmm_state.cache_count = 0;
+    pmm_state.caches = phys_alloc(harts * sizeof(pmm_cache_t));
+    if(pmm_state.caches)
+    {
+        for(int i = 0; i < harts; i++)
+        {
+            pmm_state.caches[i].count = 0;
+            pmm_state.caches[i].hits = 0;
+            pmm_state.caches[i].misses = 0;
+        }
+        pmm_state.cache_count = harts;
+    }
+
+    klog("Available Memory: %lu MiB in %d zones\n", (uint64_t)(total_size / (1024 * 1024)), pmm_state.zone_count);
 
     return true;
 }
 
 void phys_reserve(void* ptr, size_t size)
 {
+    uintptr_t start = ALIGN_DOWN((uintptr_t)ptr, PAGE_SIZE);
+    uintptr_t end = ALIGN_UP((uintptr_t)ptr + size, PAGE_SIZE);
+
+    if(end <= start)
+        return;
+
+    if(pmm_state.ready)
+        spin_lock(&pmm_state.lock);
+
+    for(int i = 0; i < pmm_state.zone_count; i++)
+    {
+        pmm_zone_t* zone = &pmm_state.zones[i];
+        uintptr_t zone_end = zone->usable.base + zone->usable.size;
+
+        if(end <= zone->usable.base || start >= zone_end)
+            continue;
+
+        uintptr_t from = start > zone->usable.base ? start : zone->usable.base;
+        uintptr_t to = end < zone_end ? end : zone_end;
+
+        reserve_range(zone, (from - zone->usable.base) / PAGE_SIZE, (to - zone->usable.base) / PAGE_SIZE);
+    }
 
+    if(pmm_state.ready)
+        spin_unlock(&pmm_state.lock);
 }
 
-static uint8_t get_page(uintmax_t index)
+static uint8_t get_page(pmm_zone_t* zone, uintmax_t index)
 {
     int m = index % 2;
-    uint8_t* base = pmm_state.metadata.base + index / 2;
+    uint8_t* base = (uint8_t*)(zone->metadata.base + index / 2);
     uint8_t meta = 0b1100;
 
     if(m == 1)
@@ -57,32 +184,770 @@ static uint8_t get_page(uintmax_t index)
     else
         meta = ((*base) & 0xF0) >> 4;
 
-    return meta;  
+    return meta;
 }
 
-void* phys_alloc(size_t size)
+static void set_page(pmm_zone_t* zone, uintmax_t index, uint8_t meta)
+{
+    uint8_t* base = (uint8_t*)(zone->metadata.base + index / 2);
+
+    if(index % 2 == 1)
+        *base = (*base & 0xF0) | (meta & 0x0F);
+    else
+        *base = (*base & 0x0F) | ((meta & 0x0F) << 4);
+}
+
+/* Set the metadata of count pages starting at first, a byte at a time where possible */
+static void set_page_run(pmm_zone_t* zone, uintmax_t first, size_t count, uint8_t meta)
+{
+    uintmax_t end = first + count;
+
+    if(first < end && first % 2 == 1)
+        set_page(zone, first++, meta);
+
+    if(first < end && end % 2 == 1)
+        set_page(zone, --end, meta);
+
+    uint8_t pair = (meta << 4) | meta;
+    uint8_t* base = (uint8_t*)(zone->metadata.base + first / 2);
+
+    for(uintmax_t i = 0; i < (end - first) / 2; i++)
+        base[i] = pair;
+}
+
+/*
+ * Page indices are relative to the zone, which is only page aligned.
+ * Buddies pair up by absolute frame number instead, so a block of order k
+ * is aligned to its size in physical memory.
+ */
+static inline uintmax_t zone_base_pfn(pmm_zone_t* zone)
+{
+    return zone->usable.base >> PAGE_SHIFT;
+}
+
+static inline pmm_block_t* page_to_block(pmm_zone_t* zone, uintmax_t index)
+{
+    return (pmm_block_t*)(zone->usable.base + index * PAGE_SIZE);
+}
+
+static inline uintmax_t block_to_page(pmm_zone_t* zone, void* block)
+{
+    return ((uintptr_t)block - zone->usable.base) / PAGE_SIZE;
+}
+
+/* Find the zone managing addr by bisecting the sorted zone table */
+static pmm_zone_t* addr_to_zone(uintptr_t addr)
 {
-    bool found = false;
-    uintmax_t pages = 0;
+    int low = 0;
+    int high = pmm_state.zone_count - 1;
 
-    while(!found)
+    while(low <= high)
     {
-        while(1)
+        int mid = (low + high) / 2;
+        pmm_zone_t* zone = &pmm_state.zones[mid];
+
+        if(addr < zone->usable.base)
+            high = mid - 1;
+        else if(addr >= zone->usable.base + zone->usable.size)
+            low = mid + 1;
+        else
+            return zone;
+    }
+
+    return 0;
+}
+
+static void list_push(pmm_zone_t* zone, int order, uintmax_t index)
+{
+    pmm_block_t* block = page_to_block(zone, index);
+    pmm_block_t* head = zone->free_lists[order];
+
+    block->prev = 0;
+    block->next = head;
+    if(head)
+        head->prev = block;
+
+    zone->free_lists[order] = block;
+}
+
+static void list_remove(pmm_zone_t* zone, int order, uintmax_t index)
+{
+    pmm_block_t* block = page_to_block(zone, index);
+
+    if(block->prev)
+        block->prev->next = block->next;
+    else
+        zone->free_lists[order] = block->next;
+
+    if(block->next)
+        block->next->prev = block->prev;
+}
+
+/* Mark a block as free, merging it with its buddies as far as possible */
+static void free_block(pmm_zone_t* zone, uintmax_t index, int order)
+{
+    uintmax_t base = zone_base_pfn(zone);
+
+    set_page_run(zone, index, (size_t)1 << order, PAGE_FREE);
+    zone->free_pages += (size_t)1 << order;
+
+    while(order < PMM_MAX_ORDER)
+    {
+        uintmax_t buddy_pfn = (base + index) ^ ((uintmax_t)1 << order);
+
+        if(buddy_pfn < base)
+            break;
+
+        uintmax_t buddy = buddy_pfn - base;
+        if(buddy + ((uintmax_t)1 << order) > zone->page_count)
+            break;
+
+        if(get_page(zone, buddy) != (PAGE_FREE | PAGE_HEAD(order)))
+            break;
+
+        list_remove(zone, order, buddy);
+        set_page(zone, buddy, PAGE_FREE);
+
+        if(buddy < index)
+            index = buddy;
+        order++;
+    }
+
+    set_page(zone, index, PAGE_FREE | PAGE_HEAD(order));
+    list_push(zone, order, index);
+}
+
+/* Hand count pages starting at first to the allocator as maximal aligned blocks */
+static void free_range(pmm_zone_t* zone, size_t first, size_t count)
+{
+    size_t end = first + count;
+    uintmax_t base = zone_base_pfn(zone);
+
+    while(first < end)
+    {
+        int order = PMM_MAX_ORDER;
+
+        while(order > 0 && ((base + first) % ((size_t)1 << order) != 0 || first + ((size_t)1 << order) > end))
+            order--;
+
+        free_block(zone, first, order);
+        first += (size_t)1 << order;
+    }
+}
+
+/* Find the head of the free block containing page index */
+static uintmax_t free_block_head(pmm_zone_t* zone, uintmax_t index, int* order)
+{
+    uintmax_t base = zone_base_pfn(zone);
+
+    for(int k = 0; k <= PMM_MAX_ORDER; k++)
+    {
+        uintmax_t head_pfn = ALIGN_DOWN(base + index, (uintmax_t)1 << k);
+        if(head_pfn < base)
+            break;
+
+        uintmax_t head = head_pfn - base;
+        uint8_t meta = get_page(zone, head);
+
+        if(PAGE_IS_HEAD(meta) && head + ((uintmax_t)1 << PAGE_ORDER(meta)) > index)
+        {
+            *order = PAGE_ORDER(meta);
+            return head;
+        }
+    }
+
+    *order = 0;
+    return index;
+}
+
+/*
+ * Mark pages [first, end) as reserved. Before the free lists exist this is
+ * a single run write. Afterwards every free block overlapping the range is
+ * unlinked, the whole block is marked used and the parts outside the range
+ * are freed again. Pages that are already in use are left alone.
+ */
+static void reserve_range(pmm_zone_t* zone, uintmax_t first, uintmax_t end)
+{
+    if(!pmm_state.ready)
+    {
+        set_page_run(zone, first, end - first, 0);
+        return;
+    }
+
+    uintmax_t index = first;
+    while(index < end)
+    {
+        if(!(get_page(zone, index) & PAGE_FREE))
+        {
+            index++;
+            continue;
+        }
+
+        int order;
+        uintmax_t head = free_block_head(zone, index, &order);
+        uintmax_t block_end = head + ((uintmax_t)1 << order);
+
+        list_remove(zone, order, head);
+        zone->free_pages -= (size_t)1 << order;
+        set_page_run(zone, head, (size_t)1 << order, 0);
+
+        uintmax_t run_end = block_end < end ? block_end : end;
+
+        if(head < index)
+            free_range(zone, head, index - head);
+        if(run_end < block_end)
+            free_range(zone, run_end, block_end - run_end);
+
+        index = run_end;
+    }
+}
+
+/* Link every run of pages still marked free into the free lists */
+static void zone_build_free_lists(pmm_zone_t* zone)
+{
+    uintmax_t index = 0;
+
+    while(index < zone->page_count)
+    {
+        if(!(get_page(zone, index) & PAGE_FREE))
+        {
+            index++;
+            continue;
+        }
+
+        uintmax_t run = index;
+        while(run < zone->page_count && (get_page(zone, run) & PAGE_FREE))
+            run++;
+
+        free_range(zone, index, run - index);
+        index = run;
+    }
+}
+
+/*
+ * Cover the whole gap with one zone and place its metadata table at the
+ * first spot that doesn't overlap any of the avoid regions. The table's own
+ * pages are then reserved like any other run.
+ */
+static bool zone_init(pmm_zone_t* zone, mem_region_t* gap, mem_region_t* avoid, int avoid_count)
+{
+    if(gap->size < PMM_ZONE_MIN_SIZE)
+        return false;
+
+    /* Set usable region */
+    zone->usable.base = ALIGN_UP(gap->base, PAGE_SIZE);
+    uintptr_t gap_end = ALIGN_DOWN(gap->base + gap->size, PAGE_SIZE);
+    if(gap_end <= zone->usable.base)
+        return false;
+
+    zone->usable.size = gap_end - zone->usable.base;
+    zone->page_count = zone->usable.size / PAGE_SIZE;
+
+    /* Set page table region */
+    zone->metadata.size = ALIGN_UP((zone->page_count + 1) / 2, 8); // 4 bits for each min sized page
+    zone->metadata.base = zone->usable.base;
+
+    for(int i = 0; i < avoid_count; i++)
+    {
+        uintptr_t a_start = avoid[i].base;
+        uintptr_t a_end = avoid[i].base + avoid[i].size;
+
+        if(avoid[i].size && a_start < zone->metadata.base + zone->metadata.size && a_end > zone->metadata.base)
         {
-            uint8_t* meta =  
+            zone->metadata.base = ALIGN_UP(a_end, PAGE_SIZE);
+            i = -1; // Start over, the new spot may hit an earlier region
         }
     }
 
+    if(zone->metadata.base + zone->metadata.size > gap_end)
+        return false;
+
+    /* Null table */
+    for(size_t i = 0; i < zone->metadata.size; i += 8)
+    {
+        uint64_t* pp = (uint64_t*)(zone->metadata.base + i);
+        *pp = 0x0000000000000000;
+    }
+
+    for(int i = 0; i < PMM_ORDER_COUNT; i++)
+        zone->free_lists[i] = 0;
+
+    zone->free_pages = 0;
+
+    /* Everything starts out free, then the table reserves itself */
+    set_page_run(zone, 0, zone->page_count, PAGE_FREE);
+
+    uintmax_t meta_first = (zone->metadata.base - zone->usable.base) / PAGE_SIZE;
+    uintmax_t meta_end = (ALIGN_UP(zone->metadata.base + zone->metadata.size, PAGE_SIZE) - zone->usable.base) / PAGE_SIZE;
+    reserve_range(zone, meta_first, meta_end);
+
+    return true;
+}
+
+static int size_to_order(size_t size)
+{
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    int order = 0;
+
+    while(((size_t)1 << order) < pages)
+        order++;
+
+    return order;
+}
+
+/* Take a block of the given order from a zone, pmm_state.lock must be held */
+static void* alloc_block(pmm_zone_t* zone, int order)
+{
+    int current = order;
+    while(current <= PMM_MAX_ORDER && !zone->free_lists[current])
+        current++;
+
+    if(current > PMM_MAX_ORDER)
+        return 0;
+
+    uintmax_t index = block_to_page(zone, zone->free_lists[current]);
+    list_remove(zone, current, index);
+
+    /* Split off upper halves until the block has the requested order */
+    while(current > order)
+    {
+        current--;
+        uintmax_t buddy = index + ((uintmax_t)1 << current);
+        set_page(zone, buddy, PAGE_FREE | PAGE_HEAD(current));
+        list_push(zone, current, buddy);
+    }
+
+    set_page_run(zone, index, (size_t)1 << order, 0);
+    set_page(zone, index, PAGE_HEAD(order));
+    zone->free_pages -= (size_t)1 << order;
+
+    return page_to_block(zone, index);
+}
+
+/* Take a block from the first zone that can satisfy it, pmm_state.lock must be held */
+static void* alloc_any(int order)
+{
+    for(int i = 0; i < pmm_state.zone_count; i++)
+    {
+        void* block = alloc_block(&pmm_state.zones[i], order);
+        if(block)
+            return block;
+    }
+
     return 0;
 }
 
+/*
+ * Pages sitting in a hart cache stay marked as allocated order-0 blocks in
+ * the metadata, so moving them in and out of a cache never touches the
+ * shared table or the lock. Instead their first word holds a tag, which
+ * is what catches a page freed a second time while it is cached.
+ */
+static inline uint64_t* cached_tag(void* page)
+{
+    return (uint64_t*)page;
+}
+
+static inline uint64_t cached_tag_value(void* page)
+{
+    return PMM_CACHED_TAG ^ (uintptr_t)page;
+}
+
+static inline void* cache_pop(pmm_cache_t* cache)
+{
+    void* page = cache->pages[--cache->count];
+    *cached_tag(page) = 0;
+    return page;
+}
+
+static void cache_refill(pmm_cache_t* cache)
+{
+    spin_lock(&pmm_state.lock);
+
+    while(cache->count < PMM_CACHE_BATCH)
+    {
+        void* page = alloc_any(0);
+        if(!page)
+            break;
+
+        /* alloc_block just unlinked it, the line is hot */
+        *cached_tag(page) = cached_tag_value(page);
+        cache->pages[cache->count++] = page;
+    }
+
+    spin_unlock(&pmm_state.lock);
+}
+
+static void cache_drain(pmm_cache_t* cache)
+{
+    spin_lock(&pmm_state.lock);
+
+    while(cache->count > PMM_CACHE_SIZE - PMM_CACHE_BATCH)
+    {
+        void* page = cache->pages[--cache->count];
+        pmm_zone_t* zone = addr_to_zone((uintptr_t)page);
+        free_block(zone, block_to_page(zone, page), 0);
+    }
+
+    spin_unlock(&pmm_state.lock);
+}
+
+static pmm_cache_t* current_cache(void)
+{
+    unsigned int hart = hart_current();
+
+    if(hart >= (unsigned int)pmm_state.cache_count)
+        return 0;
+
+    return &pmm_state.caches[hart];
+}
+
+static void* zeroed_pop(void)
+{
+    spin_lock(&pmm_state.zeroed_lock);
+
+    pmm_block_t* page = pmm_state.zeroed;
+    if(page)
+    {
+        pmm_state.zeroed = page->next;
+        pmm_state.zeroed_count--;
+    }
+
+    spin_unlock(&pmm_state.zeroed_lock);
+
+    if(page)
+        page->next = 0; // The link was the only non-zero word
+    return page;
+}
+
+static void page_zero(void* page)
+{
+    volatile uint64_t* p = (volatile uint64_t*)page;
+    volatile uint64_t* end = p + PAGE_SIZE / sizeof(uint64_t);
+
+    while(p < end)
+    {
+        p[0] = 0; p[1] = 0; p[2] = 0; p[3] = 0;
+        p[4] = 0; p[5] = 0; p[6] = 0; p[7] = 0;
+        p += 8;
+    }
+}
+
+/* Cache or buddy allocation, without falling back to the zeroed pool */
+static void* alloc_pages(int order)
+{
+    pmm_cache_t* cache = order == 0 ? current_cache() : 0;
+    if(cache)
+    {
+        if(cache->count > 0)
+        {
+            cache->hits++;
+            return cache_pop(cache);
+        }
+
+        cache->misses++;
+        cache_refill(cache);
+
+        if(cache->count > 0)
+            return cache_pop(cache);
+    }
+
+    spin_lock(&pmm_state.lock);
+    void* block = alloc_any(order);
+    spin_unlock(&pmm_state.lock);
+
+    return block;
+}
+
+void* phys_alloc(size_t size)
+{
+    int order = size_to_order(size);
+
+    if(order > PMM_MAX_ORDER)
+        return 0;
+
+    void* block = alloc_pages(order);
+
+    /* Out of memory, the zeroed pool is the last place to look */
+    if(!block && order == 0)
+        block = zeroed_pop();
+
+    return block;
+}
+
 void phys_free(void* ptr)
 {
-    if(ptr < pmm_state.usable.base)
+    uintptr_t addr = (uintptr_t)ptr;
+
+    if(!IS_ALIGNED(addr, PAGE_SIZE))
+        return;
+
+    pmm_zone_t* zone = addr_to_zone(addr);
+    if(!zone)
+        return;
+
+    uintmax_t index = block_to_page(zone, ptr);
+    pmm_cache_t* cache = current_cache();
+
+    /*
+     * The metadata of an order-0 page the caller owns can't change under
+     * it, so the cache path reads it without the lock. A page already in
+     * some cache still looks allocated there, its tag gives it away.
+     */
+    if(cache && get_page(zone, index) == PAGE_HEAD(0))
+    {
+        if(*cached_tag(ptr) == cached_tag_value(ptr))
+            return;
+
+        if(cache->count == PMM_CACHE_SIZE)
+            cache_drain(cache);
+
+        *cached_tag(ptr) = cached_tag_value(ptr);
+        cache->pages[cache->count++] = ptr;
+        return;
+    }
+
+    spin_lock(&pmm_state.lock);
+
+    /* Only allocated block heads can be freed */
+    uint8_t meta = get_page(zone, index);
+    if(!(meta & PAGE_FREE) && PAGE_IS_HEAD(meta))
+        free_block(zone, index, PAGE_ORDER(meta));
+
+    spin_unlock(&pmm_state.lock);
+}
+
+/*
+ * Free bits of one metadata word with page i of the word at bit 4 * i + 3.
+ * Even pages live in the high nibble of each byte, so swap nibbles first.
+ */
+static inline uint64_t word_free_mask(uint64_t word)
+{
+    word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return word & PAGE_WORD_FREE;
+}
+
+/* First word at or after from whose free bits differ from pattern, or count */
+static size_t skip_words(const uint64_t* words, size_t from, size_t count, uint64_t pattern)
+{
+#if defined(__riscv_vector)
+    while(from < count)
+    {
+        size_t vl = __riscv_vsetvl_e64m8(count - from);
+        vuint64m8_t v = __riscv_vle64_v_u64m8(&words[from], vl);
+        v = __riscv_vand_vx_u64m8(v, PAGE_WORD_FREE, vl);
+
+        long first = __riscv_vfirst_m_b8(__riscv_vmsne_vx_u64m8_b8(v, pattern, vl), vl);
+        if(first >= 0)
+            return from + first;
+
+        from += vl;
+    }
+
+    return count;
+#else
+    while(from < count && (words[from] & PAGE_WORD_FREE) == pattern)
+        from++;
+
+    return from;
+#endif
+}
+
+/* First page index at or after index whose address is aligned to align */
+static inline uintmax_t align_page(pmm_zone_t* zone, uintmax_t index, size_t align)
+{
+    uintptr_t addr = zone->usable.base + index * PAGE_SIZE;
+    return (ALIGN_UP(addr, align) - zone->usable.base) / PAGE_SIZE;
+}
+
+/*
+ * Look for pages free pages starting at an align boundary, 16 pages per
+ * metadata word. Fully used and fully free words are skipped in bulk, only
+ * words holding a run boundary are looked at bit by bit.
+ */
+static bool find_free_run(pmm_zone_t* zone, size_t pages, size_t align, uintmax_t* out)
+{
+    const uint64_t* words = (const uint64_t*)zone->metadata.base;
+    size_t word_count = zone->metadata.size / 8;
+    uintmax_t run_start = 0;
+    size_t w = 0;
+
+    while(w < word_count)
+    {
+        uint64_t free = word_free_mask(words[w]);
+
+        if(free == PAGE_WORD_FREE)
+        {
+            /* Extend the current run across all fully free words */
+            w = skip_words(words, w, word_count, PAGE_WORD_FREE);
+        }
+        else if(free == 0)
+        {
+            w = skip_words(words, w, word_count, 0);
+            run_start = w * PAGES_PER_WORD;
+            continue;
+        }
+        else
+        {
+            uint64_t used = ~free & PAGE_WORD_FREE;
+
+            while(used)
+            {
+                uintmax_t page = w * PAGES_PER_WORD + ctz64(used) / 4;
+                uintmax_t candidate = align_page(zone, run_start, align);
+
+                if(candidate + pages <= page)
+                {
+                    *out = candidate;
+                    return true;
+                }
+
+                run_start = page + 1;
+                used &= used - 1;
+            }
+
+            w++;
+        }
+
+        /* The run now reaches the end of word w - 1 */
+        uintmax_t run_end = w * PAGES_PER_WORD;
+        if(run_end > zone->page_count)
+            run_end = zone->page_count;
+
+        uintmax_t candidate = align_page(zone, run_start, align);
+        if(candidate + pages <= run_end)
+        {
+            *out = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Whether pages [first, first + count) are all marked used and not block heads */
+static bool run_is_claimed(pmm_zone_t* zone, uintmax_t first, size_t count)
+{
+    uintmax_t end = first + count;
+
+    if(first < end && first % 2 == 1 && get_page(zone, first++) != 0)
+        return false;
+
+    if(first < end && end % 2 == 1 && get_page(zone, --end) != 0)
+        return false;
+
+    /* Pairs of pages a byte at a time, like set_page_run */
+    const uint8_t* base = (const uint8_t*)(zone->metadata.base + first / 2);
+
+    for(uintmax_t i = 0; i < (end - first) / 2; i++)
+    {
+        if(base[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+void* phys_alloc_contiguous(size_t pages, size_t align)
+{
+    if(pages == 0)
+        return 0;
+
+    if(align < PAGE_SIZE)
+        align = PAGE_SIZE;
+
+    if((align & (align - 1)) != 0)
+        return 0;
+
+    void* result = 0;
+    spin_lock(&pmm_state.lock);
+
+    for(int i = 0; i < pmm_state.zone_count; i++)
+    {
+        pmm_zone_t* zone = &pmm_state.zones[i];
+        uintmax_t first;
+
+        if(zone->free_pages < pages || !find_free_run(zone, pages, align, &first))
+            continue;
+
+        /* Claiming a run of free pages is the same as reserving it */
+        reserve_range(zone, first, first + pages);
+        result = page_to_block(zone, first);
+        break;
+    }
+
+    spin_unlock(&pmm_state.lock);
+    return result;
+}
+
+void phys_free_contiguous(void* ptr, size_t pages)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+
+    if(!IS_ALIGNED(addr, PAGE_SIZE) || pages == 0)
+        return;
+
+    pmm_zone_t* zone = addr_to_zone(addr);
+    if(!zone)
         return;
 
-    if(ptr > pmm_state.page_count * 4096)
+    uintmax_t index = block_to_page(zone, ptr);
+    if(index + pages > zone->page_count)
         return;
+
+    spin_lock(&pmm_state.lock);
+
+    /* Every page of the run must still be claimed, a free or block head page means the size is wrong */
+    if(run_is_claimed(zone, index, pages))
+        free_range(zone, index, pages);
+
+    spin_unlock(&pmm_state.lock);
+}
+
+/* A page of zeroes, normally straight off the pool idle harts fill */
+void* phys_alloc_zeroed(void)
+{
+    void* page = zeroed_pop();
+    if(page)
+        return page;
+
+    page = phys_alloc(PAGE_SIZE);
+    if(page)
+        page_zero(page);
+
+    return page;
+}
+
+/*
+ * Called from the idle loop. Zeroes one page into the pool and returns
+ * false once the pool is full or memory runs out, so the hart can sleep.
+ */
+bool phys_zero_idle(void)
+{
+    if(__atomic_load_n(&pmm_state.zeroed_count, __ATOMIC_RELAXED) >= PMM_ZEROED_TARGET)
+        return false;
+
+    pmm_block_t* page = alloc_pages(0);
+    if(!page)
+        return false;
+
+    page_zero(page);
+
+    spin_lock(&pmm_state.zeroed_lock);
+    page->next = pmm_state.zeroed;
+    pmm_state.zeroed = page;
+    pmm_state.zeroed_count++;
+    spin_unlock(&pmm_state.zeroed_lock);
+
+    return true;
+}
+
+void phys_print_cache_stats(void)
+{
+    for(int i = 0; i < pmm_state.cache_count; i++)
+    {
+        klog("PMM cache hart %d: %lu hits, %lu misses\n", i, pmm_state.caches[i].hits, pmm_state.caches[i].misses);
+    }
 }
 
 static void get_overlap(mem_region_t* out, mem_region_t* a, mem_region_t* b)
@@ -97,21 +962,20 @@ static void get_overlap(mem_region_t* out, mem_region_t* a, mem_region_t* b)
         out->size = 0;
 }
 
-static mem_region_t find_largest_gap(mem_region_t* available, int avail_count, mem_region_t* reserved, int reserved_count) 
+/* Collect every gap between reserved regions in all available regions */
+static int find_gaps(mem_region_t* available, int avail_count, mem_region_t* reserved, int reserved_count, mem_region_t* contained, mem_region_t* out, int out_max)
 {
-    mem_region_t best = {0};
-    uint64_t best_size = 0;
+    int found = 0;
 
-    for (int i = 0; i < avail_count; ++i) 
+    for (int i = 0; i < avail_count; ++i)
     {
         mem_region_t region = available[i];
 
         // Collect reserved regions that fall within this available block
-        // and sort them by base
-        mem_region_t contained[MEM_RESERVED_MAX];
+        // and sort them by base, contained has room for all of them
         int count = 0;
 
-        for (int j = 0; j < reserved_count; ++j) 
+        for (int j = 0; j < reserved_count; ++j)
         {
             uint64_t r_start = reserved[j].base;
             uint64_t r_end = r_start + reserved[j].size;
@@ -125,11 +989,11 @@ static mem_region_t find_largest_gap(mem_region_t* available, int avail_count, m
         }
 
         // Sort by base
-        for (int x = 0; x < count - 1; ++x) 
+        for (int x = 0; x < count - 1; ++x)
         {
-            for (int y = x + 1; y < count; ++y) 
+            for (int y = x + 1; y < count; ++y)
             {
-                if (contained[x].base > contained[y].base) 
+                if (contained[x].base > contained[y].base)
                 {
                     mem_region_t tmp = contained[x];
                     contained[x] = contained[y];
@@ -141,24 +1005,20 @@ static mem_region_t find_largest_gap(mem_region_t* available, int avail_count, m
         // Now scan gaps between reservations
         uint64_t last = region.base;
 
-        for (int k = 0; k <= count; ++k) 
+        for (int k = 0; k <= count; ++k)
         {
             uint64_t next = (k == count)
                 ? (region.base + region.size)
                 : contained[k].base;
 
-            if (next > last) 
+            if (next > last && found < out_max)
             {
-                uint64_t gap_size = next - last;
-                if (gap_size > best_size) 
-                {
-                    best.base = last;
-                    best.size = gap_size;
-                    best_size = gap_size;
-                }
+                out[found].base = last;
+                out[found].size = next - last;
+                found++;
             }
 
-            if (k < count) 
+            if (k < count)
             {
                 uint64_t r_end = contained[k].base + contained[k].size;
                 if (r_end > last)
@@ -167,5 +1027,5 @@ static mem_region_t find_largest_gap(mem_region_t* available, int avail_count, m
         }
     }
 
-    return best;
-}
\ No newline at end of file
+    return found;
+}
@@ -6,24 +6,96 @@
 #include <stddef.h>
 
 #include "../bootinfo.h"
+#include "../cpu/hart.h"
+#include "../cpu/spinlock.h"
 
 #define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
 
 #define ALIGN_DOWN(addr, align) ((addr) & ~((align) - 1))
 #define ALIGN_UP(addr, align)   (((addr) + (align) - 1) & ~((align) - 1))
 #define IS_ALIGNED(addr, align) (((addr) & ((align) - 1)) == 0)
 
+/*
+ * Largest buddy block is 2^PMM_MAX_ORDER pages (256 KiB). The order of a
+ * block head is kept in 3 bits of the page's metadata nibble, see physical.c.
+ */
+#define PMM_MAX_ORDER 6
+#define PMM_ORDER_COUNT (PMM_MAX_ORDER + 1)
+
+/*
+ * Every hart keeps a magazine of free order-0 pages in front of the global
+ * pool, refilled and drained PMM_CACHE_BATCH pages at a time.
+ */
+#define PMM_CACHE_SIZE 64
+#define PMM_CACHE_BATCH 32
+
+/* Pages idle harts keep zeroed ahead of time for phys_alloc_zeroed */
+#define PMM_ZEROED_TARGET 256
+
+typedef struct pmm_block
+{
+    struct pmm_block* next;
+    struct pmm_block* prev;
+}
+pmm_block_t;
+
+typedef struct
+{
+    void* pages[PMM_CACHE_SIZE];
+    int count;
+    uint64_t hits;
+    uint64_t misses;
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) pmm_cache_t;
+
 typedef struct
 {
     mem_region_t metadata;
     mem_region_t usable;
     size_t page_count;
+    size_t free_pages;
+    pmm_block_t* free_lists[PMM_ORDER_COUNT];
+}
+pmm_zone_t;
+
+typedef struct
+{
+    spinlock_t lock;
+    bool ready;  // Free lists are built, reservations must unlink blocks
+
+    /*
+     * Every gap between reserved regions becomes a zone with its own
+     * metadata. Sorted by base address, in the early arena.
+     */
+    pmm_zone_t* zones;
+    int zone_count;
+
+    pmm_cache_t* caches;
+    int cache_count;
+
+    /* Zeroed order-0 pages, linked through their first word */
+    spinlock_t zeroed_lock;
+    pmm_block_t* zeroed;
+    size_t zeroed_count;
 }
 pmm_state_t;
 
 bool phys_init(boot_info_t* info);
 void phys_reserve(void* ptr, size_t size);
+/* Blocks of 2^k pages, aligned to their size in physical memory */
 void* phys_alloc(size_t size);
 void phys_free(void* ptr);
 
-#endif // PHYSICAL_H
\ No newline at end of file
+/*
+ * Runs of pages that need not be a power of two, e.g. DMA buffers or huge
+ * page backing. align is in bytes and must be a power of two.
+ */
+void* phys_alloc_contiguous(size_t pages, size_t align);
+void phys_free_contiguous(void* ptr, size_t pages);
+void phys_print_cache_stats(void);
+
+void* phys_alloc_zeroed(void);
+bool phys_zero_idle(void);
+
+#endif // PHYSICAL_H
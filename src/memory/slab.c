@@ -0,0 +1,280 @@
+#include "slab.h"
+#include "physical.h"
+
+static int slab_harts = 1;
+
+bool slab_init(boot_info_t* info)
+{
+    slab_harts = info->core_count > 0 ? info->core_count : 1;
+    return true;
+}
+
+static inline slab_t* object_slab(slab_cache_t* cache, void* object)
+{
+    return (slab_t*)ALIGN_DOWN((uintptr_t)object, cache->slab_size);
+}
+
+static inline void** object_link(slab_cache_t* cache, void* object)
+{
+    return (void**)((uintptr_t)object + cache->free_offset);
+}
+
+static inline void* free_pop(slab_cache_t* cache, slab_t* slab)
+{
+    void* object = slab->free;
+    slab->free = *object_link(cache, object);
+    return object;
+}
+
+static inline void free_push(slab_cache_t* cache, slab_t* slab, void* object)
+{
+    *object_link(cache, object) = slab->free;
+    slab->free = object;
+}
+
+slab_cache_t* slab_cache_create(const char* name, size_t size, uint32_t flags, void (*ctor)(void* object))
+{
+    /* Cache-line sized objects don't share lines, small ones pack at 16 bytes */
+    size = size < 8 ? 8 : size;
+    size = size > CACHE_LINE_SIZE / 2 ? ALIGN_UP(size, CACHE_LINE_SIZE) : ALIGN_UP(size, 16);
+
+    size_t header = ALIGN_UP(sizeof(slab_t), CACHE_LINE_SIZE);
+
+    int order = 0;
+    while(order < PMM_MAX_ORDER && ((PAGE_SIZE << order) - header) / size < SLAB_MIN_OBJECTS)
+        order++;
+
+    size_t slab_size = PAGE_SIZE << order;
+    if(slab_size < header + size)
+        return 0;
+
+    slab_cache_t* cache = phys_alloc(sizeof(slab_cache_t));
+    slab_magazine_t* magazines = phys_alloc(slab_harts * sizeof(slab_magazine_t));
+
+    if(!cache || !magazines)
+    {
+        if(cache)
+            phys_free(cache);
+        if(magazines)
+            phys_free(magazines);
+        return 0;
+    }
+
+    cache->name = name;
+    cache->size = size;
+    cache->slab_size = slab_size;
+    cache->per_slab = (slab_size - header) / size;
+    cache->flags = flags;
+    cache->free_offset = flags & SLAB_TYPESAFE ? size - sizeof(void*) : 0;
+    cache->ctor = ctor;
+
+    cache->color = 0;
+    cache->color_max = (slab_size - header - cache->per_slab * size) / CACHE_LINE_SIZE;
+
+    cache->lock.locked = 0;
+    cache->partial = 0;
+    cache->empty = 0;
+    cache->slab_count = 0;
+
+    cache->magazines = magazines;
+    cache->magazine_count = slab_harts;
+
+    for(int i = 0; i < slab_harts; i++)
+        magazines[i].count = 0;
+
+    return cache;
+}
+
+static void partial_push(slab_cache_t* cache, slab_t* slab)
+{
+    slab->prev = 0;
+    slab->next = cache->partial;
+    if(cache->partial)
+        cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static void partial_remove(slab_cache_t* cache, slab_t* slab)
+{
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+
+    if(slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/* Carve a fresh slab, cache->lock must be held */
+static slab_t* slab_grow(slab_cache_t* cache)
+{
+    slab_t* slab = phys_alloc(cache->slab_size);
+    if(!slab)
+        return 0;
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = 0;
+
+    /*
+     * Colouring: shift the objects of each new slab by another cache line,
+     * so the first objects of different slabs don't all compete for the
+     * same cache sets.
+     */
+    uintptr_t first = (uintptr_t)slab + ALIGN_UP(sizeof(slab_t), CACHE_LINE_SIZE) + cache->color * CACHE_LINE_SIZE;
+    cache->color = cache->color < cache->color_max ? cache->color + 1 : 0;
+
+    for(uint32_t i = cache->per_slab; i > 0; i--)
+    {
+        void* object = (void*)(first + (i - 1) * cache->size);
+
+        if(cache->ctor)
+            cache->ctor(object);
+        free_push(cache, slab, object);
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+static void magazine_refill(slab_cache_t* cache, slab_magazine_t* magazine)
+{
+    spin_lock(&cache->lock);
+
+    while(magazine->count < SLAB_BATCH)
+    {
+        slab_t* slab = cache->partial;
+
+        if(!slab)
+        {
+            slab = cache->empty;
+            cache->empty = 0;
+
+            if(!slab)
+                slab = slab_grow(cache);
+            if(!slab)
+                break;
+
+            partial_push(cache, slab);
+        }
+
+        /* Take what this slab has, a full slab leaves the partial list */
+        while(slab->free && magazine->count < SLAB_BATCH)
+        {
+            slab->inuse++;
+            magazine->objects[magazine->count++] = free_pop(cache, slab);
+        }
+
+        if(!slab->free)
+            partial_remove(cache, slab);
+    }
+
+    spin_unlock(&cache->lock);
+}
+
+/* Put one object back into its slab, cache->lock must be held */
+static void slab_put(slab_cache_t* cache, void* object)
+{
+    slab_t* slab = object_slab(cache, object);
+
+    if(!slab->free)
+        partial_push(cache, slab);
+
+    free_push(cache, slab, object);
+    slab->inuse--;
+
+    if(slab->inuse > 0 || (cache->flags & SLAB_TYPESAFE))
+        return;
+
+    /* Keep one empty slab around so a free/alloc pair at the edge doesn't thrash */
+    partial_remove(cache, slab);
+
+    if(!cache->empty)
+    {
+        cache->empty = slab;
+        return;
+    }
+
+    cache->slab_count--;
+    phys_free(slab);
+}
+
+static void magazine_drain(slab_cache_t* cache, slab_magazine_t* magazine)
+{
+    spin_lock(&cache->lock);
+
+    while(magazine->count > SLAB_MAGAZINE_SIZE - SLAB_BATCH)
+        slab_put(cache, magazine->objects[--magazine->count]);
+
+    spin_unlock(&cache->lock);
+}
+
+static inline slab_magazine_t* current_magazine(slab_cache_t* cache)
+{
+    unsigned int hart = hart_current();
+
+    if(hart >= (unsigned int)cache->magazine_count)
+        return 0;
+
+    return &cache->magazines[hart];
+}
+
+void* slab_alloc(slab_cache_t* cache)
+{
+    slab_magazine_t* magazine = current_magazine(cache);
+
+    if(!magazine)
+    {
+        /* A hart without a magazine goes straight to the slabs */
+        spin_lock(&cache->lock);
+
+        slab_t* slab = cache->partial;
+        if(!slab && (slab = cache->empty ? cache->empty : slab_grow(cache)))
+        {
+            cache->empty = slab == cache->empty ? 0 : cache->empty;
+            partial_push(cache, slab);
+        }
+
+        void* object = 0;
+        if(slab)
+        {
+            object = free_pop(cache, slab);
+            slab->inuse++;
+
+            if(!slab->free)
+                partial_remove(cache, slab);
+        }
+
+        spin_unlock(&cache->lock);
+        return object;
+    }
+
+    if(magazine->count == 0)
+        magazine_refill(cache, magazine);
+
+    if(magazine->count == 0)
+        return 0;
+
+    return magazine->objects[--magazine->count];
+}
+
+void slab_free(slab_cache_t* cache, void* object)
+{
+    if(!object)
+        return;
+
+    slab_magazine_t* magazine = current_magazine(cache);
+
+    if(!magazine)
+    {
+        spin_lock(&cache->lock);
+        slab_put(cache, object);
+        spin_unlock(&cache->lock);
+        return;
+    }
+
+    if(magazine->count == SLAB_MAGAZINE_SIZE)
+        magazine_drain(cache, magazine);
+
+    magazine->objects[magazine->count++] = object;
+}
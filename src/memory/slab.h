@@ -0,0 +1,89 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../bootinfo.h"
+#include "../cpu/hart.h"
+#include "../cpu/spinlock.h"
+
+/*
+ * Every hart keeps a magazine of free objects per cache, refilled from
+ * and drained to the slabs SLAB_BATCH objects at a time.
+ */
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_BATCH 16
+
+/*
+ * Memory of a typesafe cache is never given back to the PMM, a freed
+ * object only ever becomes another object of the same cache. Needed for
+ * objects that stale pointers may still read, like cap targets. Free
+ * objects are linked through their last word so the header stale readers
+ * look at (the kobject generation, a lock) keeps its value.
+ */
+#define SLAB_TYPESAFE (1 << 0)
+
+/* A slab holds at least this many objects unless that needs too big a block */
+#define SLAB_MIN_OBJECTS 8
+
+/*
+ * Header at the start of every slab. Slabs come from phys_alloc, which
+ * aligns blocks to their size, so an object finds its slab by rounding
+ * its address down.
+ */
+typedef struct slab
+{
+    struct slab_cache* cache;
+    struct slab* next;         // Partial list
+    struct slab* prev;
+    void* free;                // Free objects, linked through the word at free_offset
+    uint32_t inuse;            // Objects handed out, including ones in magazines
+}
+slab_t;
+
+typedef struct
+{
+    void* objects[SLAB_MAGAZINE_SIZE];
+    int count;
+}
+__attribute__((aligned(CACHE_LINE_SIZE))) slab_magazine_t;
+
+typedef struct slab_cache
+{
+    const char* name;
+    size_t size;               // Object size after rounding
+    size_t slab_size;          // Bytes per slab, a power of two pages
+    uint32_t per_slab;
+    uint32_t flags;
+    size_t free_offset;        // Where a free object keeps its link
+    void (*ctor)(void* object);
+
+    /* First objects of successive slabs start this many cache lines further in */
+    uint32_t color;
+    uint32_t color_max;
+
+    spinlock_t lock;           // Per cache, only taken to refill or drain a magazine
+    slab_t* partial;           // Slabs with both free and used objects
+    slab_t* empty;             // At most one fully free slab kept back
+    size_t slab_count;
+
+    slab_magazine_t* magazines;
+    int magazine_count;
+}
+slab_cache_t;
+
+bool slab_init(boot_info_t* info);
+
+/*
+ * ctor, if given, runs once on every object when its slab is carved, not
+ * on each alloc. Typesafe caches use it for what stale readers rely on.
+ */
+slab_cache_t* slab_cache_create(const char* name, size_t size, uint32_t flags, void (*ctor)(void* object));
+
+/* The common path only touches the executing hart's magazine */
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(slab_cache_t* cache, void* object);
+
+#endif // SLAB_H
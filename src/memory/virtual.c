@@ -0,0 +1,278 @@
+#include "virtual.h"
+#include "physical.h"
+#include "../kernel/klog.h"
+#include "../cpu/csr.h"
+
+#define KERNEL_RAM_FLAGS  (PTE_R | PTE_W | PTE_X | PTE_G)
+#define KERNEL_MMIO_FLAGS (PTE_R | PTE_W | PTE_G)
+
+static vm_state_t vm_state;
+
+static inline void write_satp(uint64_t satp)
+{
+    csr_write(satp, satp);
+    sfence_vma();
+}
+
+static inline int pte_index(uintptr_t va, int level)
+{
+    return (va >> (PAGE_SHIFT + 9 * level)) & (PT_ENTRIES - 1);
+}
+
+/* PTE bits outside the PPN: V, permissions, A/D, RSW and the Svpbmt/Svnapot bits */
+#define PTE_ATTR_MASK (~(((1ULL << 44) - 1) << PTE_PPN_SHIFT))
+#define PTE_PERM_MASK (PTE_R | PTE_W | PTE_X | PTE_U | PTE_G)
+
+/* Whether the leaf at level already maps va to pa with the permissions in flags */
+static bool leaf_maps(pte_t leaf, int level, uintptr_t va, uintptr_t pa, uint64_t flags)
+{
+    uintptr_t offset = va & (VM_LEVEL_SIZE(level) - 1);
+    uintptr_t leaf_pa = (leaf >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+
+    return leaf_pa + offset == pa && (leaf & PTE_PERM_MASK) == (flags & PTE_PERM_MASK);
+}
+
+/* Replace the leaf in entry by a table of next-level leaves mapping the same range */
+static bool split_leaf(pte_t* entry, int level)
+{
+    pte_t* next = phys_alloc(PAGE_SIZE);
+    if(!next)
+        return false;
+
+    uintptr_t pa = (*entry >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+    pte_t attrs = *entry & PTE_ATTR_MASK;
+
+    for(int i = 0; i < PT_ENTRIES; i++)
+        next[i] = (((pa + i * VM_LEVEL_SIZE(level - 1)) >> PAGE_SHIFT) << PTE_PPN_SHIFT) | attrs;
+
+    *entry = (((uintptr_t)next >> PAGE_SHIFT) << PTE_PPN_SHIFT) | PTE_V;
+    return true;
+}
+
+bool vm_map(pte_t* root, uintptr_t va, uintptr_t pa, size_t size, uint64_t flags)
+{
+    if(!IS_ALIGNED(va | pa | size, PAGE_SIZE))
+        return false;
+
+    if(root == vm_state.root && vm_state.sealed)
+    {
+        klog("ERROR: Kernel mapping at 0x%lx after the first address space\n", va);
+        return false;
+    }
+
+    bool flush = false;
+
+    while(size > 0)
+    {
+        /* Biggest leaf that fits both alignment and what is left */
+        int level = VM_MAX_LEAF_LEVEL;
+        while(level > 0 && (!IS_ALIGNED(va | pa, VM_LEVEL_SIZE(level)) || size < VM_LEVEL_SIZE(level)))
+            level--;
+
+        pte_t* table = root;
+        int l = vm_state.levels - 1;
+
+        for(; l > level; l--)
+        {
+            pte_t* entry = &table[pte_index(va, l)];
+
+            if(!(*entry & PTE_V))
+            {
+                pte_t* next = phys_alloc_zeroed();
+                if(!next)
+                    return false;
+
+                *entry = (((uintptr_t)next >> PAGE_SHIFT) << PTE_PPN_SHIFT) | PTE_V;
+            }
+            else if(*entry & PTE_LEAF)
+            {
+                /* A bigger leaf already maps this the same way, skip what it covers */
+                if(leaf_maps(*entry, l, va, pa, flags))
+                    break;
+
+                if(!split_leaf(entry, l))
+                    return false;
+
+                flush = true;
+            }
+
+            table = pte_table(*entry);
+        }
+
+        size_t step;
+
+        if(l > level)
+        {
+            step = VM_LEVEL_SIZE(l) - (va & (VM_LEVEL_SIZE(l) - 1));
+            step = step < size ? step : size;
+        }
+        else
+        {
+            pte_t* entry = &table[pte_index(va, level)];
+
+            /* A table is already in place, map inside it instead of orphaning it */
+            while(level > 0 && (*entry & PTE_V) && !(*entry & PTE_LEAF))
+            {
+                table = pte_table(*entry);
+                level--;
+                entry = &table[pte_index(va, level)];
+            }
+
+            /* A and D are set up front, not all harts update them in hardware */
+            pte_t leaf = ((pa >> PAGE_SHIFT) << PTE_PPN_SHIFT) | flags | PTE_V | PTE_A | PTE_D;
+
+            if((*entry & PTE_V) && *entry != leaf)
+                flush = true;
+
+            *entry = leaf;
+            step = VM_LEVEL_SIZE(level);
+        }
+
+        va += step;
+        pa += step;
+        size -= step;
+    }
+
+    /* The hart may still hold a leaf that was split or overwritten */
+    if(flush)
+        sfence_vma();
+
+    return true;
+}
+
+bool vm_map_mmio(uintptr_t base, size_t size)
+{
+    uintptr_t start = ALIGN_DOWN(base, PAGE_SIZE);
+    uintptr_t end = ALIGN_UP(base + size, PAGE_SIZE);
+
+    return vm_map(vm_state.root, start, start, end - start, KERNEL_MMIO_FLAGS);
+}
+
+/*
+ * Build the kernel address space: an identity direct map of every memory
+ * region plus the syscon devices. Tables are built for Sv48, the first
+ * root entry doubles as the Sv39 root if the hart turns out not to have
+ * Sv48, see vm_activate.
+ */
+bool vm_init(boot_info_t* info)
+{
+    vm_state.levels = 4;
+    vm_state.mode = 0;
+    vm_state.sealed = false;
+    vm_state.root = phys_alloc_zeroed();
+
+    if(!vm_state.root)
+        return false;
+
+    for(int i = 0; i < info->memory_region_count; i++)
+    {
+        uintptr_t start = ALIGN_UP(info->memory_regions[i].base, PAGE_SIZE);
+        uintptr_t end = ALIGN_DOWN(info->memory_regions[i].base + info->memory_regions[i].size, PAGE_SIZE);
+
+        if(end <= start)
+            continue;
+
+        if(!vm_map(vm_state.root, start, start, end - start, KERNEL_RAM_FLAGS))
+            return false;
+    }
+
+    for(int i = 0; i < info->syscon_device_count; i++)
+    {
+        if(!vm_map_mmio(info->syscon_devices[i].base, info->syscon_devices[i].size))
+            return false;
+    }
+
+    // The console and the interrupt controller behind it
+    if(info->uart_base && !vm_map_mmio(info->uart_base, info->uart_size))
+        return false;
+
+    if(info->plic_base && !vm_map_mmio(info->plic_base, info->plic_size))
+        return false;
+
+    return true;
+}
+
+/*
+ * Switch the executing hart to the kernel tables. The first call probes
+ * for Sv48 by writing satp and reading it back, an unsupported mode
+ * leaves satp untouched.
+ */
+void vm_activate(void)
+{
+    if(vm_state.mode)
+    {
+        write_satp(vm_make_satp(vm_state.mode, 0, vm_state.root));
+        return;
+    }
+
+    write_satp(vm_make_satp(SATP_MODE_SV48, 0, vm_state.root));
+    if((csr_read(satp) >> SATP_MODE_SHIFT) == SATP_MODE_SV48)
+    {
+        vm_state.mode = SATP_MODE_SV48;
+        return;
+    }
+
+    /*
+     * Sv39: the table below the first Sv48 root entry maps the low 512 GiB,
+     * only its lower half is reachable without sign extension.
+     */
+    pte_t* sv48_root = vm_state.root;
+    if(!(sv48_root[0] & PTE_V) || (sv48_root[0] & PTE_LEAF))
+        return;
+
+    pte_t* sv39_root = pte_table(sv48_root[0]);
+    bool lost = false;
+
+    for(int i = 1; i < PT_ENTRIES; i++)
+        lost |= (sv48_root[i] & PTE_V) != 0;
+
+    for(int i = PT_ENTRIES / 2; i < PT_ENTRIES; i++)
+    {
+        lost |= (sv39_root[i] & PTE_V) != 0;
+        sv39_root[i] = 0;
+    }
+
+    if(lost)
+        klog("WARNING: Memory above 256 GiB is not mapped under Sv39\n");
+
+    vm_state.root = sv39_root;
+    vm_state.levels = 3;
+    vm_state.mode = SATP_MODE_SV39;
+    phys_free(sv48_root);
+
+    write_satp(vm_make_satp(vm_state.mode, 0, vm_state.root));
+}
+
+void vm_free_table(pte_t* table, int level)
+{
+    if(level > 0)
+    {
+        for(int i = 0; i < PT_ENTRIES; i++)
+        {
+            if((table[i] & PTE_V) && !(table[i] & PTE_LEAF))
+                vm_free_table(pte_table(table[i]), level - 1);
+        }
+    }
+
+    phys_free(table);
+}
+
+void vm_kernel_seal(void)
+{
+    vm_state.sealed = true;
+}
+
+pte_t* vm_kernel_root(void)
+{
+    return vm_state.root;
+}
+
+int vm_levels(void)
+{
+    return vm_state.levels;
+}
+
+uint64_t vm_satp_mode(void)
+{
+    return vm_state.mode;
+}
@@ -0,0 +1,85 @@
+#ifndef VIRTUAL_H
+#define VIRTUAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../bootinfo.h"
+
+#define PTE_V (1ULL << 0)
+#define PTE_R (1ULL << 1)
+#define PTE_W (1ULL << 2)
+#define PTE_X (1ULL << 3)
+#define PTE_U (1ULL << 4)
+#define PTE_G (1ULL << 5)
+#define PTE_A (1ULL << 6)
+#define PTE_D (1ULL << 7)
+
+#define PTE_PPN_SHIFT 10
+#define PTE_LEAF (PTE_R | PTE_W | PTE_X)
+
+#define SATP_MODE_SV39 8ULL
+#define SATP_MODE_SV48 9ULL
+#define SATP_MODE_SHIFT 60
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFULL
+
+#define PT_ENTRIES 512
+
+/* Size mapped by one entry at a given level, level 0 being 4 KiB pages */
+#define VM_LEVEL_SIZE(level) (1ULL << (12 + 9 * (level)))
+
+/* Largest leaf used by vm_map, 1 GiB gigapages */
+#define VM_MAX_LEAF_LEVEL 2
+
+typedef uint64_t pte_t;
+
+static inline uint64_t vm_make_satp(uint64_t mode, uint64_t asid, pte_t* root)
+{
+    return (mode << SATP_MODE_SHIFT) | (asid << SATP_ASID_SHIFT) | ((uintptr_t)root >> 12);
+}
+
+static inline pte_t* pte_table(pte_t entry)
+{
+    return (pte_t*)((entry >> PTE_PPN_SHIFT) << 12);
+}
+
+typedef struct
+{
+    pte_t* root;
+    int levels;        // 3 for Sv39, 4 for Sv48
+    uint64_t mode;     // SATP_MODE_*
+    bool sealed;       // Address spaces copied the root, it takes no new mappings
+}
+vm_state_t;
+
+bool vm_init(boot_info_t* info);
+void vm_activate(void);
+
+/*
+ * Map [va, va + size) to pa in the table rooted at root, using the largest
+ * leaf that alignment and size allow at each step. flags are PTE_* bits.
+ * Parts a bigger leaf already maps the same way are left alone, a bigger
+ * leaf mapping them differently is split. Existing tables are kept.
+ */
+bool vm_map(pte_t* root, uintptr_t va, uintptr_t pa, size_t size, uint64_t flags);
+
+/* Free a table and every table below it, but not the memory leaves point to */
+void vm_free_table(pte_t* table, int level);
+
+/* Map device registers into the kernel address space */
+bool vm_map_mmio(uintptr_t base, size_t size);
+
+/*
+ * Every address space holds copies of the kernel's top tables, made when
+ * it is created, so kernel mappings added later would not show up in it.
+ * The first aspace_create seals the kernel root, vm_map fails on it after.
+ */
+void vm_kernel_seal(void);
+
+pte_t* vm_kernel_root(void);
+int vm_levels(void);
+uint64_t vm_satp_mode(void);
+
+#endif // VIRTUAL_H